@@ -0,0 +1,12 @@
+#version 330 core
+// uv coord in variable
+in vec2 uv_coord;
+
+// the ray traced image, its first row the top one
+uniform sampler2D m_texture;
+
+out vec4 fragColor;
+
+void main() {
+    fragColor = vec4(texture(m_texture, vec2(uv_coord.x, 1.f - uv_coord.y)).rgb, 1.f);
+}
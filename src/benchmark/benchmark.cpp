@@ -0,0 +1,809 @@
+#include "raytracer/bvh.h"
+#include "raytracer/raytracer.h"
+#include "raytracer/raytracescene.h"
+#include "raytracer/threadpool.h"
+#include "raytracer/packet.h"
+#include "raytracer/texture.h"
+#include "raytracer/gbuffer.h"
+#include "raytracer/trianglemesh.h"
+#include "render/bandqueue.h"
+#include "utils/sceneparser.h"
+#include "glm/gtx/transform.hpp"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <algorithm>
+#include <bit>
+
+using namespace std;
+
+// Every heap allocation in the process goes through here so benchmarks can report allocations per operation
+static atomic<long long> allocationCount = 0;
+
+void* operator new(size_t size) {
+    allocationCount++;
+    if (void *memory = malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+    free(memory);
+}
+
+namespace {
+    // A randomly placed, rotated and scaled unit primitive inside a cube that grows with the primitive count
+    glm::mat4 randomCTM(int count, mt19937 &rng) {
+        uniform_real_distribution<float> unit(0.f, 1.f);
+        float extent = 2.f * cbrtf(float(count));
+        glm::vec3 position = extent * glm::vec3{unit(rng), unit(rng), unit(rng)};
+        glm::vec3 axis = glm::normalize(glm::vec3{unit(rng), unit(rng), unit(rng)} + 0.01f);
+        glm::vec3 scale = glm::vec3{0.2f, 0.2f, 0.2f} + glm::vec3{unit(rng), unit(rng), unit(rng)};
+        return glm::translate(position) * glm::rotate(6.28f * unit(rng), axis) * glm::scale(scale);
+    }
+
+    vector<AABB> randomScene(int count, mt19937 &rng) {
+        vector<AABB> bounds;
+        bounds.reserve(count);
+        for (int i = 0; i < count; i++) {
+            bounds.push_back(unitPrimitiveBounds(randomCTM(count, rng)));
+        }
+        return bounds;
+    }
+
+    // A scene of randomly placed implicit primitives with distinct materials, in random (not spatial) order
+    RenderData randomRenderData(int count, mt19937 &rng) {
+        const PrimitiveType types[] = {PrimitiveType::PRIMITIVE_CUBE, PrimitiveType::PRIMITIVE_CONE,
+                                       PrimitiveType::PRIMITIVE_CYLINDER, PrimitiveType::PRIMITIVE_SPHERE};
+        RenderData data;
+        data.globalData = SceneGlobalData{0.5f, 0.5f, 0.5f, 0.f};
+        data.cameraData.pos = {0.f, 0.f, 0.f, 1.f};
+        data.cameraData.look = {0.f, 0.f, -1.f, 0.f};
+        data.cameraData.up = {0.f, 1.f, 0.f, 0.f};
+        data.cameraData.heightAngle = 0.5f;
+        for (int i = 0; i < count; i++) {
+            RenderShapeData shape;
+            shape.primitive.type = types[i % 4];
+            shape.primitive.material.cDiffuse = glm::vec4{float(i % 256) / 255.f, 0.5f, 0.5f, 1.f};
+            shape.primitive.material.textureMap.filename = "texture" + to_string(i) + ".png";
+            shape.ctm = randomCTM(count, rng);
+            data.shapes.push_back(shape);
+        }
+        return data;
+    }
+
+    // Measures how many primitive intersection tests a closest-hit query needs through the BVH
+    // compared to testing every primitive, for random scenes of unit primitives of growing size.
+    // A primitive's own bounding box stands in for its exact intersector here.
+    void benchmarkBVH() {
+        const int rayCount = 20000;
+        printf("%10s %12s %12s %10s %12s %12s\n", "primitives", "brute/ray", "bvh/ray", "log2(n)", "build (ms)", "ns/ray");
+        for (int count : {100, 1000, 10000, 100000}) {
+            mt19937 rng(1230);
+            vector<AABB> bounds = randomScene(count, rng);
+
+            auto buildStart = chrono::steady_clock::now();
+            BVH bvh;
+            bvh.build(bounds);
+            auto buildEnd = chrono::steady_clock::now();
+
+            AABB sceneBounds = bvh.getNodes()[0].bounds;
+            uniform_real_distribution<float> unit(0.f, 1.f);
+            long long tests = 0;
+            auto traceStart = chrono::steady_clock::now();
+            for (int r = 0; r < rayCount; r++) {
+                glm::vec3 origin = sceneBounds.min + glm::vec3{unit(rng), unit(rng), unit(rng)} * (sceneBounds.max - sceneBounds.min);
+                glm::vec3 direction = glm::normalize(glm::vec3{unit(rng), unit(rng), unit(rng)} - 0.5f);
+                glm::vec3 inverseDirection = 1.f / direction;
+                float tMax = INFINITY;
+                bvh.traverse(origin, direction, tMax, [&](int index) {
+                    tests++;
+                    float tNear;
+                    if (bounds[index].intersect(origin, inverseDirection, tMax, tNear) && tNear > 0) {
+                        tMax = tNear;
+                    }
+                    return false;
+                });
+            }
+            auto traceEnd = chrono::steady_clock::now();
+
+            double buildMs = chrono::duration<double, milli>(buildEnd - buildStart).count();
+            double nsPerRay = chrono::duration<double, nano>(traceEnd - traceStart).count() / rayCount;
+            printf("%10d %12d %12.1f %10.1f %12.2f %12.1f\n", count, count, double(tests) / rayCount, log2(double(count)), buildMs, nsPerRay);
+        }
+    }
+
+    // Times closest-hit queries against a large scene, by brute force (which streams through every
+    // primitive's intersection data) and through the BVH. Run under `perf stat -e cache-misses` to
+    // see the traversal's cache behaviour.
+    void benchmarkPrimitiveLayout(int count) {
+        mt19937 rng(1230);
+        RenderData data = randomRenderData(count, rng);
+        RayTraceScene scene{64, 64, data};
+        AABB sceneBounds = scene.getBVH().getNodes()[0].bounds;
+        uniform_real_distribution<float> unit(0.f, 1.f);
+        vector<RayTracer::Ray> rays(20000);
+        for (RayTracer::Ray &ray : rays) {
+            glm::vec3 origin = sceneBounds.min + glm::vec3{unit(rng), unit(rng), unit(rng)} * (sceneBounds.max - sceneBounds.min);
+            glm::vec3 direction = glm::normalize(glm::vec3{unit(rng), unit(rng), unit(rng)} - 0.5f);
+            ray = {glm::vec4{origin, 1.f}, glm::vec4{direction, 0.f}};
+        }
+
+        printf("\n%d primitives: %zu bytes of shape data per primitive, %d read while testing it\n",
+               count, sizeof(RenderShapeData) + sizeof(ShapeCache), int(sizeof(uint8_t) + sizeof(glm::mat4x3) + sizeof(int)));
+        printf("%-24s %12s %10s\n", "closest hit", "ns/ray", "hits");
+        for (bool accelerated : {false, true}) {
+            RayTracer::Config config{};
+            config.enableAcceleration = accelerated;
+            RayTracer raytracer{config};
+            int rayCount = accelerated ? int(rays.size()) : 200;
+            int hits = 0;
+            auto start = chrono::steady_clock::now();
+            for (int r = 0; r < rayCount; r++) {
+                float tHit;
+                glm::vec3 normal;
+                RayTracer::Ray objectRay;
+                hits += raytracer.closestHit(rays[r], scene, tHit, normal, objectRay) != -1;
+            }
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / rayCount;
+            printf("%-24s %12.1f %10d\n", accelerated ? "bvh" : "brute force", ns, hits);
+        }
+    }
+
+    // A unit-diameter sphere tessellated into 2 * resolution^2 triangles, with smooth vertex normals
+    objl::Mesh sphereMesh(int resolution) {
+        objl::Mesh mesh;
+        for (int i = 0; i <= resolution; i++) {
+            for (int j = 0; j <= resolution; j++) {
+                float theta = float(M_PI) * i / resolution, phi = 2.f * float(M_PI) * (j % resolution) / resolution;
+                glm::vec3 position = 0.5f * glm::vec3{sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi)};
+                objl::Vertex vertex;
+                vertex.Position = objl::Vector3(position.x, position.y, position.z);
+                vertex.Normal = objl::Vector3(2.f * position.x, 2.f * position.y, 2.f * position.z);
+                mesh.Vertices.push_back(vertex);
+            }
+        }
+        for (int i = 0; i < resolution; i++) {
+            for (int j = 0; j < resolution; j++) {
+                unsigned int a = i * (resolution + 1) + j, b = a + resolution + 1;
+                mesh.Indices.insert(mesh.Indices.end(), {a, b, b + 1, a, b + 1, a + 1});
+            }
+        }
+        return mesh;
+    }
+
+    // Builds and traces tessellated spheres of growing size through their bottom-level BVH
+    void benchmarkMeshes() {
+        const int rayCount = 100000;
+        printf("\n%10s %12s %12s %10s\n", "triangles", "build (ms)", "ns/ray", "hit rate");
+        for (int resolution : {70, 224, 708}) {
+            objl::Mesh sphere = sphereMesh(resolution);
+            auto buildStart = chrono::steady_clock::now();
+            TriangleMesh mesh(sphere.Vertices, sphere.Indices);
+            double buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - buildStart).count();
+
+            mt19937 rng(1230);
+            uniform_real_distribution<float> unit(-1.f, 1.f);
+            vector<RayTracer::Ray> rays(rayCount);
+            for (RayTracer::Ray &ray : rays) {
+                ray = {{unit(rng), unit(rng), 2.f, 1.f}, {0.2f * unit(rng), 0.2f * unit(rng), -1.f, 0.f}};
+            }
+            int hits = 0;
+            auto traceStart = chrono::steady_clock::now();
+            for (const RayTracer::Ray &ray : rays) {
+                RayTracer::Hit hit;
+                hits += mesh.intersect(ray, INFINITY, hit);
+            }
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - traceStart).count() / rayCount;
+            printf("%10d %12.1f %12.1f %10.2f\n", mesh.triangleCount(), buildMs, ns, double(hits) / rayCount);
+        }
+    }
+
+    // Renders a scene file with 1 to N worker threads and checks every image against the single-threaded one
+    void benchmarkRenderScaling(const string &sceneFile, int width, int height) {
+        RenderData metaData;
+        if (SceneParser::parse(sceneFile, metaData) != 0) {
+            printf("Could not load %s\n", sceneFile.c_str());
+            return;
+        }
+        RayTraceScene scene{width, height, metaData};
+        vector<RGBA> reference;
+        double serialSeconds = 0;
+        printf("\n%s at %dx%d\n", sceneFile.c_str(), width, height);
+        printf("%10s %12s %10s %10s\n", "threads", "time (ms)", "speedup", "identical");
+        int maxThreads = ThreadPool::shared().threadCount();
+        for (int threads = 1; threads <= maxThreads; threads = (threads == maxThreads) ? threads + 1 : min(2 * threads, maxThreads)) {
+            RayTracer::Config config{};
+            config.enableAcceleration = true;
+            config.enableParallelism = true;
+            config.threadCount = threads;
+            RayTracer raytracer{config};
+            vector<RGBA> image(width * height);
+
+            auto start = chrono::steady_clock::now();
+            raytracer.render(image.data(), scene);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            if (threads == 1) {
+                reference = image;
+                serialSeconds = seconds;
+            }
+            bool identical = equal(image.begin(), image.end(), reference.begin(), [](const RGBA &a, const RGBA &b) {
+                return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+            });
+            printf("%10d %12.1f %10.2f %10s\n", threads, 1000 * seconds, serialSeconds / seconds, identical ? "yes" : "NO");
+        }
+    }
+
+    // One row of the kernel suite. raysPerSecond is 0 for kernels that trace no rays.
+    struct KernelResult {
+        string name;
+        double nsPerOp;
+        double raysPerSecond;
+        double allocationsPerOp;
+    };
+
+    // Runs op(i) for i in [0, iterations) after a short warm-up, timing it and counting heap allocations.
+    // raysPerOp is how many rays each call traces.
+    template <typename Op>
+    KernelResult timeKernel(const string &name, int iterations, double raysPerOp, Op op) {
+        for (int i = 0; i < max(1, iterations / 10); i++) {
+            op(i);
+        }
+        long long allocationsBefore = allocationCount;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            op(i);
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / iterations;
+        double allocations = double(allocationCount - allocationsBefore) / iterations;
+        KernelResult result{name, ns, raysPerOp > 0 ? 1e9 * raysPerOp / ns : 0.0, allocations};
+        printf("%-40s %12.1f %14.0f %12.3f\n", name.c_str(), result.nsPerOp, result.raysPerSecond, result.allocationsPerOp);
+        return result;
+    }
+
+    // Keeps the compiler from discarding the results of benchmarked calls
+    volatile int benchmarkSink;
+
+    void benchmarkIntersectors(vector<KernelResult> &results) {
+        const int iterations = 2000000;
+        RayTracer::Ray hitRay{{0.1f, 0.05f, 3.f, 1.f}, {0.f, 0.f, -1.f, 0.f}};
+        RayTracer::Ray missRay{{2.f, 2.f, 3.f, 1.f}, {0.f, 0.f, -1.f, 0.f}};
+        struct Intersector {
+            const char *name;
+            bool (*intersect)(const RayTracer::Ray &, RayTracer::Hit &);
+            bool (*occluded)(const RayTracer::Ray &, float);
+        };
+        const Intersector intersectors[] = {{"cube", RayTracer::cubeIntersect, RayTracer::cubeOccluded},
+                                            {"cone", RayTracer::coneIntersect, RayTracer::coneOccluded},
+                                            {"cylinder", RayTracer::cylinderIntersect, RayTracer::cylinderOccluded},
+                                            {"sphere", RayTracer::sphereIntersect, RayTracer::sphereOccluded}};
+        for (const Intersector &intersector : intersectors) {
+            for (bool hits : {true, false}) {
+                const RayTracer::Ray &ray = hits ? hitRay : missRay;
+                string name = string(intersector.name) + (hits ? " (hit)" : " (miss)");
+                results.push_back(timeKernel(name, iterations, 1, [&](int) {
+                    RayTracer::Hit hit;
+                    benchmarkSink = intersector.intersect(ray, hit);
+                }));
+                results.push_back(timeKernel(string(intersector.name) + " occluded" + (hits ? " (hit)" : " (miss)"), iterations, 1, [&](int) {
+                    benchmarkSink = intersector.occluded(ray, INFINITY);
+                }));
+            }
+        }
+    }
+
+    // Solves a table of quadratics with two, one and no real roots
+    void benchmarkQuadraticEquation(vector<KernelResult> &results) {
+        mt19937 rng(1230);
+        uniform_real_distribution<float> unit(-1.f, 1.f);
+        vector<glm::vec3> coefficients(1024);
+        for (glm::vec3 &c : coefficients) {
+            c = {1.f + unit(rng) * 0.5f, unit(rng), unit(rng)};
+        }
+        results.push_back(timeKernel("quadraticEquation", 4000000, 0, [&](int i) {
+            const glm::vec3 &c = coefficients[i & 1023];
+            float roots[2];
+            benchmarkSink = RayTracer::quadraticEquation(c.x, c.y, c.z, roots);
+        }));
+    }
+
+    // Shades points inside a scene of 200 shapes lit by 1, 8 and 64 point lights, shadow rays included
+    void benchmarkPhong(vector<KernelResult> &results) {
+        mt19937 rng(1230);
+        uniform_real_distribution<float> unit(0.f, 1.f);
+        RenderData data = randomRenderData(200, rng);
+        for (int lightCount : {1, 8, 64}) {
+            data.lights.clear();
+            for (int l = 0; l < lightCount; l++) {
+                SceneLightData light{};
+                light.type = LightType::LIGHT_POINT;
+                light.color = {1.f / lightCount, 1.f / lightCount, 1.f / lightCount, 1.f};
+                light.function = {1.f, 0.f, 0.f};
+                light.pos = {12.f * unit(rng), 15.f, 12.f * unit(rng), 1.f};
+                data.lights.push_back(light);
+            }
+            RayTraceScene scene{64, 64, data};
+            RayTracer::Config config{};
+            config.enableAcceleration = true;
+            config.enableLightCulling = true;
+            RayTracer raytracer{config};
+            const SceneMaterial &material = data.shapes[0].primitive.material;
+            vector<glm::vec3> points(256);
+            for (glm::vec3 &point : points) {
+                point = 12.f * glm::vec3{unit(rng), unit(rng), unit(rng)};
+            }
+            results.push_back(timeKernel("phong, " + to_string(lightCount) + " light" + (lightCount > 1 ? "s" : ""), 200000 / lightCount, lightCount, [&](int i) {
+                const glm::vec3 &point = points[i & 255];
+                glm::vec3 color = raytracer.phong(point, {0.f, 1.f, 0.f}, glm::normalize(glm::vec3{0.f, 15.f, 0.f} - point), material, scene.getLights(),
+                                                  scene.getGlobalData(), scene, true, RGBA{0, 0, 0});
+                benchmarkSink = int(color.r * 255.f);
+            }));
+        }
+    }
+
+    // Looks up a 1024x1024 texture around a sphere, nearest and filtered
+    void benchmarkMapTexture(vector<KernelResult> &results) {
+        const int size = 1024;
+        vector<RGBA> pixels(size * size);
+        for (int i = 0; i < size * size; i++) {
+            pixels[i] = RGBA{uint8_t(i), uint8_t(i >> 8), uint8_t(i >> 16)};
+        }
+        Texture texture(pixels, size, size);
+        RenderShapeData shape;
+        shape.primitive.type = PrimitiveType::PRIMITIVE_SPHERE;
+        shape.primitive.material.textureMap.repeatU = 1.f;
+        shape.primitive.material.textureMap.repeatV = 1.f;
+        mt19937 rng(1230);
+        normal_distribution<float> gaussian;
+        vector<glm::vec3> points(1024);
+        for (glm::vec3 &point : points) {
+            point = 0.5f * glm::normalize(glm::vec3{gaussian(rng), gaussian(rng), gaussian(rng)});
+        }
+        for (bool filtered : {false, true}) {
+            RayTracer::Config config{};
+            config.enableTextureFilter = filtered;
+            RayTracer raytracer{config};
+            results.push_back(timeKernel(filtered ? "mapTexture (trilinear)" : "mapTexture (nearest)", 2000000, 0, [&](int i) {
+                const glm::vec3 &point = points[i & 1023];
+                benchmarkSink = raytracer.mapTexture(point, 2.f * point, shape, texture, 2.5f).r;
+            }));
+        }
+    }
+
+    // Renders a whole scene file on every thread; an op is one frame
+    void benchmarkSceneRender(vector<KernelResult> &results, const string &sceneFile, int width, int height) {
+        RenderData metaData;
+        if (SceneParser::parse(sceneFile, metaData) != 0) {
+            printf("Could not load %s\n", sceneFile.c_str());
+            return;
+        }
+        RayTraceScene scene{width, height, metaData};
+        RayTracer::Config config{};
+        config.enableAcceleration = true;
+        config.enableParallelism = true;
+        RayTracer raytracer{config};
+        vector<RGBA> image(width * height);
+        string name = "render " + sceneFile + " " + to_string(width) + "x" + to_string(height);
+        results.push_back(timeKernel(name, 5, double(width) * height, [&](int) {
+            raytracer.render(image.data(), scene);
+        }));
+    }
+
+    // The kernels the ray tracer spends its time in, each timed on its own
+    vector<KernelResult> benchmarkKernels(const vector<string> &sceneFiles) {
+        vector<KernelResult> results;
+        printf("%-40s %12s %14s %12s\n", "kernel", "ns/op", "rays/s", "allocs/op");
+        benchmarkIntersectors(results);
+        benchmarkQuadraticEquation(results);
+        benchmarkPhong(results);
+        benchmarkMapTexture(results);
+        for (const string &sceneFile : sceneFiles) {
+            benchmarkSceneRender(results, sceneFile, 400, 300);
+        }
+        return results;
+    }
+
+    // Baselines are plain text, one kernel per line: name, ns/op, rays/s and allocs/op separated by tabs
+    bool saveKernelResults(const string &path, const vector<KernelResult> &results) {
+        FILE *file = fopen(path.c_str(), "w");
+        if (file == nullptr) {
+            printf("Could not write %s\n", path.c_str());
+            return false;
+        }
+        for (const KernelResult &result : results) {
+            fprintf(file, "%s\t%.3f\t%.1f\t%.4f\n", result.name.c_str(), result.nsPerOp, result.raysPerSecond, result.allocationsPerOp);
+        }
+        fclose(file);
+        return true;
+    }
+
+    bool loadKernelResults(const string &path, vector<KernelResult> &results) {
+        FILE *file = fopen(path.c_str(), "r");
+        if (file == nullptr) {
+            printf("Could not read %s\n", path.c_str());
+            return false;
+        }
+        char line[512];
+        while (fgets(line, sizeof(line), file) != nullptr) {
+            char *tab = strchr(line, '\t');
+            if (tab == nullptr) {
+                continue;
+            }
+            KernelResult result;
+            result.name = string(line, tab);
+            if (sscanf(tab + 1, "%lf\t%lf\t%lf", &result.nsPerOp, &result.raysPerSecond, &result.allocationsPerOp) == 3) {
+                results.push_back(result);
+            }
+        }
+        fclose(file);
+        return true;
+    }
+
+    // Prints every kernel against its baseline and returns how many got slower by more than tolerance
+    // (a fraction of the baseline time) or started allocating more
+    int compareKernelResults(const vector<KernelResult> &results, const vector<KernelResult> &baseline, double tolerance) {
+        printf("\n%-40s %12s %12s %9s %12s\n", "kernel", "base ns/op", "ns/op", "change", "allocs/op");
+        int regressions = 0;
+        for (const KernelResult &result : results) {
+            auto found = find_if(baseline.begin(), baseline.end(), [&](const KernelResult &b) { return b.name == result.name; });
+            if (found == baseline.end()) {
+                printf("%-40s %12s %12.1f %9s %12.3f\n", result.name.c_str(), "-", result.nsPerOp, "new", result.allocationsPerOp);
+                continue;
+            }
+            double change = result.nsPerOp / found->nsPerOp - 1.0;
+            bool slower = change > tolerance;
+            bool allocates = result.allocationsPerOp > found->allocationsPerOp + 0.001;
+            regressions += slower || allocates;
+            printf("%-40s %12.1f %12.1f %+8.1f%% %12.3f%s\n", result.name.c_str(), found->nsPerOp, result.nsPerOp, 100.0 * change,
+                   result.allocationsPerOp, slower ? "  SLOWER" : allocates ? "  MORE ALLOCATIONS" : "");
+        }
+        printf("%d regression%s beyond %.0f%%\n", regressions, regressions == 1 ? "" : "s", 100.0 * tolerance);
+        return regressions;
+    }
+
+    // Compares the scalar intersectors, one ray at a time, with every packet width the CPU supports,
+    // on a packet of coherent object-space rays (a fan of eight, half of which hit)
+    void benchmarkPacketIntersectors() {
+        const int iterations = 500000;
+        RayPacket rays;
+        for (int k = 0; k < RayPacket::size; k++) {
+            rays.originX[k] = -0.7f + 0.2f * k;
+            rays.originY[k] = 0.05f;
+            rays.originZ[k] = 3.f;
+            rays.directionX[k] = 0.f;
+            rays.directionY[k] = 0.f;
+            rays.directionZ[k] = -1.f;
+        }
+        struct Primitive {
+            const char *name;
+            bool (*scalar)(const RayTracer::Ray &, RayTracer::Hit &);
+            int (*PacketIntersectors::*packet)(const RayPacket &, PacketHit &);
+        };
+        const Primitive primitives[] = {{"cube", RayTracer::cubeIntersect, &PacketIntersectors::cube},
+                                        {"cone", RayTracer::coneIntersect, &PacketIntersectors::cone},
+                                        {"cylinder", RayTracer::cylinderIntersect, &PacketIntersectors::cylinder},
+                                        {"sphere", RayTracer::sphereIntersect, &PacketIntersectors::sphere}};
+        vector<const PacketIntersectors*> widths = {&packetIntersectors(1)};
+        for (int width : {4, 8}) {
+            if (packetIntersectors(width).width == width) {
+                widths.push_back(&packetIntersectors(width));
+            }
+        }
+
+        printf("\n%-12s %14s", "Mrays/s", "scalar");
+        for (const PacketIntersectors *intersectors : widths) {
+            printf(" %9s x%d", "packet", intersectors->width);
+        }
+        printf("\n");
+        for (const Primitive &primitive : primitives) {
+            printf("%-12s", primitive.name);
+            int hits = 0;
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                for (int k = 0; k < RayPacket::size; k++) {
+                    RayTracer::Ray ray{{rays.originX[k], rays.originY[k], rays.originZ[k], 1.f}, {rays.directionX[k], rays.directionY[k], rays.directionZ[k], 0.f}};
+                    RayTracer::Hit hit;
+                    hits += primitive.scalar(ray, hit);
+                }
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            printf(" %14.1f", 1e-6 * iterations * RayPacket::size / seconds);
+
+            for (const PacketIntersectors *intersectors : widths) {
+                int packetHits = 0;
+                start = chrono::steady_clock::now();
+                for (int i = 0; i < iterations; i++) {
+                    PacketHit hit;
+                    fill(begin(hit.t), end(hit.t), INFINITY);
+                    packetHits += popcount(unsigned((intersectors->*primitive.packet)(rays, hit)));
+                }
+                seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                printf(" %12.1f", 1e-6 * iterations * RayPacket::size / seconds);
+                if (packetHits != hits) {
+                    printf(" (hit counts differ!)");
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    // Renders a scene on one thread with every packet width the CPU supports, checking the images match the scalar one
+    void benchmarkPacketRender(const string &sceneFile, int width, int height) {
+        RenderData metaData;
+        if (SceneParser::parse(sceneFile, metaData) != 0) {
+            printf("Could not load %s\n", sceneFile.c_str());
+            return;
+        }
+        RayTraceScene scene{width, height, metaData};
+        vector<RGBA> reference;
+        printf("\n%s at %dx%d, one thread\n", sceneFile.c_str(), width, height);
+        printf("%10s %12s %16s %10s\n", "simd", "time (ms)", "primary Mrays/s", "identical");
+        for (int simdWidth : {1, 4, 8}) {
+            if (packetIntersectors(simdWidth).width != simdWidth) {
+                continue;
+            }
+            RayTracer::Config config{};
+            config.enableAcceleration = true;
+            config.simdWidth = simdWidth;
+            RayTracer raytracer{config};
+            vector<RGBA> image(width * height);
+
+            auto start = chrono::steady_clock::now();
+            raytracer.render(image.data(), scene);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            if (simdWidth == 1) {
+                reference = image;
+            }
+            bool identical = equal(image.begin(), image.end(), reference.begin(), [](const RGBA &a, const RGBA &b) {
+                return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+            });
+            printf("%10d %12.1f %16.2f %10s\n", simdWidth, 1000 * seconds, 1e-6 * width * height / seconds, identical ? "yes" : "NO");
+        }
+    }
+
+    // Traces every primary ray of a scene twice and counts heap allocations during the second,
+    // steady-state pass. Shadow and reflection rays spawned by shading are included.
+    void benchmarkTraceRayAllocations(const string &sceneFile, int width, int height) {
+        RenderData metaData;
+        if (SceneParser::parse(sceneFile, metaData) != 0) {
+            printf("Could not load %s\n", sceneFile.c_str());
+            return;
+        }
+        RayTraceScene scene{width, height, metaData};
+        RayTracer::Config config{};
+        config.enableAcceleration = true;
+        RayTracer raytracer{config};
+        glm::mat4 inverse = glm::inverse(scene.getCamera().getViewMatrix());
+
+        long long allocations = 0;
+        double seconds = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            long long allocationsBefore = allocationCount;
+            auto start = chrono::steady_clock::now();
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    raytracer.traceRay(raytracer.primaryRay(scene, inverse, i + 0.5f, j + 0.5f), scene);
+                }
+            }
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            allocations = allocationCount - allocationsBefore;
+        }
+        printf("\ntraceRay on %s at %dx%d: %.1f ns/ray, %.3f allocs/ray (%lld total)\n",
+               sceneFile.c_str(), width, height, 1e9 * seconds / (width * height), double(allocations) / (width * height), allocations);
+    }
+
+    // Compares one sample per pixel with adaptive supersampling and uniform supersampling at the same maximum
+    void benchmarkSuperSample(const string &sceneFile, int width, int height) {
+        RenderData metaData;
+        if (SceneParser::parse(sceneFile, metaData) != 0) {
+            printf("Could not load %s\n", sceneFile.c_str());
+            return;
+        }
+        RayTraceScene scene{width, height, metaData};
+        printf("\nSupersampling %s at %dx%d\n", sceneFile.c_str(), width, height);
+        printf("%-22s %12s %14s %10s\n", "mode", "time (ms)", "samples/pixel", "refined");
+        // A negative threshold refines every pixel and never stops early
+        for (float threshold : {INFINITY, 0.1f, -1.f}) {
+            RayTracer::Config config{};
+            config.enableAcceleration = true;
+            config.enableParallelism = true;
+            config.enableSuperSample = true;
+            config.superSampleThreshold = threshold;
+            RayTracer raytracer{config};
+            vector<RGBA> image(width * height);
+            RayTracer::Stats stats;
+            auto start = chrono::steady_clock::now();
+            raytracer.render(image.data(), scene, &stats);
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            const char *mode = (threshold == INFINITY) ? "1 sample" : (threshold < 0) ? "uniform" : "adaptive (0.1)";
+            printf("%-22s %12.1f %14.2f %10lld\n", mode, ms, stats.samplesPerPixel(), stats.refinedPixels);
+        }
+    }
+
+    // Compares path tracing every pixel with maxPathSamples paths against stopping each once it converges
+    void benchmarkPathTrace(const string &sceneFile, int width, int height) {
+        RenderData metaData;
+        if (SceneParser::parse(sceneFile, metaData) != 0) {
+            printf("Could not load %s\n", sceneFile.c_str());
+            return;
+        }
+        RayTraceScene scene{width, height, metaData};
+        printf("\nPath tracing %s at %dx%d\n", sceneFile.c_str(), width, height);
+        printf("%-22s %12s %14s %10s\n", "mode", "time (ms)", "samples/pixel", "refined");
+        // A negative threshold never stops early
+        for (float threshold : {-1.f, 0.01f}) {
+            RayTracer::Config config{};
+            config.enableRefraction = true;
+            config.enableAcceleration = true;
+            config.enableParallelism = true;
+            config.enablePathTracing = true;
+            config.maxPathSamples = 64;
+            config.pathNoiseThreshold = threshold;
+            RayTracer raytracer{config};
+            vector<RGBA> image(width * height);
+            RayTracer::Stats stats;
+            auto start = chrono::steady_clock::now();
+            raytracer.render(image.data(), scene, &stats);
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            const char *mode = (threshold < 0) ? "fixed" : "adaptive (0.01)";
+            printf("%-22s %12.1f %14.2f %10lld\n", mode, ms, stats.samplesPerPixel(), stats.refinedPixels);
+        }
+    }
+
+    // Re-renders a scene after editing its lights and materials twice, once tracing every primary ray again and
+    // once shading the primary hits kept from the render before, and checks that both give the same image.
+    // The first edit only recolors, so shadows are kept too; the second moves the lights, so they are traced.
+    void benchmarkReshade(const string &sceneFile, int width, int height) {
+        RenderData metaData;
+        if (SceneParser::parse(sceneFile, metaData) != 0) {
+            printf("Could not load %s\n", sceneFile.c_str());
+            return;
+        }
+        RayTracer::Config config{};
+        config.enableAcceleration = true;
+        config.enableParallelism = true;
+        RayTracer raytracer{config};
+        vector<RGBA> image(width * height), traced(width * height);
+        GBuffer primaryHits;
+        raytracer.render(image.data(), RayTraceScene{width, height, metaData}, nullptr, &primaryHits);
+
+        printf("\nRe-shading %s at %dx%d\n", sceneFile.c_str(), width, height);
+        printf("%-28s %12s %14s %10s %10s\n", "edit", "traced (ms)", "re-shaded (ms)", "shadows", "image");
+        for (bool moveLights : {false, true}) {
+            for (SceneLightData &light : metaData.lights) {
+                light.color *= 0.7f;
+                if (moveLights) {
+                    light.pos += glm::vec4{0.5f, 0.f, 0.f, 0.f};
+                }
+            }
+            for (RenderShapeData &shape : metaData.shapes) {
+                shape.primitive.material.cDiffuse = glm::vec4{1.f} - shape.primitive.material.cDiffuse;
+            }
+            metaData.globalData.ks *= 0.5f;
+            RayTraceScene edited{width, height, metaData};
+
+            auto start = chrono::steady_clock::now();
+            raytracer.render(traced.data(), edited);
+            double tracedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            bool shadowsKept = primaryHits.matches(edited) && primaryHits.shadowsMatch(edited, config);
+            start = chrono::steady_clock::now();
+            raytracer.render(image.data(), edited, nullptr, &primaryHits);
+            double reshadedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            bool same = memcmp(image.data(), traced.data(), image.size() * sizeof(RGBA)) == 0;
+            printf("%-28s %12.1f %14.1f %10s %10s\n", moveLights ? "colors, materials, moves" : "colors, materials",
+                   tracedMs, reshadedMs, shadowsKept ? "kept" : "traced", same ? "identical" : "DIFFERENT");
+        }
+    }
+
+    // Checks the distributed render's band bookkeeping, which a render can't show going wrong unless a worker
+    // stalls or leaves at the right moment. Prints each check and returns how many failed.
+    int checkBandQueue() {
+        using Clock = BandQueue::Clock;
+        const Clock::time_point start{};
+        const Clock::duration timeout = chrono::seconds(60);
+        int failures = 0;
+        auto check = [&](const char *name, bool passed) {
+            printf("%-56s %s\n", name, passed ? "ok" : "FAILED");
+            failures += passed ? 0 : 1;
+        };
+        printf("\n%-56s %s\n", "band queue", "result");
+
+        BandQueue queue{10, 4};
+        check("splits 10 rows into bands of 4, 4 and 2",
+              queue.bandCount() == 3 && queue.firstRow(2) == 8 && queue.endRow(2) == 10);
+        int first = queue.take(0, start);
+        int second = queue.take(1, start);
+        int third = queue.take(2, start);
+        check("hands bands out in order", first == 0 && second == 1 && third == 2);
+        check("hands out nothing once every band is out", queue.take(3, start) == -1);
+
+        queue.release(1);
+        check("puts a leaving worker's band back", queue.take(3, start) == 1);
+
+        check("leaves bands out for up to the stall timeout", queue.requeueStalled(start + timeout, timeout) == 0);
+        check("puts back every band out for longer", queue.requeueStalled(start + 2 * timeout, timeout) == 3);
+        check("doesn't hand a worker back the band it stalled on", queue.take(0, start + 2 * timeout) == 1);
+        int reassigned = queue.take(3, start + 2 * timeout);
+        check("hands the stalled band to another worker", reassigned == 0);
+
+        check("keeps the first copy of a band", queue.complete(0));
+        check("drops the second copy of a band", !queue.complete(0));
+        check("ignores bands that don't exist", !queue.complete(-1) && !queue.complete(3));
+        check("forgets a band that was done while it waited", queue.complete(2) && queue.take(4, start + 2 * timeout) == -1);
+        check("isn't finished while a band is out", !queue.finished());
+        queue.release(0);
+        check("puts the band back once its only worker leaves", queue.take(5, start + 2 * timeout) == 1);
+        check("is finished once every band is done", queue.complete(1) && queue.finished());
+        return failures;
+    }
+}
+
+// Usage: cs1230-benchmark [scene.xml] [--kernels] [--save results.tsv] [--baseline results.tsv] [--tolerance 0.1]
+// --kernels runs only the kernel suite. --save writes its results, --baseline compares them to saved ones
+// and makes the exit status the number of regressions, so the suite can gate changes to the hot path. Failed
+// self-checks, such as the band queue's, add to the exit status too.
+int main(int argc, char *argv[]) {
+    string sceneFile = "finalproj_scene.xml";
+    string savePath, baselinePath;
+    double tolerance = 0.1;
+    bool kernelsOnly = false;
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if (argument == "--kernels") {
+            kernelsOnly = true;
+        } else if (argument == "--save" && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (argument == "--baseline" && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (argument == "--tolerance" && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (argument.rfind("--", 0) == 0) {
+            printf("Unknown option %s\n", argument.c_str());
+            return 1;
+        } else {
+            sceneFile = argument;
+        }
+    }
+
+    vector<KernelResult> results = benchmarkKernels({"resources/scene.xml", sceneFile});
+    if (!savePath.empty() && !saveKernelResults(savePath, results)) {
+        return 1;
+    }
+    int regressions = 0;
+    if (!baselinePath.empty()) {
+        vector<KernelResult> baseline;
+        if (!loadKernelResults(baselinePath, baseline)) {
+            return 1;
+        }
+        regressions = compareKernelResults(results, baseline, tolerance);
+    }
+    int failures = checkBandQueue();
+    if (kernelsOnly) {
+        return regressions + failures;
+    }
+
+    printf("\n");
+    benchmarkBVH();
+    benchmarkPacketIntersectors();
+    benchmarkPrimitiveLayout(10000);
+    benchmarkMeshes();
+    benchmarkTraceRayAllocations(sceneFile, 400, 300);
+    benchmarkPacketRender(sceneFile, 800, 600);
+    benchmarkRenderScaling(sceneFile, 800, 600);
+    benchmarkSuperSample(sceneFile, 800, 600);
+    benchmarkPathTrace(sceneFile, 400, 300);
+    benchmarkReshade(sceneFile, 3840, 2160);
+    return regressions + failures;
+}
@@ -62,11 +62,9 @@ float Camera::getWidthAngle() const {
 }
 
 float Camera::getFocalLength() const {
-    // Optional TODO: implement the getter or make your own design
-    throw std::runtime_error("not implemented");
+    return m_cameraData.focalLength;
 }
 
 float Camera::getAperture() const {
-    // Optional TODO: implement the getter or make your own design
-    throw std::runtime_error("not implemented");
+    return m_cameraData.aperture;
 }
@@ -40,12 +40,12 @@ public:
     // Returns the width angle of the camera in RADIANS.
     float getWidthAngle() const;
 
-    // Returns the focal length of this camera.
+    // Returns the focal length of this camera: the distance from it to the plane in focus.
     // This is for the depth of field extra-credit feature only;
     // You can ignore if you are not attempting to implement depth of field.
     float getFocalLength() const;
 
-    // Returns the focal length of this camera.
+    // Returns the aperture of this camera: the diameter of its lens, in world units.
     // This is for the depth of field extra-credit feature only;
     // You can ignore if you are not attempting to implement depth of field.
     float getAperture() const;
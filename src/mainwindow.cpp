@@ -2,7 +2,6 @@
 #include "settings.h"
 
 #include <QHBoxLayout>
-#include <QScrollArea>
 #include <QVBoxLayout>
 #include <QFileDialog>
 #include <QSettings>
@@ -44,8 +43,6 @@ void MainWindow::initialize() {
     near_label->setText("Near Plane:");
     QLabel *far_label = new QLabel(); // Far plane label
     far_label->setText("Far Plane:");
-    labelImage = new QLabel();
-    scrollArea = new QScrollArea();
 
 
 
@@ -348,17 +345,5 @@ void MainWindow::onExtraCredit4() {
 }
 
 void MainWindow::onRayTraceButton() {
-    if (raytrace->isChecked()) {
-        QImage image = realtime->raytraceScene();
-        labelImage->setPixmap(QPixmap::fromImage(image));
-        update();
-
-        scrollArea->setWidget(labelImage);
-        hLayout->replaceWidget(realtime, scrollArea);
-    }
-    else {
-            hLayout->replaceWidget(scrollArea, realtime);
-            scrollArea->resize(0, 0);
-    }
-
+    realtime->setRayTraced(raytrace->isChecked());
 }
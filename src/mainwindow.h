@@ -5,7 +5,6 @@
 #include <QSlider>
 #include <QSpinBox>
 #include <QDoubleSpinBox>
-#include <QScrollArea>
 #include <QPushButton>
 #include <QLabel>
 #include "QtWidgets/qboxlayout.h"
@@ -42,8 +41,6 @@ private:
     QSlider *farSlider;
     QDoubleSpinBox *nearBox;
     QDoubleSpinBox *farBox;
-    QLabel *labelImage;
-    QScrollArea *scrollArea;
     QHBoxLayout *hLayout;
     QVBoxLayout *vLayout;
 
@@ -0,0 +1,56 @@
+#include "accumulationbuffer.h"
+#include <algorithm>
+
+AccumulationBuffer::AccumulationBuffer(int width, int height) {
+    reset(width, height);
+}
+
+void AccumulationBuffer::reset(int width, int height) {
+    m_width = max(0, width);
+    m_height = max(0, height);
+    m_pixels.assign(size_t(m_width) * m_height, Pixel{});
+}
+
+int AccumulationBuffer::width() const {
+    return m_width;
+}
+
+int AccumulationBuffer::height() const {
+    return m_height;
+}
+
+AccumulationBuffer::Pixel* AccumulationBuffer::pixels() {
+    return m_pixels.data();
+}
+
+const AccumulationBuffer::Pixel* AccumulationBuffer::pixels() const {
+    return m_pixels.data();
+}
+
+long long AccumulationBuffer::sampleCount() const {
+    long long total = 0;
+    for (const Pixel &pixel : m_pixels) {
+        total += pixel.samples;
+    }
+    return total;
+}
+
+void AccumulationBuffer::resolve(RGBA *rows, int y0, int y1) const {
+    const Pixel *first = m_pixels.data() + size_t(y0) * m_width;
+    transform(first, first + size_t(y1 - y0) * m_width, rows, [](const Pixel &pixel) {
+        return AccumulationBuffer::quantize(AccumulationBuffer::toneMap(pixel.mean()));
+    });
+}
+
+void AccumulationBuffer::resolve(RGBA *imageData) const {
+    resolve(imageData, 0, m_height);
+}
+
+glm::vec3 AccumulationBuffer::toneMap(glm::vec3 color) {
+    return glm::clamp(color, 0.f, 1.f);
+}
+
+RGBA AccumulationBuffer::quantize(glm::vec3 color) {
+    color = color * 255.f + 0.5f;
+    return RGBA{uint8_t(color.r), uint8_t(color.g), uint8_t(color.b)};
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "utils/rgba.h"
+
+using namespace std;
+
+// The float image a render accumulates its samples into. Every pixel keeps the sum of its samples' colors,
+// unclamped, and how many there are, so averages of many samples (supersampling, depth of field, refinement
+// over several passes) lose nothing to 8-bit rounding, and more samples can be added to a finished image.
+// Colors are tone mapped and quantized only when the buffer is resolved to RGBA. See RayTracer::render and
+// RayTracer::refine.
+
+class AccumulationBuffer {
+public:
+    struct Pixel {
+        glm::vec3 sum{0.f}; // of the samples' colors, in linear, unclamped units where 1 is full brightness
+        uint32_t samples = 0;
+
+        glm::vec3 mean() const {
+            return samples > 0 ? sum / float(samples) : glm::vec3{0.f};
+        }
+    };
+
+    AccumulationBuffer() = default;
+    AccumulationBuffer(int width, int height);
+
+    // Resizes the buffer to width x height pixels with no samples
+    void reset(int width, int height);
+
+    int width() const;
+    int height() const;
+
+    // The pixels, row by row
+    Pixel* pixels();
+    const Pixel* pixels() const;
+
+    long long sampleCount() const;
+
+    // Tone maps and quantizes rows [y0, y1) into rows, which holds (y1 - y0) rows of width pixels
+    void resolve(RGBA *rows, int y0, int y1) const;
+    void resolve(RGBA *imageData) const;
+
+    // The tone map: colors are clamped to [0, 1], which is how the ray tracer has always shown them,
+    // then rounded to the nearest 8-bit step
+    static glm::vec3 toneMap(glm::vec3 color);
+    static RGBA quantize(glm::vec3 color);
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    vector<Pixel> m_pixels;
+};
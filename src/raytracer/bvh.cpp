@@ -0,0 +1,209 @@
+#include "bvh.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+    const int BIN_COUNT = 12;
+    const int MAX_LEAF_SIZE = 2;
+    const int MAX_DEPTH = 60; // keeps BVH::traverse's fixed-size stack from overflowing
+    const float TRAVERSAL_COST = 0.3f; // cost of a node visit relative to a primitive intersection
+
+    struct Bin {
+        AABB bounds;
+        int count = 0;
+    };
+}
+
+void AABB::expand(const glm::vec3 &point) {
+    min = glm::min(min, point);
+    max = glm::max(max, point);
+}
+
+void AABB::expand(const AABB &box) {
+    min = glm::min(min, box.min);
+    max = glm::max(max, box.max);
+}
+
+glm::vec3 AABB::centroid() const {
+    return 0.5f * (min + max);
+}
+
+float AABB::surfaceArea() const {
+    glm::vec3 extent = max - min;
+    if (extent.x < 0 || extent.y < 0 || extent.z < 0) {
+        return 0.f;
+    }
+    return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+AABB transformedBounds(const AABB &box, const glm::mat4 &ctm) {
+    AABB transformed;
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec4 point = {(corner & 1) ? box.max.x : box.min.x, (corner & 2) ? box.max.y : box.min.y, (corner & 4) ? box.max.z : box.min.z, 1.f};
+        transformed.expand(glm::vec3(ctm * point));
+    }
+    // Pad slightly so the box stays conservative for the intersectors' own tolerances
+    glm::vec3 padding = 1e-4f * (transformed.max - transformed.min) + 1e-5f;
+    transformed.min -= padding;
+    transformed.max += padding;
+    return transformed;
+}
+
+AABB unitPrimitiveBounds(const glm::mat4 &ctm) {
+    return transformedBounds(AABB{glm::vec3(-0.5f), glm::vec3(0.5f)}, ctm);
+}
+
+void BVH::build(const vector<AABB> &primitiveBounds) {
+    m_nodes.clear();
+    m_indices.resize(primitiveBounds.size());
+    if (primitiveBounds.empty()) {
+        return;
+    }
+    int count = int(primitiveBounds.size());
+    vector<glm::vec3> centroids;
+    centroids.reserve(count);
+    for (int i = 0; i < count; i++) {
+        m_indices[i] = i;
+        centroids.push_back(primitiveBounds[i].centroid());
+    }
+    m_nodes.reserve(2 * count);
+    m_nodes.push_back(BVHNode{AABB{}, 0, count});
+    updateBounds(0, primitiveBounds);
+    subdivide(0, 0, primitiveBounds, centroids);
+}
+
+bool BVH::empty() const {
+    return m_nodes.empty();
+}
+
+const vector<BVHNode>& BVH::getNodes() const {
+    return m_nodes;
+}
+
+void BVH::cull(const Frustum &frustum, vector<int> &entries, int maxEntries) const {
+    entries.clear();
+    if (m_nodes.empty() || !frustum.overlaps(m_nodes[0].bounds)) {
+        return;
+    }
+    entries.push_back(0);
+    // Each interior entry is replaced by those of its children the frustum reaches into. One that has both is
+    // kept as it is once the list is full, and traversal sorts out its children per ray instead.
+    for (int i = 0; i < int(entries.size());) {
+        const BVHNode &node = m_nodes[entries[i]];
+        if (node.count > 0) {
+            i++;
+            continue;
+        }
+        int left = node.leftFirst, right = node.leftFirst + 1;
+        bool hitLeft = frustum.overlaps(m_nodes[left].bounds);
+        bool hitRight = frustum.overlaps(m_nodes[right].bounds);
+        if (hitLeft && hitRight) {
+            if (int(entries.size()) >= maxEntries) {
+                i++;
+                continue;
+            }
+            entries[i] = left;
+            entries.push_back(right);
+        } else if (hitLeft || hitRight) {
+            entries[i] = hitLeft ? left : right;
+        } else {
+            entries.erase(entries.begin() + i);
+        }
+    }
+    // Nearest first, so the closest hits are found early and cut short the traversal of the rest
+    auto distance = [&](int index) {
+        const AABB &bounds = m_nodes[index].bounds;
+        glm::vec3 offset = glm::max(glm::max(bounds.min - frustum.origin, frustum.origin - bounds.max), glm::vec3{0.f});
+        return glm::dot(offset, offset);
+    };
+    stable_sort(entries.begin(), entries.end(), [&](int a, int b) {
+        return distance(a) < distance(b);
+    });
+}
+
+void BVH::updateBounds(int nodeIndex, const vector<AABB> &primitiveBounds) {
+    BVHNode &node = m_nodes[nodeIndex];
+    node.bounds = AABB{};
+    for (int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+        node.bounds.expand(primitiveBounds[m_indices[i]]);
+    }
+}
+
+void BVH::subdivide(int nodeIndex, int depth, const vector<AABB> &primitiveBounds, const vector<glm::vec3> &centroids) {
+    int first = m_nodes[nodeIndex].leftFirst;
+    int count = m_nodes[nodeIndex].count;
+    if (count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH) {
+        return;
+    }
+
+    AABB centroidBounds;
+    for (int i = first; i < first + count; i++) {
+        centroidBounds.expand(centroids[m_indices[i]]);
+    }
+
+    // Evaluate the SAH at every bin boundary along every axis
+    int bestAxis = -1, bestSplit = 0;
+    float bestCost = INFINITY;
+    for (int axis = 0; axis < 3; axis++) {
+        float lower = centroidBounds.min[axis], upper = centroidBounds.max[axis];
+        if (lower == upper) {
+            continue;
+        }
+        Bin bins[BIN_COUNT];
+        float scale = BIN_COUNT / (upper - lower);
+        for (int i = first; i < first + count; i++) {
+            int binIndex = min(BIN_COUNT - 1, int((centroids[m_indices[i]][axis] - lower) * scale));
+            bins[binIndex].count++;
+            bins[binIndex].bounds.expand(primitiveBounds[m_indices[i]]);
+        }
+        float leftArea[BIN_COUNT - 1], rightArea[BIN_COUNT - 1];
+        int leftCount[BIN_COUNT - 1], rightCount[BIN_COUNT - 1];
+        AABB leftBox, rightBox;
+        int leftSum = 0, rightSum = 0;
+        for (int i = 0; i < BIN_COUNT - 1; i++) {
+            leftSum += bins[i].count;
+            leftCount[i] = leftSum;
+            leftBox.expand(bins[i].bounds);
+            leftArea[i] = leftBox.surfaceArea();
+            rightSum += bins[BIN_COUNT - 1 - i].count;
+            rightCount[BIN_COUNT - 2 - i] = rightSum;
+            rightBox.expand(bins[BIN_COUNT - 1 - i].bounds);
+            rightArea[BIN_COUNT - 2 - i] = rightBox.surfaceArea();
+        }
+        for (int i = 0; i < BIN_COUNT - 1; i++) {
+            if (leftCount[i] == 0 || rightCount[i] == 0) {
+                continue;
+            }
+            float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+
+    float nodeArea = m_nodes[nodeIndex].bounds.surfaceArea();
+    if (bestAxis == -1 || TRAVERSAL_COST * nodeArea + bestCost >= count * nodeArea) {
+        return;
+    }
+
+    // Partition the primitive range around the chosen bin boundary
+    float lower = centroidBounds.min[bestAxis];
+    float scale = BIN_COUNT / (centroidBounds.max[bestAxis] - lower);
+    int *middle = std::partition(m_indices.data() + first, m_indices.data() + first + count, [&](int index) {
+        return min(BIN_COUNT - 1, int((centroids[index][bestAxis] - lower) * scale)) <= bestSplit;
+    });
+    int leftCount = int(middle - (m_indices.data() + first));
+
+    int leftIndex = int(m_nodes.size());
+    m_nodes.push_back(BVHNode{AABB{}, first, leftCount});
+    m_nodes.push_back(BVHNode{AABB{}, first + leftCount, count - leftCount});
+    m_nodes[nodeIndex].leftFirst = leftIndex;
+    m_nodes[nodeIndex].count = 0;
+    updateBounds(leftIndex, primitiveBounds);
+    updateBounds(leftIndex + 1, primitiveBounds);
+    subdivide(leftIndex, depth + 1, primitiveBounds, centroids);
+    subdivide(leftIndex + 1, depth + 1, primitiveBounds, centroids);
+}
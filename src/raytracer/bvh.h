@@ -0,0 +1,246 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "raystats.h"
+
+using namespace std;
+
+// An axis-aligned bounding box in world space
+
+struct AABB {
+    glm::vec3 min = glm::vec3(INFINITY);
+    glm::vec3 max = glm::vec3(-INFINITY);
+
+    void expand(const glm::vec3 &point);
+    void expand(const AABB &box);
+    glm::vec3 centroid() const;
+    float surfaceArea() const;
+
+    // Slab test against a ray given by its origin and the reciprocal of its direction.
+    // On a hit within [0, tMax], tNear holds the entry distance (clamped to 0).
+    inline bool intersect(const glm::vec3 &origin, const glm::vec3 &inverseDirection, float tMax, float &tNear) const {
+        glm::vec3 t0 = (min - origin) * inverseDirection;
+        glm::vec3 t1 = (max - origin) * inverseDirection;
+        glm::vec3 tSmall = glm::min(t0, t1);
+        glm::vec3 tLarge = glm::max(t0, t1);
+        tNear = std::max(std::max(tSmall.x, tSmall.y), std::max(tSmall.z, 0.f));
+        float tFar = std::min(std::min(tLarge.x, tLarge.y), std::min(tLarge.z, tMax));
+        return tNear <= tFar;
+    }
+};
+
+// The pyramid that the rays from one point through a rectangle fan out into, as the four planes through that
+// point which bound it, each kept by its inward normal. Rays from origin inside it stay inside it.
+
+struct Frustum {
+    glm::vec3 origin{0.f};
+    glm::vec3 normals[4];
+
+    // Whether the box may reach into the frustum: false only when the whole box is outside one of the planes
+    inline bool overlaps(const AABB &box) const {
+        for (const glm::vec3 &normal : normals) {
+            // The corner of the box farthest along the normal
+            glm::vec3 corner = glm::mix(box.min, box.max, glm::vec3(glm::greaterThan(normal, glm::vec3{0.f})));
+            if (glm::dot(normal, corner - origin) < 0.f) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Returns the world-space bounds of an object-space box transformed by ctm
+AABB transformedBounds(const AABB &box, const glm::mat4 &ctm);
+
+// Returns the world-space bounds of the unit primitive ([-0.5, 0.5]^3) transformed by ctm
+AABB unitPrimitiveBounds(const glm::mat4 &ctm);
+
+// A node of the flattened hierarchy. Interior nodes store the index of their left child
+// (the right child always follows it); leaves store a range into BVH::m_indices.
+
+struct BVHNode {
+    AABB bounds;
+    int leftFirst;
+    int count; // number of primitives in a leaf, 0 for interior nodes
+};
+
+// A bounding volume hierarchy built with the binned surface area heuristic
+
+class BVH {
+public:
+    // Builds the hierarchy over one bounding box per primitive.
+    // Primitive indices reported during traversal are indices into primitiveBounds.
+    void build(const vector<AABB> &primitiveBounds);
+
+    bool empty() const;
+
+    // Visits every primitive whose leaf is hit by the ray closer than tMax, nearest nodes first.
+    // tMax is re-read after every visit so the visitor can shrink it as closer hits are found.
+    // The visitor returns true to stop the traversal early (e.g. for shadow rays), and so does traverse.
+    // Only the subtree under root is searched.
+    template <typename Visitor>
+    bool traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tMax, Visitor visit, int root = 0) const;
+
+    // Visits every primitive whose leaf is hit by at least one ray of a packet closer than that ray's tMax.
+    // As with traverse, tMax is re-read after every visit. Rays with tMax = 0 take no part.
+    template <int size, typename Visitor>
+    bool traversePacket(const glm::vec3 *origins, const glm::vec3 *directions, const float *tMax, Visitor visit, int root = 0) const;
+
+    // Fills entries with nodes whose subtrees hold every primitive whose bounds reach into the frustum, nearest
+    // the frustum's origin first, splitting the nodes it reaches into for as long as there are at most maxEntries.
+    // Traversing just these subtrees finds the same hits as traversing the whole hierarchy, for rays inside it.
+    void cull(const Frustum &frustum, vector<int> &entries, int maxEntries) const;
+
+    const vector<BVHNode>& getNodes() const;
+
+private:
+    void subdivide(int nodeIndex, int depth, const vector<AABB> &primitiveBounds, const vector<glm::vec3> &centroids);
+    void updateBounds(int nodeIndex, const vector<AABB> &primitiveBounds);
+
+    vector<BVHNode> m_nodes;
+    vector<int> m_indices;
+};
+
+template <typename Visitor>
+bool BVH::traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tMax, Visitor visit, int root) const {
+    if (m_nodes.empty()) {
+        return false;
+    }
+    glm::vec3 inverseDirection = 1.f / direction;
+    float tNear;
+    if (!m_nodes[root].bounds.intersect(origin, inverseDirection, tMax, tNear)) {
+        return false;
+    }
+    // Each stack entry keeps the entry distance computed when it was pushed,
+    // so nodes made irrelevant by a closer hit are skipped without a second slab test
+    int stack[64];
+    float stackNear[64];
+    int stackSize = 0;
+    int nodeIndex = root;
+    while (true) {
+        const BVHNode &node = m_nodes[nodeIndex];
+        RAYTRACER_COUNT(nodesVisited, 1);
+        if (node.count > 0) {
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                if (visit(m_indices[i])) {
+                    return true;
+                }
+            }
+        } else {
+            int left = node.leftFirst, right = node.leftFirst + 1;
+            float tLeft, tRight;
+            bool hitLeft = m_nodes[left].bounds.intersect(origin, inverseDirection, tMax, tLeft);
+            bool hitRight = m_nodes[right].bounds.intersect(origin, inverseDirection, tMax, tRight);
+            if (hitLeft && hitRight) {
+                if (tRight < tLeft) {
+                    std::swap(left, right);
+                    std::swap(tLeft, tRight);
+                }
+                stack[stackSize] = right;
+                stackNear[stackSize] = tRight;
+                stackSize++;
+                nodeIndex = left;
+                continue;
+            } else if (hitLeft) {
+                nodeIndex = left;
+                continue;
+            } else if (hitRight) {
+                nodeIndex = right;
+                continue;
+            }
+        }
+        // Pop the next node that can still contain a closer hit
+        do {
+            if (stackSize == 0) {
+                return false;
+            }
+            stackSize--;
+        } while (stackNear[stackSize] > tMax);
+        nodeIndex = stack[stackSize];
+    }
+}
+
+template <int size, typename Visitor>
+bool BVH::traversePacket(const glm::vec3 *origins, const glm::vec3 *directions, const float *tMax, Visitor visit, int root) const {
+    if (m_nodes.empty()) {
+        return false;
+    }
+    glm::vec3 inverseDirections[size];
+    for (int i = 0; i < size; i++) {
+        inverseDirections[i] = 1.f / directions[i];
+    }
+    // A node is entered when any ray hits it, at the nearest of those rays' entry distances
+    auto intersect = [&](const AABB &bounds, float &tNear) {
+        bool hit = false;
+        tNear = INFINITY;
+        for (int i = 0; i < size; i++) {
+            float tRay;
+            if (tMax[i] > 0 && bounds.intersect(origins[i], inverseDirections[i], tMax[i], tRay)) {
+                hit = true;
+                tNear = std::min(tNear, tRay);
+            }
+        }
+        return hit;
+    };
+    auto farthest = [&]() {
+        float t = 0;
+        for (int i = 0; i < size; i++) {
+            t = std::max(t, tMax[i]);
+        }
+        return t;
+    };
+
+    float tNear;
+    if (!intersect(m_nodes[root].bounds, tNear)) {
+        return false;
+    }
+    int stack[64];
+    float stackNear[64];
+    int stackSize = 0;
+    int nodeIndex = root;
+    while (true) {
+        const BVHNode &node = m_nodes[nodeIndex];
+        RAYTRACER_COUNT(nodesVisited, 1);
+        if (node.count > 0) {
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                if (visit(m_indices[i])) {
+                    return true;
+                }
+            }
+        } else {
+            int left = node.leftFirst, right = node.leftFirst + 1;
+            float tLeft, tRight;
+            bool hitLeft = intersect(m_nodes[left].bounds, tLeft);
+            bool hitRight = intersect(m_nodes[right].bounds, tRight);
+            if (hitLeft && hitRight) {
+                if (tRight < tLeft) {
+                    std::swap(left, right);
+                    std::swap(tLeft, tRight);
+                }
+                stack[stackSize] = right;
+                stackNear[stackSize] = tRight;
+                stackSize++;
+                nodeIndex = left;
+                continue;
+            } else if (hitLeft) {
+                nodeIndex = left;
+                continue;
+            } else if (hitRight) {
+                nodeIndex = right;
+                continue;
+            }
+        }
+        // Pop the next node that can still contain a closer hit for some ray
+        float tFarthest = farthest();
+        do {
+            if (stackSize == 0) {
+                return false;
+            }
+            stackSize--;
+        } while (stackNear[stackSize] > tFarthest);
+        nodeIndex = stack[stackSize];
+    }
+}
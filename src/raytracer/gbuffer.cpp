@@ -0,0 +1,32 @@
+#include "gbuffer.h"
+#include "raytracescene.h"
+
+bool GBuffer::matches(const RayTraceScene &scene) const {
+    return !m_hits.empty() && m_geometryKey == scene.geometryKey() &&
+           m_hits.size() == size_t(scene.width()) * size_t(scene.height());
+}
+
+bool GBuffer::shadowsMatch(const RayTraceScene &scene, const RayTracer::Config &config) const {
+    return m_lightKey == scene.lightKey() && m_lightCulling == config.enableLightCulling;
+}
+
+RayTracer::PrimaryHit* GBuffer::reset(const RayTraceScene &scene, const RayTracer::Config &config) {
+    m_geometryKey = scene.geometryKey();
+    GBuffer::resetShadows(scene, config);
+    m_hits.resize(size_t(scene.width()) * size_t(scene.height()));
+    return m_hits.data();
+}
+
+void GBuffer::resetShadows(const RayTraceScene &scene, const RayTracer::Config &config) {
+    m_lightKey = scene.lightKey();
+    m_lightCulling = config.enableLightCulling;
+}
+
+RayTracer::PrimaryHit* GBuffer::hits() {
+    return m_hits.data();
+}
+
+void GBuffer::clear() {
+    m_hits.clear();
+    m_hits.shrink_to_fit();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "raytracer.h"
+
+using namespace std;
+
+// The primary hits through the pixel centers of a render, kept between renders of the same shapes through the
+// same camera. Editing lights, the global coefficients or materials then only shades the pixels again, which
+// skips every primary ray's traversal and intersection tests, and, unless lights were moved, their shadow rays.
+// See RayTracer::render.
+
+class GBuffer {
+public:
+    // Whether the buffer holds the hits of scene's pixels: it was filled for a scene of the same size,
+    // camera and shape geometry (see RayTraceScene::geometryKey)
+    bool matches(const RayTraceScene &scene) const;
+
+    // Whether the shadowed bits of the hits also hold for scene, whose lights are where they were
+    // (see RayTraceScene::lightKey), shaded with config. Lights culled at a hit never get their bit set, so the
+    // bits only hold for the light culling they were traced with. Only meaningful when matches(scene).
+    bool shadowsMatch(const RayTraceScene &scene, const RayTracer::Config &config) const;
+
+    // Makes room for the hits of scene's pixels, row by row, which the caller then fills shading with config
+    RayTracer::PrimaryHit* reset(const RayTraceScene &scene, const RayTracer::Config &config);
+
+    // Marks the shadowed bits as being those of scene's lights shaded with config, which the caller then traces again
+    void resetShadows(const RayTraceScene &scene, const RayTracer::Config &config);
+
+    RayTracer::PrimaryHit* hits();
+
+    // Frees the hits, so the next render traces its primary rays again
+    void clear();
+
+private:
+    uint64_t m_geometryKey = 0;
+    uint64_t m_lightKey = 0;
+    bool m_lightCulling = false;
+    vector<RayTracer::PrimaryHit> m_hits;
+};
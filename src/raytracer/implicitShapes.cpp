@@ -1,175 +1,253 @@
 #include "raytracer.h"
-#include <tuple>
-
-tuple<vector<float>, glm::vec3, bool> RayTracer::cylinderIntersect(Ray ray) {
-    vector<tuple<float, glm::vec3>> solutions;
-    glm::vec3 P = glm::vec3(ray.origin);
-    glm::vec3 d = glm::vec3(ray.direction);
-    float a = powf(d.x, 2.f) + powf(d.z, 2.f);
-    float b = (2.f * P.x * d.x) + (2.f * P.z * d.z);
-    float c = powf(P.x, 2.f) + powf(P.z, 2.f) - 0.25f;
-    vector<float> infinite = RayTracer::quadraticEquation(a, b, c);
-    for (int i = 0; i < infinite.size(); i++) {
-        glm::vec3 tRay = P + infinite[i] * d;
-        if (tRay.y > 0.5 || tRay.y < -0.5 || infinite[i] <= 0) {
-            continue;
+#include "packet.h"
+
+#if defined(_MSC_VER) && defined(RAYTRACER_X86_SIMD)
+#include <intrin.h>
+#endif
+
+// Each primitive has one kernel shared by the closest-hit and occlusion entry points.
+// Kernels only keep candidates closer than tMax. With anyHit set they return on the first
+// such candidate and leave the normal unset, which is all a shadow ray needs.
+
+namespace {
+    template <bool anyHit>
+    bool cylinderKernel(const RayTracer::Ray &ray, float tMax, RayTracer::Hit &hit) {
+        hit.t = tMax;
+        glm::vec3 P = glm::vec3(ray.origin);
+        glm::vec3 d = glm::vec3(ray.direction);
+        float a = powf(d.x, 2.f) + powf(d.z, 2.f);
+        float b = (2.f * P.x * d.x) + (2.f * P.z * d.z);
+        float c = powf(P.x, 2.f) + powf(P.z, 2.f) - 0.25f;
+        float infinite[2];
+        int count = RayTracer::quadraticEquation(a, b, c, infinite);
+        for (int i = 0; i < count; i++) {
+            glm::vec3 tRay = P + infinite[i] * d;
+            if (tRay.y > 0.5 || tRay.y < -0.5 || infinite[i] <= 0 || infinite[i] >= hit.t) {
+                continue;
+            }
+            hit.t = infinite[i];
+            if (anyHit) {
+                return true;
+            }
+            glm::vec3 reflect = P + (infinite[i] * d);
+            hit.normal = {2 * reflect.x, 0, 2 * reflect.z};
         }
-        glm::vec3 reflect = P + (infinite[i] * d);
-        solutions.push_back({{infinite[i]}, {2 * reflect.x, 0, 2 * reflect.z}});
-    }
-    float t3 = (0.5f - P.y) / d.y;
-    float t4 = (-0.5f - P.y) / d.y;
-    glm::vec3 t3Ray = P + t3 * d;
-    glm::vec3 t4Ray = P + t4 * d;
-    float t3Check = pow(t3Ray.x, 2.f) + pow(t3Ray.z, 2.f);
-    float t4Check = pow(t4Ray.x, 2.f) + pow(t4Ray.z, 2.f);
-    if (t3Check <= .25 && t3 > 0) {
-        solutions.push_back({{t3}, {0, 1, 0}});
-    }
-    if (t4Check <= .25 && t4 > 0) {
-        solutions.push_back({{t4}, {0, -1, 0}});
-    }
-    if (solutions.empty()) {
-        return {{}, {0, 0, 0}, false};
-    } else {
-        float min = get<0>(solutions[0]);
-        glm::vec3 normal = get<1>(solutions[0]);
-        for (int j = 1; j < solutions.size(); j++) {
-            if (get<0>(solutions[j]) < min) {
-                min = get<0>(solutions[j]);
-                normal = get<1>(solutions[j]);
+        float t3 = (0.5f - P.y) / d.y;
+        float t4 = (-0.5f - P.y) / d.y;
+        glm::vec3 t3Ray = P + t3 * d;
+        glm::vec3 t4Ray = P + t4 * d;
+        float t3Check = pow(t3Ray.x, 2.f) + pow(t3Ray.z, 2.f);
+        float t4Check = pow(t4Ray.x, 2.f) + pow(t4Ray.z, 2.f);
+        if (t3Check <= .25 && t3 > 0 && t3 < hit.t) {
+            hit.t = t3;
+            hit.normal = {0, 1, 0};
+            if (anyHit) {
+                return true;
             }
         }
-        return {{min}, normal, true};
-    }
-}
-
-tuple<vector<float>, glm::vec3, bool> RayTracer::coneIntersect(Ray ray) {
-    vector<tuple<float, glm::vec3>> solutions;
-    glm::vec3 P = glm::vec3(ray.origin);
-    glm::vec3 d = glm::vec3(ray.direction);
-    float a = powf(d.x, 2.f) + powf(d.z, 2.f) - (0.25f * powf(d.y, 2.f));
-    float b = (2.f * P.x * d.x) + (2.f * P.z * d.z) - (0.5f * P.y * d.y) + (0.25f * d.y);
-    float c = powf(P.x, 2.f) + powf(P.z, 2.f) - (0.25f * powf(P.y, 2.f)) + (0.25f * P.y) - 0.0625f;
-    vector<float> infinite = RayTracer::quadraticEquation(a, b, c);
-    for (int i = 0; i < infinite.size(); i++) {
-        glm::vec3 tRay = P + infinite[i] * d;
-        if (tRay.y > 0.5 || tRay.y < -0.5 || infinite[i] <= 0) {
-            continue;
+        if (t4Check <= .25 && t4 > 0 && t4 < hit.t) {
+            hit.t = t4;
+            hit.normal = {0, -1, 0};
         }
-        glm::vec3 reflect = P + (infinite[i] * d);
-        solutions.push_back({infinite[i], {2.f * reflect.x, -0.5f * reflect.y + 0.25f, 2.f * reflect.z}});
+        return hit.t < tMax;
     }
-    float t3 = (-0.5f - P.y) / d.y;
-    float t3Check = pow(P.x + (t3 * d.x), 2.f) + pow(P.z + (t3 * d.z), 2.f);
-    if (t3Check <= 0.25f && t3 > 0) {
-        solutions.push_back({t3, {0, -1, 0}});
-    }
-    if (solutions.empty()) {
-        return {{}, {0, 0, 0}, false};
-    } else {
-        float min = get<0>(solutions[0]);
-        glm::vec3 normal = get<1>(solutions[0]);
-        for (int j = 1; j < solutions.size(); j++) {
-            if (get<0>(solutions[j]) < min) {
-                min = get<0>(solutions[j]);
-                normal = get<1>(solutions[j]);
+
+    template <bool anyHit>
+    bool coneKernel(const RayTracer::Ray &ray, float tMax, RayTracer::Hit &hit) {
+        hit.t = tMax;
+        glm::vec3 P = glm::vec3(ray.origin);
+        glm::vec3 d = glm::vec3(ray.direction);
+        float a = powf(d.x, 2.f) + powf(d.z, 2.f) - (0.25f * powf(d.y, 2.f));
+        float b = (2.f * P.x * d.x) + (2.f * P.z * d.z) - (0.5f * P.y * d.y) + (0.25f * d.y);
+        float c = powf(P.x, 2.f) + powf(P.z, 2.f) - (0.25f * powf(P.y, 2.f)) + (0.25f * P.y) - 0.0625f;
+        float infinite[2];
+        int count = RayTracer::quadraticEquation(a, b, c, infinite);
+        for (int i = 0; i < count; i++) {
+            glm::vec3 tRay = P + infinite[i] * d;
+            if (tRay.y > 0.5 || tRay.y < -0.5 || infinite[i] <= 0 || infinite[i] >= hit.t) {
+                continue;
+            }
+            hit.t = infinite[i];
+            if (anyHit) {
+                return true;
             }
+            glm::vec3 reflect = P + (infinite[i] * d);
+            hit.normal = {2.f * reflect.x, -0.5f * reflect.y + 0.25f, 2.f * reflect.z};
         }
-        return {{min}, normal, true};
+        float t3 = (-0.5f - P.y) / d.y;
+        float t3Check = pow(P.x + (t3 * d.x), 2.f) + pow(P.z + (t3 * d.z), 2.f);
+        if (t3Check <= 0.25f && t3 > 0 && t3 < hit.t) {
+            hit.t = t3;
+            hit.normal = {0, -1, 0};
+        }
+        return hit.t < tMax;
     }
-}
 
-tuple<vector<float>, glm::vec3, bool> RayTracer::sphereIntersect(Ray ray) {
-    glm::vec3 P = glm::vec3(ray.origin);
-    glm::vec3 d = glm::vec3(ray.direction);
-    float a = powf(d.x, 2.f) + powf(d.y, 2.f) + powf(d.z, 2.f);
-    float b = (2.f * P.x * d.x) + (2.f * P.y * d.y) + (2.f * P.z * d.z);
-    float c = powf(P.x, 2.f) + powf(P.y, 2.f) + powf(P.z, 2.f) - 0.25f;
-    vector<float> solutions = RayTracer::quadraticEquation(a, b, c);
-    if (solutions.empty()) {
-        return {{}, {0, 0, 0}, false};
-    } else {
-        float min = solutions[0];
-        for (int j = 1; j < solutions.size(); j++) {
-            if (solutions[j] < min) {
-                min = solutions[j];
+    template <bool anyHit>
+    bool sphereKernel(const RayTracer::Ray &ray, float tMax, RayTracer::Hit &hit) {
+        hit.t = tMax;
+        glm::vec3 P = glm::vec3(ray.origin);
+        glm::vec3 d = glm::vec3(ray.direction);
+        float a = powf(d.x, 2.f) + powf(d.y, 2.f) + powf(d.z, 2.f);
+        float b = (2.f * P.x * d.x) + (2.f * P.y * d.y) + (2.f * P.z * d.z);
+        float c = powf(P.x, 2.f) + powf(P.y, 2.f) + powf(P.z, 2.f) - 0.25f;
+        float solutions[2];
+        int count = RayTracer::quadraticEquation(a, b, c, solutions);
+        for (int j = 0; j < count; j++) {
+            if (solutions[j] < hit.t) {
+                hit.t = solutions[j];
+                if (anyHit) {
+                    return true;
+                }
             }
         }
-        glm::vec3 reflect = P + (min * d);
-        return {{min}, {2 * reflect.x, 2 * reflect.y, 2 * reflect.z}, true};
+        if (hit.t >= tMax) {
+            return false;
+        }
+        glm::vec3 reflect = P + (hit.t * d);
+        hit.normal = {2 * reflect.x, 2 * reflect.y, 2 * reflect.z};
+        return true;
     }
-}
 
-tuple<vector<float>, glm::vec3, bool> RayTracer::cubeIntersect(Ray ray) {
-    std::vector<tuple<float, glm::vec3>> solutions;
-    glm::vec4 newRay;
-
-    float t1 = (0.5f - ray.origin.x)/ray.direction.x;
-    newRay = ray.origin + t1*ray.direction;
-    if (newRay.x >= -0.5001 && newRay.x <= 0.5001 && newRay.y >= -0.5001 && newRay.y <= 0.5001 && newRay.z >= -0.5001 && newRay.z <= 0.5001 && t1 > 0) {
-        solutions.push_back({{t1}, glm::vec3{1, 0, 0}});
-    }
-    float t2 = (-0.5f - ray.origin.x)/ray.direction.x;
-    newRay = ray.origin + t2*ray.direction;
-    if (newRay.x >= -0.5001 && newRay.x <= 0.5001 && newRay.y >= -0.5001 && newRay.y <= 0.5001 && newRay.z >= -0.5001 && newRay.z <= 0.5001 && t2 > 0) {
-        solutions.push_back({{t2}, glm::vec3{-1, 0, 0}});
-    }
-    float t3 = (0.5f - ray.origin.y)/ray.direction.y;
-    newRay = ray.origin + t3*ray.direction;
-    if (newRay.x >= -0.5001 && newRay.x <= 0.5001 && newRay.y >= -0.5001 && newRay.y <= 0.5001 && newRay.z >= -0.5001 && newRay.z <= 0.5001 && t3 > 0) {
-        solutions.push_back({{t3}, glm::vec3{0, 1, 0}});
-    }
-    float t4 = (-0.5f - ray.origin.y)/ray.direction.y;
-    newRay = ray.origin + t4*ray.direction;
-    if (newRay.x >= -0.5001 && newRay.x <= 0.5001 && newRay.y >= -0.5001 && newRay.y <= 0.5001 && newRay.z >= -0.5001 && newRay.z <= 0.5001 && t4 > 0) {
-        solutions.push_back({{t4}, glm::vec3{0, -1, 0}});
-    }
-    float t5 = (0.5f - ray.origin.z)/ray.direction.z;
-    newRay = ray.origin + t5*ray.direction;
-    if (newRay.x >= -0.5001 && newRay.x <= 0.5001 && newRay.y >= -0.5001 && newRay.y <= 0.5001 && newRay.z >= -0.5001 && newRay.z <= 0.5001 && t5 > 0) {
-        solutions.push_back({{t5}, glm::vec3{0, 0, 1}});
-    }
-    float t6 = (-0.5f - ray.origin.z)/ray.direction.z;
-    newRay = ray.origin + t6*ray.direction;
-    if (newRay.x >= -0.5001 && newRay.x <= 0.5001 && newRay.y >= -0.5001 && newRay.y <= 0.5001 && newRay.z >= -0.5001 && newRay.z <= 0.5001 && t6 > 0) {
-        solutions.push_back({{t6}, glm::vec3{0, 0, -1}});
+    // Tests the face of the cube at t against the cube's (slightly padded) extent
+    template <bool anyHit>
+    inline bool cubeFace(const RayTracer::Ray &ray, float t, glm::vec3 faceNormal, RayTracer::Hit &hit) {
+        glm::vec4 newRay = ray.origin + t*ray.direction;
+        if (newRay.x >= -0.5001 && newRay.x <= 0.5001 && newRay.y >= -0.5001 && newRay.y <= 0.5001 && newRay.z >= -0.5001 && newRay.z <= 0.5001 && t > 0 && t < hit.t) {
+            hit.t = t;
+            hit.normal = faceNormal;
+            return anyHit;
+        }
+        return false;
     }
-    if (solutions.empty()) {
-        return {{}, {0, 0, 0}, false};
-    } else {
-        float min = get<0>(solutions[0]);
-        glm::vec3 normal = get<1>(solutions[0]);
-        for (int i = 1; i < solutions.size(); i++) {
-            if (get<0>(solutions[i]) < min) {
-                min = get<0>(solutions[i]);
-                normal = get<1>(solutions[i]);
-            }
+
+    template <bool anyHit>
+    bool cubeKernel(const RayTracer::Ray &ray, float tMax, RayTracer::Hit &hit) {
+        hit.t = tMax;
+        if (cubeFace<anyHit>(ray, (0.5f - ray.origin.x)/ray.direction.x, glm::vec3{1, 0, 0}, hit) ||
+            cubeFace<anyHit>(ray, (-0.5f - ray.origin.x)/ray.direction.x, glm::vec3{-1, 0, 0}, hit) ||
+            cubeFace<anyHit>(ray, (0.5f - ray.origin.y)/ray.direction.y, glm::vec3{0, 1, 0}, hit) ||
+            cubeFace<anyHit>(ray, (-0.5f - ray.origin.y)/ray.direction.y, glm::vec3{0, -1, 0}, hit) ||
+            cubeFace<anyHit>(ray, (0.5f - ray.origin.z)/ray.direction.z, glm::vec3{0, 0, 1}, hit) ||
+            cubeFace<anyHit>(ray, (-0.5f - ray.origin.z)/ray.direction.z, glm::vec3{0, 0, -1}, hit)) {
+            return true;
         }
-        return {{min}, normal, true};
+        return hit.t < tMax;
     }
 }
 
-vector<float> RayTracer::quadraticEquation(float a, float b, float c) {
+bool RayTracer::cylinderIntersect(const Ray &ray, Hit &hit) {
+    return cylinderKernel<false>(ray, INFINITY, hit);
+}
+
+bool RayTracer::coneIntersect(const Ray &ray, Hit &hit) {
+    return coneKernel<false>(ray, INFINITY, hit);
+}
+
+bool RayTracer::sphereIntersect(const Ray &ray, Hit &hit) {
+    return sphereKernel<false>(ray, INFINITY, hit);
+}
+
+bool RayTracer::cubeIntersect(const Ray &ray, Hit &hit) {
+    return cubeKernel<false>(ray, INFINITY, hit);
+}
+
+bool RayTracer::cylinderOccluded(const Ray &ray, float tMax) {
+    Hit hit;
+    return cylinderKernel<true>(ray, tMax, hit);
+}
+
+bool RayTracer::coneOccluded(const Ray &ray, float tMax) {
+    Hit hit;
+    return coneKernel<true>(ray, tMax, hit);
+}
+
+bool RayTracer::sphereOccluded(const Ray &ray, float tMax) {
+    Hit hit;
+    return sphereKernel<true>(ray, tMax, hit);
+}
+
+bool RayTracer::cubeOccluded(const Ray &ray, float tMax) {
+    Hit hit;
+    return cubeKernel<true>(ray, tMax, hit);
+}
+
+// Writes the positive roots of at^2 + bt + c into roots and returns how many there are
+int RayTracer::quadraticEquation(float a, float b, float c, float roots[2]) {
     float discriminant = powf(b, 2.f) - (4.f * a * c);
-    vector<float> solutions;
+    int count = 0;
     if (discriminant > 0) {
         float t1 = (-b + sqrt(powf(b, 2.f) - (4.f * a * c))) / (2.f * a);
         float t2 = (-b - sqrt(powf(b, 2.f) - (4.f * a * c))) / (2.f * a);
         if (t1 > 0) {
-            solutions.push_back(t1);
+            roots[count++] = t1;
         }
         if (t2 > 0) {
-            solutions.push_back(t2);
+            roots[count++] = t2;
         }
-        return solutions;
     } else if (discriminant == 0) {
         float t = -b / (2.f * a);
         if (t > 0) {
-            solutions.push_back(t);
+            roots[count++] = t;
+        }
+    }
+    return count;
+}
+
+namespace {
+    // The scalar fallback runs the single-ray kernels over the packet one ray at a time
+    template <bool (*kernel)(const RayTracer::Ray &, float, RayTracer::Hit &)>
+    int scalarPacketTest(const RayPacket &rays, PacketHit &hit) {
+        int hits = 0;
+        for (int i = 0; i < RayPacket::size; i++) {
+            RayTracer::Ray ray{{rays.originX[i], rays.originY[i], rays.originZ[i], 1.f}, {rays.directionX[i], rays.directionY[i], rays.directionZ[i], 0.f}};
+            RayTracer::Hit rayHit;
+            if (kernel(ray, hit.t[i], rayHit)) {
+                hit.t[i] = rayHit.t;
+                hit.normalX[i] = rayHit.normal.x;
+                hit.normalY[i] = rayHit.normal.y;
+                hit.normalZ[i] = rayHit.normal.z;
+                hits |= 1 << i;
+            }
+        }
+        return hits;
+    }
+
+    const PacketIntersectors scalarPacketIntersectors{1, scalarPacketTest<cubeKernel<false>>, scalarPacketTest<coneKernel<false>>,
+                                                      scalarPacketTest<cylinderKernel<false>>, scalarPacketTest<sphereKernel<false>>};
+
+#ifdef RAYTRACER_X86_SIMD
+    // Whether both the CPU and the operating system support AVX2
+    bool cpuSupportsAvx2() {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
         }
-        return solutions;
-    } else {
-        return solutions;
+        __cpuid(info, 1);
+        bool osSavesAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        return osSavesAvx && (info[1] & (1 << 5));
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+}
+
+const PacketIntersectors& packetIntersectors(int maxWidth) {
+    if (maxWidth <= 0) {
+        maxWidth = RayPacket::size;
+    }
+#ifdef RAYTRACER_X86_SIMD
+    static const bool avx2 = cpuSupportsAvx2();
+    if (avx2 && maxWidth >= 8) {
+        return avx2PacketIntersectors;
+    }
+    if (maxWidth >= 4) {
+        return ssePacketIntersectors;
     }
+#endif
+    return scalarPacketIntersectors;
 }
@@ -0,0 +1,44 @@
+#include "packet.h"
+
+#ifdef RAYTRACER_X86_SIMD
+
+#include <immintrin.h>
+#include "packetkernels.h"
+
+// Eight lanes of AVX. This file alone is compiled with AVX2 enabled (see CMakeLists.txt), and its
+// intersectors are only handed out once the CPU has been checked for AVX2 support.
+// FMA is deliberately left disabled so products and sums round separately, as in the scalar tests.
+
+namespace {
+    struct Float8 {
+        static constexpr int width = 8;
+        __m256 v;
+
+        Float8() = default;
+        Float8(__m256 v) : v(v) {}
+        Float8(float f) : v(_mm256_set1_ps(f)) {}
+
+        static Float8 load(const float *p) { return _mm256_load_ps(p); }
+        void store(float *p) const { _mm256_store_ps(p, v); }
+    };
+
+    inline Float8 operator+(Float8 a, Float8 b) { return _mm256_add_ps(a.v, b.v); }
+    inline Float8 operator-(Float8 a, Float8 b) { return _mm256_sub_ps(a.v, b.v); }
+    inline Float8 operator*(Float8 a, Float8 b) { return _mm256_mul_ps(a.v, b.v); }
+    inline Float8 operator/(Float8 a, Float8 b) { return _mm256_div_ps(a.v, b.v); }
+    inline Float8 operator-(Float8 a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.f)); }
+    inline Float8 operator<(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    inline Float8 operator<=(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+    inline Float8 operator>(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+    inline Float8 operator>=(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+    inline Float8 operator&(Float8 a, Float8 b) { return _mm256_and_ps(a.v, b.v); }
+    inline Float8 operator|(Float8 a, Float8 b) { return _mm256_or_ps(a.v, b.v); }
+    inline Float8 andNot(Float8 a, Float8 b) { return _mm256_andnot_ps(b.v, a.v); }
+    inline Float8 select(Float8 mask, Float8 a, Float8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+    inline Float8 sqrt(Float8 a) { return _mm256_sqrt_ps(a.v); }
+    inline int movemask(Float8 mask) { return _mm256_movemask_ps(mask.v); }
+}
+
+const PacketIntersectors avx2PacketIntersectors = makePacketIntersectors<Float8>();
+
+#endif
@@ -0,0 +1,42 @@
+#include "packet.h"
+
+#ifdef RAYTRACER_X86_SIMD
+
+#include <emmintrin.h>
+#include "packetkernels.h"
+
+// Four lanes of SSE, which every x86-64 CPU has
+
+namespace {
+    struct Float4 {
+        static constexpr int width = 4;
+        __m128 v;
+
+        Float4() = default;
+        Float4(__m128 v) : v(v) {}
+        Float4(float f) : v(_mm_set1_ps(f)) {}
+
+        static Float4 load(const float *p) { return _mm_load_ps(p); }
+        void store(float *p) const { _mm_store_ps(p, v); }
+    };
+
+    inline Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+    inline Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+    inline Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+    inline Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+    inline Float4 operator-(Float4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.f)); }
+    inline Float4 operator<(Float4 a, Float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+    inline Float4 operator<=(Float4 a, Float4 b) { return _mm_cmple_ps(a.v, b.v); }
+    inline Float4 operator>(Float4 a, Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+    inline Float4 operator>=(Float4 a, Float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+    inline Float4 operator&(Float4 a, Float4 b) { return _mm_and_ps(a.v, b.v); }
+    inline Float4 operator|(Float4 a, Float4 b) { return _mm_or_ps(a.v, b.v); }
+    inline Float4 andNot(Float4 a, Float4 b) { return _mm_andnot_ps(b.v, a.v); }
+    inline Float4 select(Float4 mask, Float4 a, Float4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+    inline Float4 sqrt(Float4 a) { return _mm_sqrt_ps(a.v); }
+    inline int movemask(Float4 mask) { return _mm_movemask_ps(mask.v); }
+}
+
+const PacketIntersectors ssePacketIntersectors = makePacketIntersectors<Float4>();
+
+#endif
@@ -0,0 +1,164 @@
+#include "lightgrid.h"
+#include <algorithm>
+#include <numeric>
+
+namespace {
+    // Whether a sphere reaches into the cone a spot light shines into, its outer angle around its direction
+    bool insideCone(const SceneLightData &light, glm::vec3 center, float radius) {
+        glm::vec3 toCenter = center - glm::vec3{light.pos};
+        float distance = glm::length(toCenter);
+        if (distance <= radius) {
+            return true;
+        }
+        float angle = glm::acos(glm::clamp(glm::dot(toCenter / distance, glm::normalize(glm::vec3{light.dir})), -1.f, 1.f));
+        float angularRadius = glm::asin(min(1.f, radius / distance));
+        // A little slack keeps points right on the cone's edge, which shading still lights
+        return angle - angularRadius <= light.angle + 1e-4f;
+    }
+
+    float distanceToBox(glm::vec3 point, const AABB &box) {
+        return glm::length(glm::max(glm::max(box.min - point, point - box.max), glm::vec3{0.f}));
+    }
+
+    // Moves the dimmest lights of [first, last) to its front, as many as add up to less than budget with total,
+    // adding them to total, and returns how many. Halves the range around its median instead of sorting it all.
+    int dimmest(pair<float, int> *first, pair<float, int> *last, float budget, float &total) {
+        int count = 0;
+        while (last - first > 16) {
+            pair<float, int> *middle = first + (last - first) / 2;
+            nth_element(first, middle, last);
+            float sum = 0.f;
+            for (pair<float, int> *light = first; light != middle; light++) {
+                sum += light->first;
+            }
+            if (total + sum < budget) {
+                total += sum;
+                count += int(middle - first);
+                first = middle;
+            } else {
+                last = middle;
+            }
+        }
+        sort(first, last);
+        for (; first != last && total + first->first < budget; first++) {
+            total += first->first;
+            count++;
+        }
+        return count;
+    }
+}
+
+float LightGrid::brightestIn(const SceneLightData &light, const AABB &cell) {
+    if (light.type != LightType::LIGHT_POINT && light.type != LightType::LIGHT_SPOT) {
+        return INFINITY;
+    }
+    float brightest = max({light.color.r, light.color.g, light.color.b});
+    if (brightest <= 0.f) {
+        return 0.f;
+    }
+    float c0 = light.function.x, c1 = light.function.y, c2 = light.function.z;
+    // Attenuation that doesn't fall off steadily has no bound worth finding
+    if (c0 < 0.f || c1 < 0.f || c2 < 0.f) {
+        return INFINITY;
+    }
+    if (light.type == LightType::LIGHT_SPOT && !insideCone(light, cell.centroid(), 0.5f * glm::length(cell.max - cell.min))) {
+        return 0.f;
+    }
+    float distance = distanceToBox(glm::vec3{light.pos}, cell);
+    return brightest * min(1.f, 1.f / (c0 + (distance * c1) + (distance * distance * c2)));
+}
+
+void LightGrid::build(const vector<SceneLightData> &lights, const AABB &sceneBounds) {
+    int lightCount = int(lights.size());
+    m_allLights.resize(lightCount);
+    iota(m_allLights.begin(), m_allLights.end(), 0);
+    int bounded = 0;
+    for (const SceneLightData &light : lights) {
+        if (light.type == LightType::LIGHT_POINT || light.type == LightType::LIGHT_SPOT) {
+            bounded++;
+        }
+    }
+    m_cellStarts.clear();
+    m_cellLights.clear();
+    m_cellCutoffs.clear();
+    m_resolution = 0;
+    if (!(sceneBounds.min.x <= sceneBounds.max.x) || lightCount == 0) {
+        return;
+    }
+
+    // Around 4 cells per light that doesn't reach everywhere, so each cell lists few of them
+    m_resolution = bounded == 0 ? 1 : glm::clamp(int(std::round(std::cbrt(4.f * float(bounded)))), 1, 32);
+    glm::vec3 extent = sceneBounds.max - sceneBounds.min;
+    glm::vec3 padding{1e-3f * max({extent.x, extent.y, extent.z}) + 1e-4f};
+    m_bounds = AABB{sceneBounds.min - padding, sceneBounds.max + padding};
+    m_cellSize = (m_bounds.max - m_bounds.min) / float(m_resolution);
+
+    int n = m_resolution;
+    vector<pair<float, int>> dim;
+    vector<uint8_t> dropped(lightCount, 0);
+    m_cellStarts.reserve(size_t(n) * n * n + 1);
+    m_cellCutoffs.reserve(size_t(n) * n * n);
+    m_cellStarts.push_back(0);
+    for (int z = 0; z < n; z++) {
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                glm::vec3 cellMin = m_bounds.min + glm::vec3{x, y, z} * m_cellSize;
+                AABB cell{cellMin, cellMin + m_cellSize};
+                dim.clear();
+                for (int index = 0; index < lightCount; index++) {
+                    float brightest = LightGrid::brightestIn(lights[index], cell);
+                    if (brightest < lightCutoff) {
+                        dim.push_back({brightest, index});
+                    }
+                }
+                float total = 0.f;
+                int count = dimmest(dim.data(), dim.data() + dim.size(), lightCutoff, total);
+                for (int k = 0; k < count; k++) {
+                    dropped[dim[k].second] = 1;
+                }
+                int kept = 0;
+                for (int index = 0; index < lightCount; index++) {
+                    if (dropped[index]) {
+                        dropped[index] = 0;
+                    } else {
+                        m_cellLights.push_back(index);
+                        LightType type = lights[index].type;
+                        kept += (type == LightType::LIGHT_POINT || type == LightType::LIGHT_SPOT) ? 1 : 0;
+                    }
+                }
+                m_cellStarts.push_back(int(m_cellLights.size()));
+                m_cellCutoffs.push_back(kept == 0 ? 0.f : (lightCutoff - total) / float(kept));
+            }
+        }
+    }
+}
+
+span<const int> LightGrid::lightsAt(const glm::vec3 &position) const {
+    if (m_resolution == 0) {
+        return allLights();
+    }
+    glm::vec3 cellPosition = glm::floor((position - m_bounds.min) / m_cellSize);
+    // Written so that NaN positions fail too
+    if (!glm::all(glm::greaterThanEqual(cellPosition, glm::vec3{0.f})) || !glm::all(glm::lessThan(cellPosition, glm::vec3{float(m_resolution)}))) {
+        return allLights();
+    }
+    glm::ivec3 cell = glm::ivec3(cellPosition);
+    int index = (cell.z * m_resolution + cell.y) * m_resolution + cell.x;
+    return span<const int>(m_cellLights.data() + m_cellStarts[index], size_t(m_cellStarts[index + 1] - m_cellStarts[index]));
+}
+
+float LightGrid::cutoffAt(const glm::vec3 &position) const {
+    if (m_resolution == 0) {
+        return 0.f;
+    }
+    glm::vec3 cellPosition = glm::floor((position - m_bounds.min) / m_cellSize);
+    if (!glm::all(glm::greaterThanEqual(cellPosition, glm::vec3{0.f})) || !glm::all(glm::lessThan(cellPosition, glm::vec3{float(m_resolution)}))) {
+        return 0.f;
+    }
+    glm::ivec3 cell = glm::ivec3(cellPosition);
+    return m_cellCutoffs[(cell.z * m_resolution + cell.y) * m_resolution + cell.x];
+}
+
+span<const int> LightGrid::allLights() const {
+    return span<const int>(m_allLights);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <span>
+#include <vector>
+#include "bvh.h"
+#include "utils/scenedata.h"
+
+using namespace std;
+
+// Which lights each cell of a uniform grid over a scene's shapes has to visit, so shading skips the lights too dim
+// to matter where it is. Inside a cell, a point or spot light adds at most its brightest channel times its
+// attenuation at the cell's nearest point, per unit of diffuse or specular weight, and nothing outside a spot
+// light's cone. Each cell drops its dimmest lights for as long as those bounds add up to less than lightCutoff, and
+// shares what is left of the cutoff between the point and spot lights it keeps: shading may still skip one where
+// it adds less than its share (see cutoffAt). So however many lights overlap, what a point loses stays under one
+// 8-bit step. Directional lights reach everywhere.
+// Every shading point lies on a shape, so it falls inside the grid; points outside it see every light.
+// Lights within a cell stay in scene order, so shading sums their contributions in the same order as before.
+
+// How much light a cell may drop in all: half of one 8-bit step, for diffuse and specular each
+const float lightCutoff = 1.f / 512.f;
+
+class LightGrid {
+public:
+    void build(const vector<SceneLightData> &lights, const AABB &sceneBounds);
+
+    // Indices into the scene's lights of the ones that may reach position
+    span<const int> lightsAt(const glm::vec3 &position) const;
+
+    // How little light a point or spot light of lightsAt(position) may add at position and still be skipped
+    float cutoffAt(const glm::vec3 &position) const;
+
+    // Every light's index
+    span<const int> allLights() const;
+
+    // The most light reaches anywhere in cell: its brightest channel times its attenuation, 1 / (c0 + c1 d + c2 d^2),
+    // at the cell's nearest point, or 0 when the cell is outside a spot light's cone. INFINITY for directional
+    // lights and attenuation that can't be bounded.
+    static float brightestIn(const SceneLightData &light, const AABB &cell);
+
+private:
+    AABB m_bounds;
+    int m_resolution = 0;  // cells along each axis
+    glm::vec3 m_cellSize{0.f};
+    vector<int> m_cellStarts; // cell c lists m_cellLights[m_cellStarts[c], m_cellStarts[c + 1])
+    vector<int> m_cellLights;
+    vector<float> m_cellCutoffs;
+    vector<int> m_allLights;
+};
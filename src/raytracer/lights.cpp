@@ -2,39 +2,67 @@
 #include "raytracescene.h"
 #include <iostream>
 
-RGBA RayTracer::toRGBA(const glm::vec4 &illumination) {
-    float r = 255 * min(max(illumination.x, 0.f), 1.f);
-    float g = 255 * min(max(illumination.y, 0.f), 1.f);
-    float b = 255 * min(max(illumination.z, 0.f), 1.f);
-    return RGBA{uint8_t(r), uint8_t(g), uint8_t(b)};
+namespace {
+    // The store slot of the shape that last blocked each light, per thread. Neighbouring shading points
+    // are usually shadowed by the same shape, so it is tested before the scene is traversed.
+    struct OccluderCache {
+        long long sceneId = -1;
+        vector<int> slots;
+    };
+
+    thread_local OccluderCache occluderCache;
 }
 
-RGBA RayTracer::phong(glm::vec3 position, glm::vec3 normal, glm::vec3 directionToCamera, SceneMaterial &material,
-                      const vector<SceneLightData> &lights, const SceneGlobalData &globalData, const vector<RenderShapeData> &shapes, const RayTraceScene &scene, bool recursive, RGBA textureColor) {
+// Returns the light leaving position toward the camera, unclamped: it is only tone mapped once the pixel's
+// samples are all in (see AccumulationBuffer)
+glm::vec3 RayTracer::phong(glm::vec3 position, glm::vec3 normal, glm::vec3 directionToCamera, const SceneMaterial &material,
+                      const vector<SceneLightData> &lights, const SceneGlobalData &globalData, const RayTraceScene &scene, bool recursive, RGBA textureColor,
+                      uint32_t *shadowed, bool shadowsKnown) {
     normal = glm::normalize(normal);
     directionToCamera = glm::normalize(directionToCamera);
 
-    glm::vec4 illumination(0, 0, 0, 1);
+    // When shadowed is given, which of the first 32 lights are blocked is kept in its bits, or with shadowsKnown
+    // read from them instead of traced
+    auto blocked = [&](int lightIndex, glm::vec3 direction, bool isDirectional, float tCheck) {
+        if (shadowed == nullptr || lightIndex >= 32) {
+            return RayTracer::checkShadow(position, direction, scene, lightIndex, isDirectional, tCheck);
+        }
+        uint32_t bit = 1u << lightIndex;
+        if (!shadowsKnown) {
+            bool occluded = RayTracer::checkShadow(position, direction, scene, lightIndex, isDirectional, tCheck);
+            *shadowed = occluded ? (*shadowed | bit) : (*shadowed & ~bit);
+        }
+        return (*shadowed & bit) != 0;
+    };
 
     float phong_r = globalData.ka * material.cAmbient.x;
     float phong_g = globalData.ka * material.cAmbient.y;
     float phong_b = globalData.ka * material.cAmbient.z;
 
-    for (const SceneLightData &light : lights) {
+    // With enableLightCulling, lights too dim to matter at position are skipped, shadow ray and all (see LightGrid);
+    // otherwise every light is visited. lights are the scene's, which the grid indexes.
+    const LightGrid *lightGrid = m_config.enableLightCulling ? &scene.getLightGrid() : nullptr;
+    float cutoff = (lightGrid != nullptr) ? lightGrid->cutoffAt(position) : 0.f;
+    auto tooDim = [&](float brightest) {
+        return brightest >= 0.f && brightest < cutoff;
+    };
+    for (int lightIndex : (lightGrid != nullptr) ? lightGrid->lightsAt(position) : scene.getLightIndices()) {
+        const SceneLightData &light = lights[lightIndex];
         float f_att, lambert, reflection, distance, redColor, greenColor, blueColor, innerTheta, outerTheta, currAngle, falloff, interpolationR, interpolationG, interpolationB;
         glm::vec3 source, specVec, textureFloats;
 
         switch (light.type) {
             case LightType::LIGHT_POINT:
 
-                distance = sqrt(pow(light.pos.x - position.x, 2) + pow(light.pos.y - position.y, 2) + pow(light.pos.z - position.z, 2));
+                distance = glm::distance(glm::vec3{light.pos}, position);
 
-                if (RayTracer::checkShadow(position, glm::normalize(glm::vec3{light.pos} - position), shapes, false, distance)) {
+                f_att = min(1.f, 1.f / (light.function.x + (distance * light.function.y) + (distance * distance * light.function.z)));
+
+                if (tooDim(f_att * max({light.color.x, light.color.y, light.color.z})) ||
+                    blocked(lightIndex, glm::normalize(glm::vec3{light.pos} - position), false, distance)) {
                     break;
                 }
 
-                f_att = min(1.f, float(1.f / (light.function.x + (distance * light.function.y) + (pow(distance, 2) * light.function.z))));
-
                 lambert = max(0.f, glm::dot(normal, glm::normalize(glm::vec3{light.pos} - position)));
 
                 textureFloats = {(textureColor.r/255.f), (textureColor.g/255.f), (textureColor.b/255.f)};
@@ -59,7 +87,7 @@ RGBA RayTracer::phong(glm::vec3 position, glm::vec3 normal, glm::vec3 directionT
 
             case LightType::LIGHT_DIRECTIONAL:
 
-                if (RayTracer::checkShadow(position, glm::normalize(glm::vec3{-light.dir}), shapes, true, 0.00)) {
+                if (blocked(lightIndex, glm::normalize(glm::vec3{-light.dir}), true, 0.00)) {
                     break;
                 }
 
@@ -89,15 +117,9 @@ RGBA RayTracer::phong(glm::vec3 position, glm::vec3 normal, glm::vec3 directionT
 
             case LightType::LIGHT_SPOT:
 
-                distance = sqrt(pow(light.pos.x - position.x, 2) + pow(light.pos.y - position.y, 2) + pow(light.pos.z - position.z, 2));
-
-                if (RayTracer::checkShadow(position, glm::normalize(glm::vec3{light.pos} - position), shapes, false, distance)) {
-                    break;
-                }
-
-                f_att = min(1.f, float(1.f / (light.function.x + (distance * light.function.y) + (pow(distance, 2) * light.function.z))));
+                distance = glm::distance(glm::vec3{light.pos}, position);
 
-                lambert = min(1.f, max(0.f, glm::dot(normal, glm::normalize(glm::vec3{light.pos} - position))));
+                // Points outside the cone are dark, so their shadow rays are never traced
                 outerTheta = light.angle;
                 innerTheta = light.angle - light.penumbra;
 
@@ -120,6 +142,15 @@ RGBA RayTracer::phong(glm::vec3 position, glm::vec3 normal, glm::vec3 directionT
                     break;
                 }
 
+                f_att = min(1.f, 1.f / (light.function.x + (distance * light.function.y) + (distance * distance * light.function.z)));
+
+                if (tooDim(f_att * max({redColor, greenColor, blueColor})) ||
+                    blocked(lightIndex, glm::normalize(glm::vec3{light.pos} - position), false, distance)) {
+                    break;
+                }
+
+                lambert = min(1.f, max(0.f, glm::dot(normal, glm::normalize(glm::vec3{light.pos} - position))));
+
                 textureFloats = {(textureColor.r/255.f), (textureColor.g/255.f), (textureColor.b/255.f)};
 
                 interpolationR = (material.blend * textureFloats.r) + ((1.f - material.blend) * (globalData.kd * material.cDiffuse.x));
@@ -146,188 +177,174 @@ RGBA RayTracer::phong(glm::vec3 position, glm::vec3 normal, glm::vec3 directionT
         }
     }
 
-    if (!recursive && (material.cReflective.x != 0 || material.cReflective.y != 0 || material.cReflective.z != 0)) {
-
-        glm::vec3 reflection = glm::reflect(-directionToCamera, normal);
-        glm::vec3 reflectedColor = RayTracer::recursiveReflection(position, reflection, 0, scene);
-
-        if (reflectedColor.x < 0) {
-            reflectedColor.x = 0.f;
-        } else if (reflectedColor.x > 1) {
-            reflectedColor.x = 1.f;
+    // Secondary rays start at primary hits only; traceSecondary follows them further itself
+    if (!recursive) {
+        const SceneGlobalData &global = scene.getGlobalData();
+        glm::vec3 reflective = global.ks * glm::vec3{material.cReflective};
+        glm::vec3 transparent = m_config.enableRefraction ? global.kt * glm::vec3{material.cTransparent} : glm::vec3{0.f};
+        glm::vec3 secondary{0.f};
+        // The same cutoff traceSecondary applies to the rays it follows further
+        auto visible = [&](glm::vec3 weight) {
+            return glm::any(glm::greaterThanEqual(weight, glm::vec3{m_config.minThroughput}));
+        };
+        if (visible(reflective)) {
+            glm::vec3 reflection = glm::reflect(-directionToCamera, normal);
+            glm::vec3 reflectedColor = RayTracer::traceSecondary(Ray{glm::vec4{position, 1.f}, glm::vec4{reflection, 0.f}}, reflective, scene);
+            secondary += reflective * reflectedColor;
         }
-        if (reflectedColor.y < 0) {
-            reflectedColor.y = 0.f;
-        } else if (reflectedColor.y > 1) {
-            reflectedColor.y = 1.f;
+        glm::vec3 refraction = visible(transparent) ? RayTracer::refractDirection(-directionToCamera, normal, material.ior) : glm::vec3{0.f};
+        if (refraction != glm::vec3{0.f}) {
+            glm::vec3 refractedColor = RayTracer::traceSecondary(Ray{glm::vec4{position, 1.f}, glm::vec4{refraction, 0.f}}, transparent, scene);
+            secondary += transparent * refractedColor;
         }
-        if (reflectedColor.z < 0) {
-            reflectedColor.z = 0.f;
-        } else if (reflectedColor.z > 1) {
-            reflectedColor.z = 1.f;
-        }
-
-        phong_r += (scene.m_globalData.ks * material.cReflective.x) * reflectedColor.r;
-        phong_g += (scene.m_globalData.ks * material.cReflective.y) * reflectedColor.g;
-        phong_b += (scene.m_globalData.ks * material.cReflective.z) * reflectedColor.b;
-
+        phong_r += secondary.r;
+        phong_g += secondary.g;
+        phong_b += secondary.b;
     }
 
-    illumination = {phong_r, phong_g, phong_b, 1};
-
-    RGBA returnValue = RayTracer::toRGBA(illumination);
-    return returnValue;
+    return glm::vec3{phong_r, phong_g, phong_b};
 }
 
-bool RayTracer::checkShadow(glm::vec3 origin, glm::vec3 direction, const vector<RenderShapeData> &shapes, bool isDirectional, float tCheck) {
-    tuple<vector<float>, glm::vec3, bool> result;
-    bool test = false;
-    Ray objectRay;
+// Returns whether anything blocks the light at lightIndex from origin, stopping at the first blocker found
+bool RayTracer::checkShadow(glm::vec3 origin, glm::vec3 direction, const RayTraceScene &scene, int lightIndex, bool isDirectional, float tCheck) {
+    RAYTRACER_COUNT(shadowRays, 1);
+    bool occluded = false;
     float epsilon = 0.01f;
-    glm::vec3 normal;
-    RenderShapeData closest;
-    Ray closestRay;
     glm::vec4 offsetDirection = {direction.x, direction.y, direction.z, 0};
     glm::vec4 offsetOrigin = {origin.x, origin.y, origin.z, 1};
     offsetOrigin += (epsilon * offsetDirection);
-    int shapeIndex = 0;
-    for (const RenderShapeData &shape : shapes) {
-        objectRay = {m_inverseCTMCache[shapeIndex] * offsetOrigin, m_inverseCTMCache[shapeIndex] * offsetDirection}; // to Object space
-        shapeIndex++;
-        switch (shape.primitive.type) {
-            case PrimitiveType::PRIMITIVE_CUBE:
-                result = RayTracer::cubeIntersect(objectRay);
-                test = get<2>(result);
-                if (test && (isDirectional || get<0>(result)[0] < tCheck + epsilon)) {
-                    return true;
-                }
-                break;
-            case PrimitiveType::PRIMITIVE_CONE:
-                result = RayTracer::coneIntersect(objectRay);
-                test = get<2>(result);
-                if (test && (isDirectional || get<0>(result)[0] < tCheck + epsilon)) {
-                    return true;
-                }
-                break;
-            case PrimitiveType::PRIMITIVE_CYLINDER:
-                result = RayTracer::cylinderIntersect(objectRay);
-                test = get<2>(result);
-                if (test && (isDirectional || get<0>(result)[0] < tCheck + epsilon)) {
-                    return true;
-                }
-                break;
-            case PrimitiveType::PRIMITIVE_SPHERE:
-                result = RayTracer::sphereIntersect(objectRay);
-                test = get<2>(result);
-                if (test && (isDirectional || get<0>(result)[0] < tCheck + epsilon)) {
-                    return true;
-                }
-                break;
-            case PrimitiveType::PRIMITIVE_MESH:
-                // not implemented, put here to suppress QT warnings
-                break;
-            case PrimitiveType::PRIMITIVE_TORUS:
-                // not implemented, put here to suppress QT warnings
-                break;
-        }
+    Ray ray{offsetOrigin, offsetDirection};
+    float tMax = isDirectional ? INFINITY : tCheck + epsilon;
+
+    if (occluderCache.sceneId != scene.id()) {
+        occluderCache.sceneId = scene.id();
+        occluderCache.slots.assign(scene.getLights().size(), -1);
     }
-    return false;
+    int &lastOccluder = occluderCache.slots[lightIndex];
+    if (lastOccluder != -1 && RayTracer::shapeOccluded(lastOccluder, ray, scene, tMax)) {
+        return true;
+    }
+    scene.visitCandidates(glm::vec3{offsetOrigin}, direction, tMax, m_config.enableAcceleration, [&](int slot) {
+        if (slot == lastOccluder) {
+            return false;
+        }
+        occluded = RayTracer::shapeOccluded(slot, ray, scene, tMax);
+        if (occluded) {
+            lastOccluder = slot;
+        }
+        return occluded;
+    });
+    return occluded;
 }
 
-glm::vec3 RayTracer::recursiveReflection(glm::vec3 origin, glm::vec3 direction, int depth, const RayTraceScene &scene) {
-    float t = 0.f, min = INFINITY, epsilon = 0.01f;
-    RenderShapeData closest;
-    vector<RenderShapeData> shapes = scene.m_shapes;
-    glm::vec3 normal;
-    tuple<vector<float>, glm::vec3, bool> result;
-    Ray objectRay, closestRay;
-    glm::vec4 offsetDirection = {direction.x, direction.y, direction.z, 0};
-    glm::vec4 offsetOrigin = {origin.x, origin.y, origin.z, 1};
-    offsetOrigin += (epsilon * offsetDirection);
-    int shapeIndex = 0;
-    for (const RenderShapeData &shape : shapes) {
-        objectRay = {m_inverseCTMCache[shapeIndex] * offsetOrigin, m_inverseCTMCache[shapeIndex] * offsetDirection}; // to Object space
-        shapeIndex++;
-        switch (shape.primitive.type) {
-            case PrimitiveType::PRIMITIVE_CUBE:
-                result = RayTracer::cubeIntersect(objectRay);
-                break;
-            case PrimitiveType::PRIMITIVE_CONE:
-                result = RayTracer::coneIntersect(objectRay);
-                break;
-            case PrimitiveType::PRIMITIVE_CYLINDER:
-                result = RayTracer::cylinderIntersect(objectRay);
-                break;
-            case PrimitiveType::PRIMITIVE_SPHERE:
-                result = RayTracer::sphereIntersect(objectRay);
-                break;
-            case PrimitiveType::PRIMITIVE_MESH:
-                // not implemented, put here to suppress QT warnings
-                break;
-            case PrimitiveType::PRIMITIVE_TORUS:
-                // not implemented, put here to suppress QT warnings
-                break;
+// Follows the secondary rays leaving a primary hit: ray itself, then the reflections and (with enableRefraction)
+// refractions of whatever it hits, depth first. Each hit is a frame on a fixed-capacity stack rather than a
+// recursive call. A frame's value is its own lighting plus its children's values, each scaled by the child's
+// weight (ks * cReflective or kt * cTransparent), so values are summed innermost first, as recursion would.
+// throughput is the weight ray carries into the pixel; a child whose throughput would fall under
+// minThroughput in every channel, or that would be more than maxBounces deep, is never traced.
+// Returns the value of ray, unclamped, or black when it hits nothing.
+glm::vec3 RayTracer::traceSecondary(const Ray &ray, glm::vec3 throughput, const RayTraceScene &scene) {
+    struct Frame {
+        glm::vec3 position;  // of the hit, in world space
+        glm::vec3 direction; // of the ray that hit, in world space
+        glm::vec3 normal;    // at the hit, normalized, in world space
+        glm::vec3 value;
+        glm::vec3 throughput;
+        glm::vec3 weight;    // of value in the parent frame
+        const SceneMaterial *material;
+        int nextChild;       // 0 while the reflection is pending, 1 while the refraction is, then 2
+    };
+    const int capacity = 16;
+    Frame stack[capacity];
+    int depth = 0;
+    int maxDepth = min(max(1, m_config.maxBounces), capacity);
+    const SceneGlobalData &globalData = scene.getGlobalData();
+
+    // Pushes the frame of the next hit along a ray from origin, or returns false if the ray escapes
+    auto push = [&](glm::vec3 origin, glm::vec3 direction, glm::vec3 rayThroughput, glm::vec3 weight) {
+        RAYTRACER_COUNT(secondaryRays, 1);
+        float min, epsilon = 0.01f;
+        glm::vec3 normal;
+        Ray closestRay;
+        glm::vec4 offsetDirection = {direction.x, direction.y, direction.z, 0};
+        glm::vec4 offsetOrigin = {origin.x, origin.y, origin.z, 1};
+        offsetOrigin += (epsilon * offsetDirection);
+        int closestIndex = RayTracer::closestHit(Ray{offsetOrigin, offsetDirection}, scene, min, normal, closestRay);
+        if (closestIndex == -1) {
+            return false;
         }
-        if (get<0>(result).empty()) {
-            continue;
+        const RenderShapeData &closest = scene.getShapes()[closestIndex];
+        const ShapeCache &cache = scene.getShapeCache(closestIndex);
+        // Compute object space normal at object space intersection
+        glm::vec4 worldIntersectPosition = closest.ctm * closestRay.origin;
+        glm::vec4 worldIntersectDirection = closest.ctm * closestRay.direction;
+        glm::vec3 intersect = glm::vec3{worldIntersectPosition + (min * worldIntersectDirection)};
+        // Transform object space normal to world space
+        glm::vec3 worldNormal = cache.normalMatrix * normal;
+
+        RGBA textureColor;
+        if (closest.primitive.material.textureMap.isUsed && cache.textureIndex != -1) {
+            textureColor = RayTracer::mapTexture(glm::vec3{closestRay.origin + (min * closestRay.direction)}, normal, closest, scene.getTextures()[cache.textureIndex]);
         } else {
-            t = get<0>(result)[0];
+            textureColor = RGBA{0, 0, 0};
         }
-        if (t < min) {
-            min = t;
-            normal = get<1>(result);
-            closest = shape;
-            closestRay = {objectRay.origin, objectRay.direction};
-        }
-    }
-    if (min == INFINITY) {
+        glm::vec3 color = RayTracer::phong(intersect, worldNormal, glm::vec3{offsetOrigin} - intersect, closest.primitive.material, scene.getLights(), globalData, scene, true, textureColor);
+
+        Frame &frame = stack[depth++];
+        frame.position = intersect;
+        frame.direction = glm::vec3{worldIntersectDirection};
+        frame.normal = glm::normalize(worldNormal);
+        frame.value = color;
+        frame.throughput = rayThroughput;
+        frame.weight = weight;
+        frame.material = &closest.primitive.material;
+        frame.nextChild = 0;
+        return true;
+    };
+
+    if (!push(glm::vec3{ray.origin}, glm::vec3{ray.direction}, throughput, glm::vec3{1.f})) {
         return {0.f, 0.f, 0.f};
     }
-    // Compute object space normal at object space intersection
-    glm::vec4 worldIntersectPosition = closest.ctm * closestRay.origin;
-    glm::vec4 worldIntersectDirection = closest.ctm * closestRay.direction;
-    glm::vec3 intersect = glm::vec3{worldIntersectPosition + (min * worldIntersectDirection)};
-    // Transform object space normal to world space
-    glm::vec3 worldNormal = glm::inverse(glm::transpose(glm::mat3(closest.ctm))) * normal;
-    // Use normal and intersection point (both in world space) for lighting computation
-
-    RGBA textureColor;
-    if (closest.primitive.material.textureMap.isUsed) {
-        textureColor = RayTracer::mapTexture(glm::vec3{closestRay.origin + (min * closestRay.direction)}, normal, closest);
-    } else {
-        textureColor = RGBA{0, 0, 0};
-    }
-
-    RGBA newColor = RayTracer::phong(intersect, worldNormal, glm::vec3{offsetOrigin} - intersect, closest.primitive.material, scene.m_lights, scene.m_globalData , scene.m_shapes, scene, true, textureColor);
-    glm::vec3 reflected = {newColor.r/255.f, newColor.g/255.f, newColor.b/255.f};
-
-    if (reflected.x < 0) {
-        reflected.x = 0.f;
-    } else if (reflected.x > 1) {
-        reflected.x = 1.f;
-    }
-    if (reflected.y < 0) {
-        reflected.y = 0.f;
-    } else if (reflected.y > 1) {
-        reflected.y = 1.f;
-    }
-    if (reflected.z < 0) {
-        reflected.z = 0.f;
-    } else if (reflected.z > 1) {
-        reflected.z = 1.f;
+    while (true) {
+        Frame &frame = stack[depth - 1];
+        const SceneMaterial &material = *frame.material;
+        if (frame.nextChild < 2 && depth < maxDepth) {
+            int child = frame.nextChild++;
+            glm::vec3 weight, direction;
+            if (child == 0) {
+                weight = globalData.ks * glm::vec3{material.cReflective};
+                direction = glm::reflect(frame.direction, frame.normal);
+            } else {
+                weight = m_config.enableRefraction ? globalData.kt * glm::vec3{material.cTransparent} : glm::vec3{0.f};
+                direction = RayTracer::refractDirection(frame.direction, frame.normal, material.ior);
+            }
+            glm::vec3 childThroughput = frame.throughput * weight;
+            bool visible = glm::any(glm::greaterThanEqual(childThroughput, glm::vec3{m_config.minThroughput}));
+            if (weight != glm::vec3{0.f} && visible && direction != glm::vec3{0.f}) {
+                push(frame.position, direction, childThroughput, weight);
+            }
+            continue;
+        }
+        // Every child is done, so the frame's value is final
+        if (--depth == 0) {
+            return frame.value;
+        }
+        Frame &parent = stack[depth - 1];
+        parent.value.x += frame.value.x * frame.weight.x;
+        parent.value.y += frame.value.y * frame.weight.y;
+        parent.value.z += frame.value.z * frame.weight.z;
     }
+}
 
-
-    if (depth < 3 && (closest.primitive.material.cReflective.x != 0 || closest.primitive.material.cReflective.y != 0 || closest.primitive.material.cReflective.z != 0)) {
-        glm::vec3 normalDirection = glm::vec3{worldIntersectDirection};
-        glm::vec3 normalWorld = glm::normalize(worldNormal);
-        glm::vec3 reflection = glm::reflect(normalDirection, normalWorld);
-        glm::vec3 next = RayTracer::recursiveReflection(intersect, reflection, depth + 1, scene);
-        reflected.x += next.x * (scene.m_globalData.ks * closest.primitive.material.cReflective.x);
-        reflected.y += next.y * (scene.m_globalData.ks * closest.primitive.material.cReflective.y);
-        reflected.z += next.z * (scene.m_globalData.ks * closest.primitive.material.cReflective.z);
-        return reflected;
-    } else {
-        return reflected;
+// The direction of a ray travelling along direction once it refracts through a surface with the given normal
+// (pointing out of the shape) into or out of a material with index of refraction ior. Rays travelling along
+// the normal are leaving the shape. Returns the zero vector on total internal reflection.
+glm::vec3 RayTracer::refractDirection(glm::vec3 direction, glm::vec3 normal, float ior) {
+    direction = glm::normalize(direction);
+    ior = (ior > 0.f) ? ior : 1.f;
+    if (glm::dot(direction, normal) > 0.f) {
+        return glm::refract(direction, -normal, ior);
     }
+    return glm::refract(direction, normal, 1.f / ior);
 }
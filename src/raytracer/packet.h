@@ -0,0 +1,46 @@
+#pragma once
+
+// Packets of rays for the SIMD intersectors. Rays are kept in structure-of-arrays form so each
+// component of every ray in a packet loads straight into one SIMD register.
+
+struct RayPacket {
+    static constexpr int size = 8;
+
+    alignas(32) float originX[size];
+    alignas(32) float originY[size];
+    alignas(32) float originZ[size];
+    alignas(32) float directionX[size];
+    alignas(32) float directionY[size];
+    alignas(32) float directionZ[size];
+};
+
+// The closest hits found so far for every ray of a packet, in the space of the primitive that was hit.
+// t doubles as each ray's tMax: a packet test only reports hits closer than t, and overwrites
+// t and the normal of the rays it hits. Unused rays are given t = 0 so they never hit anything.
+struct PacketHit {
+    alignas(32) float t[RayPacket::size];
+    alignas(32) float normalX[RayPacket::size];
+    alignas(32) float normalY[RayPacket::size];
+    alignas(32) float normalZ[RayPacket::size];
+};
+
+// Closest-hit tests of a packet of object-space rays against the unit primitives, implemented for one
+// instruction set. Every test returns a bitmask of the rays whose hit it moved closer.
+// The results match the scalar RayTracer intersectors bit for bit.
+struct PacketIntersectors {
+    int width; // rays per instruction: 8 for AVX2, 4 for SSE, 1 for the scalar fallback
+    int (*cube)(const RayPacket &rays, PacketHit &hit);
+    int (*cone)(const RayPacket &rays, PacketHit &hit);
+    int (*cylinder)(const RayPacket &rays, PacketHit &hit);
+    int (*sphere)(const RayPacket &rays, PacketHit &hit);
+};
+
+// The intersectors for the widest instruction set the CPU supports that is at most maxWidth rays wide
+// (no limit when maxWidth <= 0). Falls back to testing one ray at a time on CPUs without SSE or AVX2.
+const PacketIntersectors& packetIntersectors(int maxWidth);
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RAYTRACER_X86_SIMD
+extern const PacketIntersectors ssePacketIntersectors;
+extern const PacketIntersectors avx2PacketIntersectors;
+#endif
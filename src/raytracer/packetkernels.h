@@ -0,0 +1,185 @@
+#pragma once
+
+#include "packet.h"
+#include <cmath>
+
+// The packet intersectors, written once over a SIMD lane type and included by the translation unit of
+// each instruction set. Lanes must provide F::width, F::load, store, arithmetic and comparison operators
+// (comparisons return all-ones lane masks), &, |, andNot(a, b) = a & ~b, select(mask, a, b), sqrt and
+// movemask. Each kernel follows its scalar twin in implicitShapes.cpp operation for operation, so every
+// lane rounds exactly like a scalar test of the same ray would.
+//
+// Everything here lives in an anonymous namespace: each instruction set's translation unit gets its own
+// copy, compiled with its own flags, and the linker never mixes them up.
+
+namespace {
+    // The largest float that is at most 0.5001. The scalar cube test compares against the double 0.5001,
+    // and float comparisons against this bound give the same answers.
+    inline float cubeExtent() {
+        float extent = 0.5001f;
+        if (double(extent) > 0.5001) {
+            extent = nextafterf(extent, 0.f);
+        }
+        return extent;
+    }
+
+    // Both roots of at^2 + bt + c in every lane, with masks of the lanes where each is real and positive.
+    // A zero discriminant yields the same root twice, which the kernels' strict comparisons ignore.
+    template <typename F>
+    inline void quadraticEquation(F a, F b, F c, F roots[2], F valid[2]) {
+        F discriminant = (b * b) - ((F(4.f) * a) * c);
+        F real = discriminant >= F(0.f);
+        F root = sqrt(discriminant);
+        roots[0] = (-b + root) / (F(2.f) * a);
+        roots[1] = (-b - root) / (F(2.f) * a);
+        valid[0] = real & (roots[0] > F(0.f));
+        valid[1] = real & (roots[1] > F(0.f));
+    }
+
+    template <typename F>
+    struct PacketLanes {
+        F px, py, pz, dx, dy, dz;
+        F t, nx, ny, nz;
+        F hits;
+
+        PacketLanes(const RayPacket &rays, const PacketHit &hit, int base) :
+            px(F::load(rays.originX + base)), py(F::load(rays.originY + base)), pz(F::load(rays.originZ + base)),
+            dx(F::load(rays.directionX + base)), dy(F::load(rays.directionY + base)), dz(F::load(rays.directionZ + base)),
+            t(F::load(hit.t + base)), nx(F::load(hit.normalX + base)), ny(F::load(hit.normalY + base)), nz(F::load(hit.normalZ + base)),
+            hits(F(0.f) > F(0.f))
+        {}
+
+        // Moves the hit of the lanes in mask to tNew with the given normal
+        void update(F mask, F tNew, F normalX, F normalY, F normalZ) {
+            t = select(mask, tNew, t);
+            nx = select(mask, normalX, nx);
+            ny = select(mask, normalY, ny);
+            nz = select(mask, normalZ, nz);
+            hits = hits | mask;
+        }
+
+        int store(PacketHit &hit, int base) const {
+            t.store(hit.t + base);
+            nx.store(hit.normalX + base);
+            ny.store(hit.normalY + base);
+            nz.store(hit.normalZ + base);
+            return movemask(hits) << base;
+        }
+    };
+
+    // Tests the roots of a quadric against the unit-height side wall, as cylinderKernel and coneKernel do
+    template <typename F, typename Normal>
+    inline void sideWall(PacketLanes<F> &lanes, F roots[2], F valid[2], Normal normal) {
+        for (int i = 0; i < 2; i++) {
+            F y = lanes.py + roots[i] * lanes.dy;
+            F outside = (y > F(0.5f)) | (y < F(-0.5f)) | (roots[i] <= F(0.f)) | (roots[i] >= lanes.t);
+            F mask = andNot(valid[i], outside);
+            F x = lanes.px + roots[i] * lanes.dx;
+            F z = lanes.pz + roots[i] * lanes.dz;
+            F nx, ny, nz;
+            normal(x, y, z, nx, ny, nz);
+            lanes.update(mask, roots[i], nx, ny, nz);
+        }
+    }
+
+    template <typename F>
+    int cylinderLanes(const RayPacket &rays, PacketHit &hit, int base) {
+        PacketLanes<F> l(rays, hit, base);
+        F a = (l.dx * l.dx) + (l.dz * l.dz);
+        F b = ((F(2.f) * l.px) * l.dx) + ((F(2.f) * l.pz) * l.dz);
+        F c = ((l.px * l.px) + (l.pz * l.pz)) - F(0.25f);
+        F roots[2], valid[2];
+        quadraticEquation(a, b, c, roots, valid);
+        sideWall(l, roots, valid, [](F x, F, F z, F &nx, F &ny, F &nz) {
+            nx = F(2.f) * x;
+            ny = F(0.f);
+            nz = F(2.f) * z;
+        });
+        F t3 = (F(0.5f) - l.py) / l.dy;
+        F t4 = (F(-0.5f) - l.py) / l.dy;
+        F t3x = l.px + t3 * l.dx, t3z = l.pz + t3 * l.dz;
+        F t4x = l.px + t4 * l.dx, t4z = l.pz + t4 * l.dz;
+        F t3Check = (t3x * t3x) + (t3z * t3z);
+        F t4Check = (t4x * t4x) + (t4z * t4z);
+        l.update((t3Check <= F(0.25f)) & (t3 > F(0.f)) & (t3 < l.t), t3, F(0.f), F(1.f), F(0.f));
+        l.update((t4Check <= F(0.25f)) & (t4 > F(0.f)) & (t4 < l.t), t4, F(0.f), F(-1.f), F(0.f));
+        return l.store(hit, base);
+    }
+
+    template <typename F>
+    int coneLanes(const RayPacket &rays, PacketHit &hit, int base) {
+        PacketLanes<F> l(rays, hit, base);
+        F a = ((l.dx * l.dx) + (l.dz * l.dz)) - (F(0.25f) * (l.dy * l.dy));
+        F b = ((((F(2.f) * l.px) * l.dx) + ((F(2.f) * l.pz) * l.dz)) - ((F(0.5f) * l.py) * l.dy)) + (F(0.25f) * l.dy);
+        F c = ((((l.px * l.px) + (l.pz * l.pz)) - (F(0.25f) * (l.py * l.py))) + (F(0.25f) * l.py)) - F(0.0625f);
+        F roots[2], valid[2];
+        quadraticEquation(a, b, c, roots, valid);
+        sideWall(l, roots, valid, [](F x, F y, F z, F &nx, F &ny, F &nz) {
+            nx = F(2.f) * x;
+            ny = (F(-0.5f) * y) + F(0.25f);
+            nz = F(2.f) * z;
+        });
+        F t3 = (F(-0.5f) - l.py) / l.dy;
+        F t3x = l.px + (t3 * l.dx), t3z = l.pz + (t3 * l.dz);
+        F t3Check = (t3x * t3x) + (t3z * t3z);
+        l.update((t3Check <= F(0.25f)) & (t3 > F(0.f)) & (t3 < l.t), t3, F(0.f), F(-1.f), F(0.f));
+        return l.store(hit, base);
+    }
+
+    template <typename F>
+    int sphereLanes(const RayPacket &rays, PacketHit &hit, int base) {
+        PacketLanes<F> l(rays, hit, base);
+        F a = ((l.dx * l.dx) + (l.dy * l.dy)) + (l.dz * l.dz);
+        F b = (((F(2.f) * l.px) * l.dx) + ((F(2.f) * l.py) * l.dy)) + ((F(2.f) * l.pz) * l.dz);
+        F c = (((l.px * l.px) + (l.py * l.py)) + (l.pz * l.pz)) - F(0.25f);
+        F roots[2], valid[2];
+        quadraticEquation(a, b, c, roots, valid);
+        F closest = l.t;
+        F hits = l.hits;
+        for (int i = 0; i < 2; i++) {
+            F mask = valid[i] & (roots[i] < closest);
+            closest = select(mask, roots[i], closest);
+            hits = hits | mask;
+        }
+        // The normal is taken at the nearer root only, like sphereKernel
+        F x = l.px + closest * l.dx, y = l.py + closest * l.dy, z = l.pz + closest * l.dz;
+        l.update(hits, closest, F(2.f) * x, F(2.f) * y, F(2.f) * z);
+        return l.store(hit, base);
+    }
+
+    template <typename F>
+    inline void cubeFace(PacketLanes<F> &l, F t, F extent, float nx, float ny, float nz) {
+        F x = l.px + t * l.dx, y = l.py + t * l.dy, z = l.pz + t * l.dz;
+        F inside = (x >= -extent) & (x <= extent) & (y >= -extent) & (y <= extent) & (z >= -extent) & (z <= extent);
+        l.update(inside & (t > F(0.f)) & (t < l.t), t, F(nx), F(ny), F(nz));
+    }
+
+    template <typename F>
+    int cubeLanes(const RayPacket &rays, PacketHit &hit, int base) {
+        PacketLanes<F> l(rays, hit, base);
+        F extent(cubeExtent());
+        cubeFace(l, (F(0.5f) - l.px) / l.dx, extent, 1, 0, 0);
+        cubeFace(l, (F(-0.5f) - l.px) / l.dx, extent, -1, 0, 0);
+        cubeFace(l, (F(0.5f) - l.py) / l.dy, extent, 0, 1, 0);
+        cubeFace(l, (F(-0.5f) - l.py) / l.dy, extent, 0, -1, 0);
+        cubeFace(l, (F(0.5f) - l.pz) / l.dz, extent, 0, 0, 1);
+        cubeFace(l, (F(-0.5f) - l.pz) / l.dz, extent, 0, 0, -1);
+        return l.store(hit, base);
+    }
+
+    // Runs a kernel over a whole packet, F::width lanes at a time
+    template <typename F, int (*kernel)(const RayPacket &, PacketHit &, int)>
+    int packetTest(const RayPacket &rays, PacketHit &hit) {
+        int hits = 0;
+        for (int base = 0; base < RayPacket::size; base += F::width) {
+            hits |= kernel(rays, hit, base);
+        }
+        return hits;
+    }
+
+    template <typename F>
+    constexpr PacketIntersectors makePacketIntersectors() {
+        return PacketIntersectors{F::width, packetTest<F, cubeLanes<F>>, packetTest<F, coneLanes<F>>,
+                                  packetTest<F, cylinderLanes<F>>, packetTest<F, sphereLanes<F>>};
+    }
+}
@@ -0,0 +1,273 @@
+#include "raytracer.h"
+#include "raytracescene.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+    // A well-mixed 32-bit hash, so every path is a pure function of its pixel and sample and renders stay repeatable
+    uint32_t mixBits(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x7feb352dU;
+        x ^= x >> 15;
+        x *= 0x846ca68bU;
+        x ^= x >> 16;
+        return x;
+    }
+
+    float unitFloat(uint32_t bits) {
+        return float(bits >> 8) / float(1 << 24);
+    }
+
+    uint32_t reverseBits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+        x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+        x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Owen scrambling of a 32-bit fraction by hashing (Burley, "Practical Hash-based Owen Scrambling"): every bit
+    // is flipped or not depending on the seed and the bits above it only, so points that shared a power-of-two
+    // interval still do, and a (0, m, 2)-net stays one
+    uint32_t owenScramble(uint32_t x, uint32_t seed) {
+        x = reverseBits(x);
+        x ^= x * 0x3d20adeaU;
+        x += seed;
+        x *= (seed >> 16) | 1U;
+        x ^= x * 0x05526c56U;
+        x ^= x * 0x53a22864U;
+        return reverseBits(x);
+    }
+
+    // The first two dimensions of the Sobol sequence as 32-bit fractions. Every aligned run of 2^m of its points
+    // is a (0, m, 2)-net: each of the 2^m equal rectangles of the unit square holds one of them.
+    uint32_t sobol0(uint32_t index) {
+        return reverseBits(index);
+    }
+
+    uint32_t sobol1(uint32_t index) {
+        uint32_t bits = 0;
+        for (uint32_t v = 1U << 31; index != 0; index >>= 1, v ^= v >> 1) {
+            if (index & 1U) {
+                bits ^= v;
+            }
+        }
+        return bits;
+    }
+
+    // A cosine-weighted direction around the unit vector normal, for the point u of the unit square
+    glm::vec3 cosineDirection(glm::vec3 normal, glm::vec2 u) {
+        // A basis around normal without branches or a division by zero (Duff et al., "Building an Orthonormal Basis, Revisited")
+        float sign = std::copysign(1.f, normal.z);
+        float a = -1.f / (sign + normal.z);
+        float b = normal.x * normal.y * a;
+        glm::vec3 tangent{1.f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x};
+        glm::vec3 bitangent{b, sign + normal.y * normal.y * a, -normal.y};
+        float radius = std::sqrt(u.x), phi = 2.f * float(M_PI) * u.y;
+        return radius * std::cos(phi) * tangent + radius * std::sin(phi) * bitangent + std::sqrt(max(0.f, 1.f - u.x)) * normal;
+    }
+
+    float maxComponent(glm::vec3 v) {
+        return max({v.r, v.g, v.b});
+    }
+}
+
+// The random numbers of one path, two dimensions at a time. Each pair is the first two dimensions of the Sobol
+// sequence, Owen scrambled and with its points shuffled (again by Owen scrambling their indices), with a seed
+// per pixel and pair. Sample k of a pixel takes the k-th point of every pair. Shuffling keeps aligned runs
+// together, so the first 2^m samples of a pixel form a net in every pair, while the pairs and the pixels stay
+// uncorrelated.
+struct PathSampler {
+    uint32_t seed;
+    uint32_t index;
+    uint32_t dimension = 0;
+
+    glm::vec2 next2D() {
+        uint32_t pairSeed = mixBits(seed ^ mixBits(dimension++ * 0x9e3779b9U + 1U));
+        uint32_t shuffled = owenScramble(index, pairSeed);
+        return glm::vec2{unitFloat(owenScramble(sobol0(shuffled), mixBits(pairSeed ^ 0xa511e9b3U))),
+                         unitFloat(owenScramble(sobol1(shuffled), mixBits(pairSeed ^ 0x63d83595U)))};
+    }
+};
+
+// Path traces rows [y0, y1) into pixels, which holds their (y1 - y0) * width pixels, each taking as many
+// samples as it needs (see pathTracePixel). A pixel's paths depend on nothing but the pixel, so a window
+// matches the same rows of the whole image.
+bool RayTracer::pathTraceWindow(AccumulationBuffer::Pixel *pixels, const RayTraceScene &scene, int y0, int y1, Stats *stats, Progress *progress) {
+    const Camera &camera = scene.getCamera();
+    int width = scene.width();
+    glm::mat4 inverse = glm::inverse(camera.getViewMatrix());
+    bool lensSampled = m_config.enableDepthOfField && camera.getAperture() > 0.f && camera.getFocalLength() > 0.f;
+    float radius = lensSampled ? camera.getAperture() / 2.f : 0.f;
+    vector<RayCounters> pixelRays(rayStatsEnabled && stats != nullptr ? width * (y1 - y0) : 0);
+    RayCounters *pixelCounters = pixelRays.empty() ? nullptr : pixelRays.data();
+    if (progress != nullptr) {
+        progress->tiles = RayTracer::tileCount(width, y1 - y0);
+        progress->tilesDone = 0;
+    }
+
+    atomic<long long> samples = 0, refined = 0;
+    RayTracer::forEachTile(width, y0, y1, [&](int x0, int tileY0, int x1, int tileY1) {
+        long long tileSamples = 0, tileRefined = 0;
+        chargeRayCounters(nullptr, 0);
+        for (int j = tileY0; j < tileY1; j++) {
+            for (int i = x0; i < x1; i++) {
+                int index = ((j - y0) * width) + i;
+                pixels[index] = RayTracer::pathTracePixel(scene, inverse, i, j, radius);
+                tileSamples += pixels[index].samples;
+                if (int(pixels[index].samples) > m_config.minPathSamples) {
+                    tileRefined++;
+                }
+                chargeRayCounters(pixelCounters, index);
+            }
+        }
+        samples += tileSamples;
+        refined += tileRefined;
+    }, progress);
+
+    if (stats != nullptr) {
+        stats->pixels = (long long) width * (y1 - y0);
+        stats->samples = samples;
+        stats->refinedPixels = refined;
+        stats->blurredPixels = lensSampled ? stats->pixels : 0;
+        stats->reusedPrimaryHits = false;
+        stats->pixelRays = std::move(pixelRays);
+    }
+    return !(progress != nullptr && progress->cancelled);
+}
+
+// Takes paths through pixel (i, j) until its tone-mapped mean has converged: from minPathSamples on, and again
+// every time the count doubles, it stops once the standard error of that mean is under pathNoiseThreshold in
+// every channel, or after maxPathSamples. With a power-of-two minPathSamples, a pixel always stops on a whole
+// net of its sample sequence (see PathSampler). Flat and directly lit pixels stop after a few; pixels seeing
+// soft indirect light or glossy paths keep going.
+AccumulationBuffer::Pixel RayTracer::pathTracePixel(const RayTraceScene &scene, const glm::mat4 &inverse, int i, int j, float lensRadius) {
+    int maxSamples = max(1, m_config.maxPathSamples);
+    int checkpoint = max(2, m_config.minPathSamples);
+    glm::vec3 sum{0.f}, shownSum{0.f}, shownSquares{0.f};
+    int taken = 0;
+    while (taken < maxSamples) {
+        glm::vec3 color = RayTracer::pathSample(scene, inverse, i, j, uint32_t(taken), lensRadius);
+        glm::vec3 shown = AccumulationBuffer::toneMap(color);
+        sum += color;
+        shownSum += shown;
+        shownSquares += shown * shown;
+        taken++;
+        if (taken == checkpoint) {
+            checkpoint *= 2;
+            glm::vec3 mean = shownSum / float(taken);
+            glm::vec3 variance = glm::max(shownSquares / float(taken) - mean * mean, glm::vec3{0.f}) * (float(taken) / float(taken - 1));
+            if (glm::all(glm::lessThan(glm::sqrt(variance / float(taken)), glm::vec3{m_config.pathNoiseThreshold}))) {
+                break;
+            }
+        }
+    }
+    return AccumulationBuffer::Pixel{sum, uint32_t(taken)};
+}
+
+// The light carried by path sample of pixel (i, j), unclamped. Its first two dimensions place it in the pixel
+// and, with a lensRadius, on the lens.
+glm::vec3 RayTracer::pathSample(const RayTraceScene &scene, const glm::mat4 &inverse, int i, int j, uint32_t sample, float lensRadius) {
+    PathSampler sampler{mixBits(uint32_t(j * scene.width() + i) ^ 0x2c1b3c6dU), sample};
+    glm::vec2 offset = sampler.next2D();
+    glm::vec2 lensPoint = sampler.next2D();
+    glm::vec2 lens{0.f};
+    if (lensRadius > 0.f) {
+        float radius = lensRadius * std::sqrt(lensPoint.x), theta = 2.f * float(M_PI) * lensPoint.y;
+        lens = glm::vec2{radius * std::cos(theta), radius * std::sin(theta)};
+    }
+    return RayTracer::tracePath(RayTracer::primaryRay(scene, inverse, i + offset.x, j + offset.y, lens), scene, sampler);
+}
+
+// Follows a world-space ray from hit to hit, adding up the light it carries back, unclamped. At every hit:
+// - an emissive material adds its cEmissive;
+// - every light adds what phong lights the hit with, shadows included (next-event estimation). Point, spot and
+//   directional lights have no area for a path to hit, so this is how all of their light is found, once. The
+//   ambient term is left out, as the light bouncing between shapes it stands in for is traced instead;
+// - the path goes on in one direction, chosen between a cosine-weighted diffuse bounce, the mirror reflection
+//   (ks * cReflective) and, with enableRefraction, the refraction (kt * cTransparent), each in proportion to
+//   the largest channel of its weight. Dividing the weight by that chance keeps the estimate unbiased.
+// Paths are at most maxPathBounces hits long. Past the third hit, a path goes on with the chance of its
+// brightest throughput channel, at most 0.95, and the ones that do are scaled up by as much (Russian roulette).
+glm::vec3 RayTracer::tracePath(Ray ray, const RayTraceScene &scene, PathSampler &sampler) {
+    const SceneGlobalData &globalData = scene.getGlobalData();
+    SceneGlobalData direct = globalData;
+    direct.ka = 0.f;
+    glm::vec3 radiance{0.f}, throughput{1.f};
+    int maxBounces = max(1, m_config.maxPathBounces);
+    for (int bounce = 0; bounce < maxBounces; bounce++) {
+        if (bounce > 0) {
+            RAYTRACER_COUNT(secondaryRays, 1);
+        }
+        float t;
+        glm::vec3 normal;
+        Ray objectRay;
+        int index = RayTracer::closestHit(ray, scene, t, normal, objectRay);
+        if (index == -1) {
+            break;
+        }
+        const RenderShapeData &shape = scene.getShapes()[index];
+        const ShapeCache &cache = scene.getShapeCache(index);
+        const SceneMaterial &material = shape.primitive.material;
+        glm::vec3 position = glm::vec3{ray.origin + (t * ray.direction)};
+        glm::vec3 worldNormal = glm::normalize(cache.normalMatrix * normal);
+        glm::vec3 direction = glm::normalize(glm::vec3{ray.direction});
+        RGBA textureColor{0, 0, 0};
+        if (material.textureMap.isUsed && cache.textureIndex != -1) {
+            textureColor = RayTracer::mapTexture(glm::vec3{objectRay.origin + (t * objectRay.direction)}, normal, shape, scene.getTextures()[cache.textureIndex]);
+        }
+        radiance += throughput * glm::vec3{material.cEmissive};
+        radiance += throughput * RayTracer::phong(position, worldNormal, -direction, material, scene.getLights(), direct, scene, true, textureColor);
+        if (bounce + 1 == maxBounces) {
+            break;
+        }
+
+        // The same diffuse color phong lights the hit with
+        glm::vec3 textureFloats = glm::vec3{textureColor.r, textureColor.g, textureColor.b} / 255.f;
+        glm::vec3 weights[3] = {
+            material.blend * textureFloats + (1.f - material.blend) * globalData.kd * glm::vec3{material.cDiffuse},
+            globalData.ks * glm::vec3{material.cReflective},
+            m_config.enableRefraction ? globalData.kt * glm::vec3{material.cTransparent} : glm::vec3{0.f},
+        };
+        float chances[3] = {maxComponent(weights[0]), maxComponent(weights[1]), maxComponent(weights[2])};
+        float total = chances[0] + chances[1] + chances[2];
+        if (!(total > 0.f)) {
+            break;
+        }
+        glm::vec2 choice = sampler.next2D();
+        glm::vec2 u = sampler.next2D();
+        float pick = choice.x * total;
+        int lobe = pick < chances[0] ? 0 : (pick < chances[0] + chances[1] ? 1 : 2);
+        // Rounding can land pick past the last lobe that can be chosen
+        while (chances[lobe] == 0.f) {
+            lobe--;
+        }
+        glm::vec3 next;
+        if (lobe == 0) {
+            next = cosineDirection(glm::dot(worldNormal, direction) < 0.f ? worldNormal : -worldNormal, u);
+        } else if (lobe == 1) {
+            next = glm::reflect(direction, worldNormal);
+        } else {
+            next = RayTracer::refractDirection(direction, worldNormal, material.ior);
+            // Totally reflected
+            if (next == glm::vec3{0.f}) {
+                next = glm::reflect(direction, worldNormal);
+            }
+        }
+        throughput *= weights[lobe] * (total / chances[lobe]);
+
+        if (bounce >= 2) {
+            float survival = min(0.95f, maxComponent(throughput));
+            if (!(choice.y < survival)) {
+                break;
+            }
+            throughput /= survival;
+        }
+        float epsilon = 0.01f;
+        ray = Ray{glm::vec4{position + epsilon * next, 1.f}, glm::vec4{next, 0.f}};
+    }
+    return radiance;
+}
@@ -0,0 +1,50 @@
+#include "primitivestore.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+    // Spreads the low 10 bits of v so there are two zero bits between each of them
+    uint32_t expandBits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // The 30-bit Morton code of a point given in [0, 1]^3
+    uint32_t mortonCode(glm::vec3 p) {
+        p = glm::clamp(p * 1024.f, glm::vec3(0.f), glm::vec3(1023.f));
+        return (expandBits(uint32_t(p.x)) << 2) | (expandBits(uint32_t(p.y)) << 1) | expandBits(uint32_t(p.z));
+    }
+}
+
+void PrimitiveStore::build(const vector<RenderShapeData> &shapes, const vector<glm::mat4> &inverseCTMs, const vector<AABB> &bounds) {
+    int count = int(shapes.size());
+    AABB centroidBounds;
+    for (const AABB &box : bounds) {
+        centroidBounds.expand(box.centroid());
+    }
+    glm::vec3 extent = glm::max(centroidBounds.max - centroidBounds.min, glm::vec3(1e-6f));
+
+    vector<pair<uint32_t, int>> order(count);
+    for (int i = 0; i < count; i++) {
+        order[i] = {mortonCode((bounds[i].centroid() - centroidBounds.min) / extent), i};
+    }
+    sort(order.begin(), order.end());
+
+    m_types.resize(count);
+    m_inverseTransforms.resize(count);
+    m_shapeIndices.resize(count);
+    for (int slot = 0; slot < count; slot++) {
+        int index = order[slot].second;
+        m_types[slot] = uint8_t(shapes[index].primitive.type);
+        m_inverseTransforms[slot] = glm::mat4x3(inverseCTMs[index]);
+        m_shapeIndices[slot] = index;
+    }
+}
+
+int PrimitiveStore::size() const {
+    return int(m_types.size());
+}
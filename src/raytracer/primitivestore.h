@@ -0,0 +1,46 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+#include "utils/sceneparser.h"
+#include "bvh.h"
+
+using namespace std;
+
+// The per-primitive data read for every candidate during traversal, split out of RenderShapeData.
+// RenderShapeData carries the material (with its texture filenames), the mesh and the CTM, so
+// scanning it touches several cache lines per shape. Here each field lives in its own packed array:
+// a one-byte type tag, the top three rows of the world-to-object matrix (as four 3-component columns)
+// and the index of the shape the primitive came from, which leads back to its material and the rest
+// of the cold data. Primitives are stored in Morton order of their bounds' centroids, so primitives
+// that are close in space (and so are tested by the same rays) are close in memory.
+
+class PrimitiveStore {
+public:
+    // Fills the store from one entry per shape. bounds[i] must enclose shapes[i].
+    void build(const vector<RenderShapeData> &shapes, const vector<glm::mat4> &inverseCTMs, const vector<AABB> &bounds);
+
+    int size() const;
+
+    PrimitiveType type(int slot) const {
+        return PrimitiveType(m_types[slot]);
+    }
+
+    // The index into RenderData::shapes of the primitive in slot
+    int shapeIndex(int slot) const {
+        return m_shapeIndices[slot];
+    }
+
+    // Takes a world-space point (w = 1) or direction (w = 0) to the object space of the primitive in slot.
+    // The bottom row of an affine inverse is (0, 0, 0, 1), so w passes through unchanged.
+    glm::vec4 toObject(int slot, const glm::vec4 &v) const {
+        const glm::mat4x3 &m = m_inverseTransforms[slot];
+        return glm::vec4{(m[0] * v.x + m[1] * v.y) + (m[2] * v.z + m[3] * v.w), v.w};
+    }
+
+private:
+    vector<uint8_t> m_types;
+    vector<glm::mat4x3> m_inverseTransforms;
+    vector<int> m_shapeIndices;
+};
@@ -0,0 +1,107 @@
+#include "raystats.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <glm/glm.hpp>
+
+#ifdef RAYTRACER_STATS
+thread_local RayCounters rayCounters;
+#endif
+
+uint32_t RayCounters::cost() const {
+    uint32_t total = nodesVisited;
+    for (uint32_t calls : intersectorCalls) {
+        total += calls;
+    }
+    return total;
+}
+
+RayCounters& RayCounters::operator+=(const RayCounters &other) {
+    primaryRays += other.primaryRays;
+    shadowRays += other.shadowRays;
+    secondaryRays += other.secondaryRays;
+    nodesVisited += other.nodesVisited;
+    for (int type = 0; type < primitiveTypeCount; type++) {
+        intersectorCalls[type] += other.intersectorCalls[type];
+    }
+    return *this;
+}
+
+RayCounters RayCounters::share(int k, int count) const {
+    auto part = [&](uint32_t n) {
+        return n / count + (uint32_t(k) < n % count ? 1 : 0);
+    };
+    RayCounters result;
+    result.primaryRays = part(primaryRays);
+    result.shadowRays = part(shadowRays);
+    result.secondaryRays = part(secondaryRays);
+    result.nodesVisited = part(nodesVisited);
+    for (int type = 0; type < primitiveTypeCount; type++) {
+        result.intersectorCalls[type] = part(intersectorCalls[type]);
+    }
+    return result;
+}
+
+vector<RGBA> rayCostHeatmap(const vector<RayCounters> &pixelRays) {
+    uint32_t maxCost = 0;
+    for (const RayCounters &pixel : pixelRays) {
+        maxCost = max(maxCost, pixel.cost());
+    }
+    const glm::vec3 ramp[] = {{0.f, 0.f, 0.f}, {0.f, 0.f, 1.f}, {1.f, 0.f, 0.f}, {1.f, 1.f, 0.f}, {1.f, 1.f, 1.f}};
+    const int segments = int(size(ramp)) - 1;
+    float scale = log1p(float(maxCost));
+    vector<RGBA> image(pixelRays.size());
+    for (size_t i = 0; i < pixelRays.size(); i++) {
+        float x = scale > 0.f ? log1p(float(pixelRays[i].cost())) / scale * segments : 0.f;
+        int segment = min(int(x), segments - 1);
+        glm::vec3 color = glm::mix(ramp[segment], ramp[segment + 1], x - float(segment)) * 255.f + 0.5f;
+        image[i] = RGBA{uint8_t(color.r), uint8_t(color.g), uint8_t(color.b)};
+    }
+    return image;
+}
+
+string rayStatsTable(const vector<RayCounters> &pixelRays, int width) {
+    const char *typeNames[primitiveTypeCount] = {"cube", "cone", "cylinder", "torus", "sphere", "mesh", "plane", "inverted cube"};
+    // Rows 0 to 3 are the ray and node counters, the rest the intersector calls of each primitive type
+    const char *names[4] = {"primary rays", "shadow rays", "secondary rays", "BVH nodes visited"};
+    auto value = [](const RayCounters &pixel, int row) {
+        switch (row) {
+            case 0: return pixel.primaryRays;
+            case 1: return pixel.shadowRays;
+            case 2: return pixel.secondaryRays;
+            case 3: return pixel.nodesVisited;
+            default: return pixel.intersectorCalls[row - 4];
+        }
+    };
+
+    string table;
+    char line[160];
+    snprintf(line, sizeof(line), "%-24s %16s %12s %12s\n", "counter", "total", "per pixel", "max pixel");
+    table += line;
+    double pixels = max<double>(1.0, double(pixelRays.size()));
+    for (int row = 0; row < 4 + primitiveTypeCount; row++) {
+        unsigned long long total = 0;
+        uint32_t most = 0;
+        for (const RayCounters &pixel : pixelRays) {
+            total += value(pixel, row);
+            most = max(most, value(pixel, row));
+        }
+        // Primitives the scene doesn't use would only clutter the table
+        if (row >= 4 && total == 0) {
+            continue;
+        }
+        string name = row < 4 ? names[row] : string(typeNames[row - 4]) + " tests";
+        snprintf(line, sizeof(line), "%-24s %16llu %12.2f %12u\n", name.c_str(), total, double(total) / pixels, most);
+        table += line;
+    }
+
+    auto costliest = max_element(pixelRays.begin(), pixelRays.end(), [](const RayCounters &a, const RayCounters &b) {
+        return a.cost() < b.cost();
+    });
+    if (costliest != pixelRays.end() && width > 0) {
+        int index = int(costliest - pixelRays.begin());
+        snprintf(line, sizeof(line), "costliest pixel: (%d, %d), %u nodes and tests\n", index % width, index / width, costliest->cost());
+        table += line;
+    }
+    return table;
+}
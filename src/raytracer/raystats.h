@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "utils/rgba.h"
+
+using namespace std;
+
+// Instrumentation of where a render spends its work, per pixel. It is only built in with RAYTRACER_STATS
+// defined (the CMake option of the same name); otherwise RAYTRACER_COUNT expands to nothing and
+// chargeRayCounters is empty, so the ray tracer compiles to exactly what it would without them.
+//
+// Work is counted on the thread doing it, in rayCounters, and the render loops charge it to the pixel
+// they just traced. Work done for a packet of primary rays is split evenly over the packet's pixels.
+
+const int primitiveTypeCount = 8; // values of PrimitiveType
+
+struct RayCounters {
+    uint32_t primaryRays   = 0; // camera rays, including the probes that measure depth of field
+    uint32_t shadowRays    = 0;
+    uint32_t secondaryRays = 0; // reflected and refracted rays
+    uint32_t nodesVisited  = 0; // BVH nodes, of the scene and of meshes; a packet visiting a node counts once
+    uint32_t intersectorCalls[primitiveTypeCount] = {}; // rays tested against a primitive, by PrimitiveType
+
+    // BVH nodes plus intersector calls, a rough measure of the time a pixel took
+    uint32_t cost() const;
+
+    RayCounters& operator+=(const RayCounters &other);
+
+    // The k-th of count even shares of these counts, with remainders going to the first shares
+    RayCounters share(int k, int count) const;
+};
+
+#ifdef RAYTRACER_STATS
+const bool rayStatsEnabled = true;
+
+extern thread_local RayCounters rayCounters;
+
+#define RAYTRACER_COUNT(counter, n) (rayCounters.counter += uint32_t(n))
+#else
+const bool rayStatsEnabled = false;
+
+#define RAYTRACER_COUNT(counter, n) ((void) 0)
+#endif
+
+// Moves the work counted on this thread since the last call onto pixelRays[index, index + count),
+// split evenly, or drops it when pixelRays is null
+inline void chargeRayCounters([[maybe_unused]] RayCounters *pixelRays, [[maybe_unused]] int index, [[maybe_unused]] int count = 1) {
+#ifdef RAYTRACER_STATS
+    if (pixelRays != nullptr) {
+        for (int k = 0; k < count; k++) {
+            pixelRays[index + k] += rayCounters.share(k, count);
+        }
+    }
+    rayCounters = RayCounters{};
+#endif
+}
+
+// A false-color image of the cost of every pixel, on a log scale from black (no work) through blue, red and
+// yellow to white (the costliest pixel)
+vector<RGBA> rayCostHeatmap(const vector<RayCounters> &pixelRays);
+
+// A table of the totals, per-pixel averages and per-pixel maxima of every counter, and the costliest pixel
+string rayStatsTable(const vector<RayCounters> &pixelRays, int width);
@@ -1,141 +1,1002 @@
 #include "raytracer.h"
 #include "raytracescene.h"
+#include "threadpool.h"
+#include "packet.h"
+#include "gbuffer.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <future>
 #include <iostream>
 #include <ostream>
-#include <QString>
-#include <QImage>
 
 using namespace std;
 
+namespace {
+    // How many BVH subtrees a tile's primary rays may search, see BVH::cull
+    const int MAX_TILE_ENTRIES = 32;
+}
+
 RayTracer::RayTracer(Config config) :
     m_config(config)
 {}
 
-void RayTracer::render(RGBA *imageData, const RayTraceScene &scene) {
+void RayTracer::render(RGBA *imageData, const RayTraceScene &scene, Stats *stats, GBuffer *primaryHits) {
     // Note that we're passing `data` as a pointer (to its first element)
     // Recall from Lab 1 that you can access its elements like this: `data[i]`
+    AccumulationBuffer buffer;
+    RayTracer::render(buffer, scene, stats, primaryHits);
+    buffer.resolve(imageData);
+}
+
+bool RayTracer::render(AccumulationBuffer &buffer, const RayTraceScene &scene, Stats *stats, GBuffer *primaryHits, Progress *progress) {
+    if (buffer.width() != scene.width() || buffer.height() != scene.height()) {
+        buffer.reset(scene.width(), scene.height());
+    }
+    return RayTracer::renderWindow(buffer.pixels(), scene, 0, scene.height(), stats, primaryHits, progress);
+}
+
+void RayTracer::renderRows(RGBA *rows, const RayTraceScene &scene, int y0, int y1, Stats *stats) {
+    AccumulationBuffer buffer(scene.width(), y1 - y0);
+    RayTracer::renderWindow(buffer.pixels(), scene, y0, y1, stats, nullptr);
+    buffer.resolve(rows);
+}
+
+// Renders the scene in bands of bandHeight rows, top to bottom, handing each finished band to writeRows
+// (its pixels, first row and end row) before the next one is rendered. The band being written is the only
+// one kept alongside the band being rendered, so memory stays at two bands whatever the image size. For the same
+// reason, stats gets no pixelRays. Stops early, returning false, as soon as writeRows does.
+bool RayTracer::renderStreamed(const RayTraceScene &scene, int bandHeight, const function<bool(const RGBA *, int, int)> &writeRows,
+                               Stats *stats) {
+    int width = scene.width(), height = scene.height();
+    bandHeight = max(1, min(bandHeight, height));
+    vector<RGBA> bands[2] = {vector<RGBA>(size_t(width) * bandHeight), vector<RGBA>(size_t(width) * bandHeight)};
+    Stats total;
+    future<bool> writing;
+    int band = 0;
+    for (int y0 = 0; y0 < height; y0 += bandHeight, band ^= 1) {
+        int y1 = min(y0 + bandHeight, height);
+        Stats bandStats;
+        RayTracer::renderRows(bands[band].data(), scene, y0, y1, stats != nullptr ? &bandStats : nullptr);
+        total.pixels += bandStats.pixels;
+        total.samples += bandStats.samples;
+        total.refinedPixels += bandStats.refinedPixels;
+        total.blurredPixels += bandStats.blurredPixels;
+        // The previous band is written while this one renders; it has to be done before its buffer is reused
+        if (writing.valid() && !writing.get()) {
+            return false;
+        }
+        writing = async(launch::async, [&, band, y0, y1] {
+            return writeRows(bands[band].data(), y0, y1);
+        });
+    }
+    bool written = !writing.valid() || writing.get();
+    if (stats != nullptr) {
+        *stats = std::move(total);
+    }
+    return written;
+}
+
+// Renders rows [y0, y1) of the image into pixels, which holds (y1 - y0) rows of width pixels, replacing their samples.
+// Passes that look at neighbouring pixels also trace the rows they need around the window, so a window
+// matches the same rows of a whole render exactly. primaryHits and progress are only used for whole images.
+// Returns false when progress was cancelled.
+bool RayTracer::renderWindow(AccumulationBuffer::Pixel *pixels, const RayTraceScene &scene, int y0, int y1, Stats *stats, GBuffer *primaryHits,
+                             Progress *progress) {
+    // Path tracing takes every sample of a pixel itself, and keeps no primary hits
+    if (m_config.enablePathTracing) {
+        bool wholeImage = y0 == 0 && y1 == scene.height();
+        return RayTracer::pathTraceWindow(pixels, scene, y0, y1, stats, wholeImage ? progress : nullptr);
+    }
     Camera camera = scene.getCamera();
-    int width = scene.width(), height = scene.height(), k = 1;
+    int width = scene.width(), height = scene.height();
     glm::mat4 inverse = glm::inverse(camera.getViewMatrix());
 
-    // puts textures in a map, filename -> vector<RGBA>
-    for (const RenderShapeData &shape : scene.m_shapes) {
-        string filename = shape.primitive.material.textureMap.filename;
-        if (filename.empty() || (m_cachedTextures.find(filename) != m_cachedTextures.end())) {
-            continue;
+    // Supersampling compares every pixel with the first pass of its neighbours, so a window also traces the row
+    // above and below it. Rows from top to bottom are rendered into window, of which pixels is a part.
+    int margin = m_config.enableSuperSample ? 1 : 0;
+    int top = max(0, y0 - margin), bottom = min(height, y1 + margin);
+    int rows = bottom - top;
+    vector<AccumulationBuffer::Pixel> marginRows;
+    AccumulationBuffer::Pixel *window = pixels;
+    if (top != y0 || bottom != y1) {
+        marginRows.resize(size_t(width) * rows);
+        window = marginRows.data();
+    }
+    vector<RayCounters> pixelRays(rayStatsEnabled && stats != nullptr ? width * rows : 0);
+    RayCounters *pixelCounters = pixelRays.empty() ? nullptr : pixelRays.data();
+
+    // Only lights and materials changed since primaryHits was filled, so the pixel centers are just shaded again.
+    // Unless the lights moved too, which lights each hit sees is also known.
+    if (y0 != 0 || y1 != height) {
+        primaryHits = nullptr;
+        progress = nullptr;
+    }
+    bool reuseHits = primaryHits != nullptr && primaryHits->matches(scene);
+    bool reuseShadows = reuseHits && primaryHits->shadowsMatch(scene, m_config);
+    RayTracer::PrimaryHit *hits = nullptr;
+    if (primaryHits != nullptr) {
+        hits = reuseHits ? primaryHits->hits() : primaryHits->reset(scene, m_config);
+        if (reuseHits && !reuseShadows) {
+            primaryHits->resetShadows(scene, m_config);
         }
-        QImage textureImage;
-        QString file = QString::fromStdString(filename);
-        if (!textureImage.load(file)) {
-            cout << "Error loading texture" << endl;
-            continue;
+    }
+    bool lensPass = m_config.enableDepthOfField && camera.getAperture() > 0.f && camera.getFocalLength() > 0.f;
+    if (progress != nullptr) {
+        int passes = 1 + (lensPass ? 1 : 0) + (m_config.enableSuperSample ? 1 : 0);
+        progress->tiles = passes * RayTracer::tileCount(width, rows);
+        progress->tilesDone = 0;
+    }
+    RayTracer::forEachTile(width, top, bottom, [&](int x0, int tileY0, int x1, int tileY1) {
+        if (reuseHits) {
+            RayTracer::shadeTile(window, top, scene, inverse, x0, tileY0, x1, tileY1, hits, reuseShadows, pixelCounters);
+        } else {
+            RayTracer::renderTile(window, top, scene, inverse, x0, tileY0, x1, tileY1, pixelCounters, hits);
+        }
+    }, progress);
+    long long samples = reuseHits ? 0 : (long long) width * rows;
+    long long refinedPixels = 0, blurredPixels = 0;
+
+    // Pixels whose circle of confusion covers more than a pixel are traced again through the lens.
+    // The pinhole rays of the first pass already went through its center, which is all an in-focus pixel needs.
+    vector<uint8_t> blurred;
+    if (lensPass && !(progress != nullptr && progress->cancelled)) {
+        vector<float> diameters = RayTracer::circlesOfConfusion(scene, inverse, top, bottom, pixelCounters);
+        blurred.assign(width * rows, 0);
+        atomic<long long> lensSamples = 0, lensPixels = 0;
+        RayTracer::forEachTile(width, top, bottom, [&](int x0, int tileY0, int x1, int tileY1) {
+            int tileSamples = 0, tilePixels = 0;
+            chargeRayCounters(nullptr, 0);
+            for (int j = tileY0; j < tileY1; j++) {
+                for (int i = x0; i < x1; i++) {
+                    int index = ((j - top) * width) + i;
+                    if (diameters[index] > 1.f) {
+                        window[index] = RayTracer::depthOfFieldPixel(scene, inverse, i, j, diameters[index]);
+                        tileSamples += window[index].samples;
+                        chargeRayCounters(pixelCounters, index);
+                        blurred[index] = 1;
+                        tilePixels++;
+                    }
+                }
+            }
+            lensSamples += tileSamples;
+            lensPixels += tilePixels;
+        }, progress);
+        samples += lensSamples;
+        blurredPixels = lensPixels;
+    }
+
+    if (m_config.enableSuperSample) {
+        // Refinement decisions read the first pass as it would be shown, never another tile's refined pixels,
+        // so tiles stay independent
+        vector<glm::vec3> firstPass(size_t(width) * rows);
+        transform(window, window + firstPass.size(), firstPass.begin(), [](const AccumulationBuffer::Pixel &pixel) {
+            return AccumulationBuffer::toneMap(pixel.mean());
+        });
+        atomic<long long> extraSamples = 0, refined = 0;
+        RayTracer::forEachTile(width, y0, y1, [&](int x0, int tileY0, int x1, int tileY1) {
+            int tileSamples = 0, tileRefined = 0;
+            chargeRayCounters(nullptr, 0);
+            for (int j = tileY0; j < tileY1; j++) {
+                for (int i = x0; i < x1; i++) {
+                    int index = ((j - top) * width) + i;
+                    bool lensSampled = !blurred.empty() && blurred[index];
+                    if (!lensSampled && RayTracer::neighbourhoodContrast(firstPass.data(), width, rows, i, j - top) > m_config.superSampleThreshold) {
+                        window[index] = RayTracer::superSamplePixel(scene, inverse, i, j);
+                        tileSamples += window[index].samples;
+                        chargeRayCounters(pixelCounters, index);
+                        tileRefined++;
+                    }
+                }
+            }
+            extraSamples += tileSamples;
+            refined += tileRefined;
+        }, progress);
+        samples += extraSamples;
+        refinedPixels = refined;
+    }
+
+    if (window != pixels) {
+        copy(window + size_t(y0 - top) * width, window + size_t(y1 - top) * width, pixels);
+        if (!pixelRays.empty()) {
+            pixelRays.erase(pixelRays.begin() + size_t(y1 - top) * width, pixelRays.end());
+            pixelRays.erase(pixelRays.begin(), pixelRays.begin() + size_t(y0 - top) * width);
+        }
+    }
+    if (stats != nullptr) {
+        stats->pixels = (long long) width * (y1 - y0);
+        stats->samples = samples;
+        stats->refinedPixels = refinedPixels;
+        stats->blurredPixels = blurredPixels;
+        stats->reusedPrimaryHits = reuseHits;
+        stats->pixelRays = std::move(pixelRays);
+    }
+    if (progress != nullptr && progress->cancelled) {
+        // Some of the hits were never traced
+        if (primaryHits != nullptr) {
+            primaryHits->clear();
+        }
+        return false;
+    }
+    return true;
+}
+
+// Calls renderTile(x0, y0, x1, y1) over rows [top, bottom) of the image: once when parallelism is off, otherwise
+// once per tile. Tiles are handed out through the shared pool's work-stealing deques.
+// With progress, the image is split into tiles even when parallelism is off, tiles are skipped once it is
+// cancelled, and every tile traced is counted and reported to it.
+// Every pixel is traced independently, so the image matches the serial path exactly.
+void RayTracer::forEachTile(int width, int top, int bottom, const function<void(int, int, int, int)> &renderTile, Progress *progress) {
+    if (!m_config.enableParallelism && progress == nullptr) {
+        renderTile(0, top, width, bottom);
+        return;
+    }
+    int tileSize = max(1, m_config.tileSize);
+    int tilesX = (width + tileSize - 1) / tileSize;
+    auto runTile = [&](int tile) {
+        if (progress != nullptr && progress->cancelled) {
+            return;
+        }
+        int x0 = (tile % tilesX) * tileSize;
+        int y0 = top + (tile / tilesX) * tileSize;
+        int x1 = min(x0 + tileSize, width), y1 = min(y0 + tileSize, bottom);
+        renderTile(x0, y0, x1, y1);
+        if (progress != nullptr) {
+            progress->tilesDone++;
+            if (progress->tileDone) {
+                progress->tileDone(x0, y0, x1, y1);
+            }
+        }
+    };
+    int tiles = RayTracer::tileCount(width, bottom - top);
+    if (!m_config.enableParallelism) {
+        for (int tile = 0; tile < tiles; tile++) {
+            runTile(tile);
+        }
+        return;
+    }
+    ThreadPool::shared().parallelFor(tiles, m_config.threadCount, [&](int tile, int) {
+        runTile(tile);
+    });
+}
+
+// How many tiles forEachTile splits rows rows of width pixels into
+int RayTracer::tileCount(int width, int rows) const {
+    int tileSize = max(1, m_config.tileSize);
+    return ((width + tileSize - 1) / tileSize) * ((rows + tileSize - 1) / tileSize);
+}
+
+// The largest difference in any channel between the pixels of the 3x3 block around (i, j), of tone-mapped colors
+float RayTracer::neighbourhoodContrast(const glm::vec3 *image, int width, int height, int i, int j) {
+    glm::vec3 low{INFINITY}, high{-INFINITY};
+    for (int y = max(0, j - 1); y <= min(height - 1, j + 1); y++) {
+        for (int x = max(0, i - 1); x <= min(width - 1, i + 1); x++) {
+            low = glm::min(low, image[(y * width) + x]);
+            high = glm::max(high, image[(y * width) + x]);
+        }
+    }
+    glm::vec3 range = high - low;
+    return max({range.r, range.g, range.b});
+}
+
+namespace {
+    // A well-mixed 32-bit hash, so jitter is a pure function of pixel and sample and renders stay repeatable
+    uint32_t mixBits(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x7feb352dU;
+        x ^= x >> 15;
+        x *= 0x846ca68bU;
+        x ^= x >> 16;
+        return x;
+    }
+
+    float unitFloat(uint32_t bits) {
+        return float(bits >> 8) / float(1 << 24);
+    }
+
+    // The k-th stratum of an n x n grid (n a power of two) in an order whose every prefix of 4^m strata
+    // covers the pixel evenly: the first 4 land in different quadrants, the first 16 in different 4x4 cells.
+    void stratum(int k, int n, int &sx, int &sy) {
+        int bits = 0;
+        while ((1 << bits) < n * n) {
+            bits++;
+        }
+        int reversed = 0;
+        for (int b = 0; b < bits; b++) {
+            reversed |= ((k >> b) & 1) << (bits - 1 - b);
+        }
+        sx = 0;
+        sy = 0;
+        for (int b = 0; 2 * b < bits; b++) {
+            sx |= ((reversed >> (2 * b)) & 1) << b;
+            sy |= ((reversed >> (2 * b + 1)) & 1) << b;
+        }
+    }
+}
+
+// Takes jittered samples from a grid of strata over pixel (i, j), 4 at a time, stopping once the standard
+// deviation of their tone-mapped colors is under superSampleThreshold in every channel or maxSamples have been taken.
+AccumulationBuffer::Pixel RayTracer::superSamplePixel(const RayTraceScene &scene, const glm::mat4 &inverse, int i, int j) {
+    const PacketIntersectors &intersectors = packetIntersectors(m_config.simdWidth);
+    int maxSamples = max(4, m_config.maxSamples);
+    int n = 2;
+    while (n * n < maxSamples) {
+        n *= 2;
+    }
+    uint32_t seed = mixBits(uint32_t(j * scene.width() + i));
+    glm::vec3 sum{0.f}, shownSum{0.f}, shownSquares{0.f};
+    int taken = 0;
+    while (taken < maxSamples) {
+        Ray rays[4];
+        glm::vec3 colors[4];
+        int count = min(4, maxSamples - taken);
+        for (int k = 0; k < count; k++) {
+            int sx, sy;
+            stratum(taken + k, n, sx, sy);
+            uint32_t jitter = mixBits(seed ^ uint32_t(taken + k) * 0x9e3779b9U);
+            float px = i + (sx + unitFloat(jitter)) / n;
+            float py = j + (sy + unitFloat(mixBits(jitter))) / n;
+            rays[k] = RayTracer::primaryRay(scene, inverse, px, py);
+        }
+        if (intersectors.width > 1) {
+            RayTracer::tracePacket(rays, count, scene, intersectors, colors);
+        } else {
+            for (int k = 0; k < count; k++) {
+                colors[k] = RayTracer::traceRay(rays[k], scene);
+            }
+        }
+        for (int k = 0; k < count; k++) {
+            glm::vec3 shown = AccumulationBuffer::toneMap(colors[k]);
+            sum += colors[k];
+            shownSum += shown;
+            shownSquares += shown * shown;
+        }
+        taken += count;
+        glm::vec3 mean = shownSum / float(taken);
+        glm::vec3 variance = glm::max(shownSquares / float(taken) - mean * mean, glm::vec3{0.f});
+        if (glm::all(glm::lessThan(glm::sqrt(variance), glm::vec3{m_config.superSampleThreshold}))) {
+            break;
+        }
+    }
+    return AccumulationBuffer::Pixel{sum, uint32_t(taken)};
+}
+
+// The diameter in pixels of the circle of confusion of what the center of every pixel in rows [y0, y1) sees. A blurred point
+// spreads over the pixels its circle covers, so each pixel then takes the largest circle covering it, within
+// 32 pixels. That way an out-of-focus foreground also blurs the in-focus pixels just around it.
+vector<float> RayTracer::circlesOfConfusion(const RayTraceScene &scene, const glm::mat4 &inverse, int y0, int y1, RayCounters *pixelRays) {
+    const Camera &camera = scene.getCamera();
+    int width = scene.width(), height = scene.height();
+    float aperture = camera.getAperture(), focus = camera.getFocalLength();
+    // The size of a pixel on the plane in focus
+    float pixelSize = 2.f * std::tan(camera.getHeightAngle() / 2.f) * focus / float(height);
+    // Circles reach into rows [y0, y1) from as far as maxReach rows around them
+    const int maxReach = 32;
+    int top = max(0, y0 - maxReach), bottom = min(height, y1 + maxReach);
+    int rowCount = bottom - top;
+    vector<float> diameters(width * rowCount);
+    RayTracer::forEachTile(width, top, bottom, [&](int x0, int tileY0, int x1, int tileY1) {
+        chargeRayCounters(nullptr, 0);
+        for (int j = tileY0; j < tileY1; j++) {
+            for (int i = x0; i < x1; i++) {
+                float depth;
+                glm::vec3 normal;
+                Ray objectRay;
+                // Primary directions are one unit long along the view axis, so t is the depth of the hit
+                int hit = RayTracer::closestHit(RayTracer::primaryRay(scene, inverse, i + 0.5f, j + 0.5f), scene, depth, normal, objectRay);
+                float blur = (hit == -1) ? aperture : aperture * glm::abs(depth - focus) / depth;
+                diameters[((j - top) * width) + i] = blur / pixelSize;
+                chargeRayCounters(j >= y0 && j < y1 ? pixelRays : nullptr, ((j - y0) * width) + i);
+            }
+        }
+    });
+
+    // A square dilation, first along rows then along columns, keeping circles that reach far enough
+    auto dilate = [&](const vector<float> &from, vector<float> &to, int step, int count, int stride, int lines) {
+        for (int line = 0; line < lines; line++) {
+            for (int k = 0; k < count; k++) {
+                int index = (line * stride) + (k * step);
+                float largest = from[index];
+                for (int d = 1; d <= maxReach; d++) {
+                    if (k - d >= 0 && from[index - (d * step)] >= 2.f * d) {
+                        largest = max(largest, from[index - (d * step)]);
+                    }
+                    if (k + d < count && from[index + (d * step)] >= 2.f * d) {
+                        largest = max(largest, from[index + (d * step)]);
+                    }
+                }
+                to[index] = largest;
+            }
+        }
+    };
+    vector<float> rows(diameters.size());
+    dilate(diameters, rows, 1, width, width, rowCount);
+    dilate(rows, diameters, width, rowCount, 1, width);
+    return vector<float>(diameters.begin() + size_t(y0 - top) * width, diameters.begin() + size_t(y1 - top) * width);
+}
+
+namespace {
+    // The base-2 radical inverse of i: its bits mirrored around the binary point
+    float radicalInverse(uint32_t i) {
+        i = (i << 16) | (i >> 16);
+        i = ((i & 0x00ff00ffU) << 8) | ((i & 0xff00ff00U) >> 8);
+        i = ((i & 0x0f0f0f0fU) << 4) | ((i & 0xf0f0f0f0U) >> 4);
+        i = ((i & 0x33333333U) << 2) | ((i & 0xccccccccU) >> 2);
+        i = ((i & 0x55555555U) << 1) | ((i & 0xaaaaaaaaU) >> 1);
+        return float(i >> 8) / float(1 << 24);
+    }
+
+    // Maps the unit square onto the unit disk (Shirley and Chiu's concentric map), keeping strata compact
+    glm::vec2 concentricDisk(float a, float b) {
+        a = 2.f * a - 1.f;
+        b = 2.f * b - 1.f;
+        if (a == 0.f && b == 0.f) {
+            return {0.f, 0.f};
+        }
+        float radius, theta;
+        if (glm::abs(a) > glm::abs(b)) {
+            radius = a;
+            theta = float(M_PI / 4) * (b / a);
+        } else {
+            radius = b;
+            theta = float(M_PI / 2) - float(M_PI / 4) * (a / b);
+        }
+        return radius * glm::vec2{std::cos(theta), std::sin(theta)};
+    }
+}
+
+// Averages rays through the center of pixel (i, j) from points spread over the lens. The number of rays grows
+// with the area of the circle of confusion, diameter pixels wide, in powers of two up to maxLensSamples.
+// The lens points are a Hammersley set, stratified in both directions, shifted by a per-pixel offset so
+// neighbouring pixels don't repeat each other's pattern.
+AccumulationBuffer::Pixel RayTracer::depthOfFieldPixel(const RayTraceScene &scene, const glm::mat4 &inverse, int i, int j, float diameter) {
+    const PacketIntersectors &intersectors = packetIntersectors(m_config.simdWidth);
+    float radius = scene.getCamera().getAperture() / 2.f;
+    int count = 1;
+    while (float(count) < diameter * diameter && count * 2 <= m_config.maxLensSamples) {
+        count *= 2;
+    }
+    uint32_t seed = mixBits(uint32_t(j * scene.width() + i) ^ 0x5bd1e995U);
+    glm::vec2 shift = {unitFloat(seed), unitFloat(mixBits(seed))};
+    glm::vec3 sum{0.f};
+    for (int base = 0; base < count; base += RayPacket::size) {
+        Ray rays[RayPacket::size];
+        glm::vec3 colors[RayPacket::size];
+        int batch = min(int(RayPacket::size), count - base);
+        for (int k = 0; k < batch; k++) {
+            glm::vec2 point = glm::fract(glm::vec2{(base + k + 0.5f) / count, radicalInverse(base + k)} + shift);
+            rays[k] = RayTracer::primaryRay(scene, inverse, i + 0.5f, j + 0.5f, radius * concentricDisk(point.x, point.y));
+        }
+        if (intersectors.width > 1) {
+            RayTracer::tracePacket(rays, batch, scene, intersectors, colors);
+        } else {
+            for (int k = 0; k < batch; k++) {
+                colors[k] = RayTracer::traceRay(rays[k], scene);
+            }
+        }
+        for (int k = 0; k < batch; k++) {
+            sum += colors[k];
+        }
+    }
+    return AccumulationBuffer::Pixel{sum, uint32_t(count)};
+}
+
+namespace {
+    // The k-th point of the R2 sequence (Roberts' additive recurrence on the plastic number), whose every run of
+    // consecutive points covers the unit square evenly however many there are
+    glm::vec2 r2Point(uint32_t k) {
+        return glm::vec2{std::fmod(0.5 + k * 0.7548776662466927, 1.0), std::fmod(0.5 + k * 0.5698402909980532, 1.0)};
+    }
+}
+
+// Adds samples more samples to every pixel of buffer, which is first cleared when it isn't the scene's size.
+// Sample k of a pixel is jittered over it by the k-th point of the R2 sequence, and with depth of field is traced
+// from a point on the lens drawn from its own low-discrepancy sequence, both shifted per pixel. So each call picks
+// up every pixel's samples where the last left off, and however many calls are made, the samples stay spread
+// evenly: refining in passes converges like taking all the samples at once. Path traced pixels take the next
+// samples of their own sequence instead (see pathtracer.cpp), every pixel as many, converged or not.
+bool RayTracer::refine(AccumulationBuffer &buffer, const RayTraceScene &scene, int samples, Stats *stats, Progress *progress) {
+    const Camera &camera = scene.getCamera();
+    int width = scene.width(), height = scene.height();
+    if (buffer.width() != width || buffer.height() != height) {
+        buffer.reset(width, height);
+    }
+    samples = max(0, samples);
+    glm::mat4 inverse = glm::inverse(camera.getViewMatrix());
+    const PacketIntersectors &intersectors = packetIntersectors(m_config.simdWidth);
+    bool lensSampled = m_config.enableDepthOfField && camera.getAperture() > 0.f && camera.getFocalLength() > 0.f;
+    float radius = lensSampled ? camera.getAperture() / 2.f : 0.f;
+    vector<RayCounters> pixelRays(rayStatsEnabled && stats != nullptr ? width * height : 0);
+    RayCounters *pixelCounters = pixelRays.empty() ? nullptr : pixelRays.data();
+    AccumulationBuffer::Pixel *pixels = buffer.pixels();
+    if (progress != nullptr) {
+        progress->tiles = RayTracer::tileCount(width, height);
+        progress->tilesDone = 0;
+    }
+
+    RayTracer::forEachTile(width, 0, height, [&](int x0, int y0, int x1, int y1) {
+        chargeRayCounters(nullptr, 0);
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                int index = (j * width) + i;
+                AccumulationBuffer::Pixel &pixel = pixels[index];
+                if (m_config.enablePathTracing) {
+                    // Carries on along the pixel's own path samples, past those pathTracePixel took
+                    for (int k = 0; k < samples; k++) {
+                        pixel.sum += RayTracer::pathSample(scene, inverse, i, j, pixel.samples + uint32_t(k), radius);
+                    }
+                    pixel.samples += uint32_t(samples);
+                    chargeRayCounters(pixelCounters, index);
+                    continue;
+                }
+                uint32_t seed = mixBits(uint32_t(index) ^ 0x68e31da4U);
+                glm::vec2 pixelShift = {unitFloat(seed), unitFloat(mixBits(seed))};
+                glm::vec2 lensShift = {unitFloat(mixBits(seed ^ 0x1b873593U)), unitFloat(mixBits(seed ^ 0xcc9e2d51U))};
+                glm::vec3 sum{0.f};
+                for (int base = 0; base < samples; base += RayPacket::size) {
+                    Ray rays[RayPacket::size];
+                    glm::vec3 colors[RayPacket::size];
+                    int batch = min(int(RayPacket::size), samples - base);
+                    for (int k = 0; k < batch; k++) {
+                        uint32_t sample = pixel.samples + uint32_t(base + k);
+                        glm::vec2 offset = glm::fract(pixelShift + r2Point(sample));
+                        glm::vec2 lens{0.f};
+                        if (lensSampled) {
+                            glm::vec2 point = glm::fract(lensShift + glm::vec2{radicalInverse(sample), float(std::fmod(sample * 0.6180339887498949, 1.0))});
+                            lens = radius * concentricDisk(point.x, point.y);
+                        }
+                        rays[k] = RayTracer::primaryRay(scene, inverse, i + offset.x, j + offset.y, lens);
+                    }
+                    // A packet of one ray would only pay the packet setup
+                    if (intersectors.width > 1 && batch > 1) {
+                        RayTracer::tracePacket(rays, batch, scene, intersectors, colors);
+                    } else {
+                        for (int k = 0; k < batch; k++) {
+                            colors[k] = RayTracer::traceRay(rays[k], scene);
+                        }
+                    }
+                    for (int k = 0; k < batch; k++) {
+                        sum += colors[k];
+                    }
+                }
+                pixel.sum += sum;
+                pixel.samples += uint32_t(samples);
+                chargeRayCounters(pixelCounters, index);
+            }
+        }
+    }, progress);
+
+    if (stats != nullptr) {
+        stats->pixels = (long long) width * height;
+        stats->samples = (long long) width * height * samples;
+        stats->refinedPixels = samples > 0 ? stats->pixels : 0;
+        stats->blurredPixels = lensSampled && samples > 0 ? stats->pixels : 0;
+        stats->reusedPrimaryHits = false;
+        stats->pixelRays = std::move(pixelRays);
+    }
+    return !(progress != nullptr && progress->cancelled);
+}
+
+bool RayTracer::renderCoarse(AccumulationBuffer &buffer, const RayTraceScene &scene, int blockSize, Progress *progress) {
+    const Camera &camera = scene.getCamera();
+    int width = scene.width(), height = scene.height();
+    if (buffer.width() != width || buffer.height() != height) {
+        buffer.reset(width, height);
+    }
+    blockSize = max(1, blockSize);
+    glm::mat4 inverse = glm::inverse(camera.getViewMatrix());
+    AccumulationBuffer::Pixel *pixels = buffer.pixels();
+    if (progress != nullptr) {
+        progress->tiles = RayTracer::tileCount(width, height);
+        progress->tilesDone = 0;
+    }
+
+    // Each tile only fills its own part of the blocks it overlaps, so tiles never write over each other. A block
+    // that straddles tiles is traced by each of them, which only happens when tiles aren't a multiple of blocks.
+    RayTracer::forEachTile(width, 0, height, [&](int x0, int y0, int x1, int y1) {
+        for (int j = y0 / blockSize * blockSize; j < y1; j += blockSize) {
+            for (int i = x0 / blockSize * blockSize; i < x1; i += blockSize) {
+                bool inTile = i >= x0 && j >= y0;
+                bool tracedBefore = inTile && i % (2 * blockSize) == 0 && j % (2 * blockSize) == 0 && pixels[(j * width) + i].samples > 0;
+                if (tracedBefore) {
+                    continue;
+                }
+                glm::vec3 color = m_config.enablePathTracing ? RayTracer::pathSample(scene, inverse, i, j, 0, 0.f)
+                                                             : RayTracer::traceRay(RayTracer::primaryRay(scene, inverse, i + 0.5f, j + 0.5f), scene);
+                AccumulationBuffer::Pixel pixel{color, 1};
+                for (int v = max(j, y0); v < min(j + blockSize, y1); v++) {
+                    fill(pixels + (v * width) + max(i, x0), pixels + (v * width) + min(i + blockSize, x1), pixel);
+                }
+            }
+        }
+    }, progress);
+    return !(progress != nullptr && progress->cancelled);
+}
+
+// Traces the pixels in [x0, x1) x [y0, y1) through their centers into pixels, which holds the image's rows
+// from row top on, as each pixel's only sample. With RAYTRACER_STATS, the work of every pixel is added to
+// pixelRays when it is not null. When hits is not null, each pixel's primary hit is kept in it. Both are
+// indexed like pixels.
+void RayTracer::renderTile(AccumulationBuffer::Pixel *pixels, int top, const RayTraceScene &scene, const glm::mat4 &inverse, int x0, int y0, int x1, int y1,
+                           RayCounters *pixelRays, PrimaryHit *hits) {
+    int width = scene.width();
+    const PacketIntersectors &intersectors = packetIntersectors(m_config.simdWidth);
+    chargeRayCounters(nullptr, 0);
+    // Every primary ray of the tile leaves the eye through the tile, so they only search the parts of the BVH
+    // its frustum reaches into. Secondary rays go anywhere and search all of it.
+    vector<int> entryNodes;
+    const vector<int> *tileNodes = nullptr;
+    if (m_config.enableAcceleration) {
+        scene.getBVH().cull(RayTracer::tileFrustum(scene, inverse, x0, y0, x1, y1), entryNodes, MAX_TILE_ENTRIES);
+        tileNodes = &entryNodes;
+    }
+    if (intersectors.width > 1) {
+        // Primary rays through neighbouring pixels are coherent, so runs of a row are traced as one packet
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i += RayPacket::size) {
+                Ray rays[RayPacket::size];
+                glm::vec3 colors[RayPacket::size];
+                int count = min(RayPacket::size, x1 - i);
+                for (int k = 0; k < count; k++) {
+                    rays[k] = RayTracer::primaryRay(scene, inverse, i + k + 0.5f, j + 0.5f);
+                }
+                RayTracer::tracePacket(rays, count, scene, intersectors, colors,
+                                       hits != nullptr ? hits + ((j - top) * width) + i : nullptr, tileNodes);
+                for (int k = 0; k < count; k++) {
+                    pixels[((j - top) * width) + i + k] = AccumulationBuffer::Pixel{colors[k], 1};
+                }
+                chargeRayCounters(pixelRays, ((j - top) * width) + i, count);
+            }
+        }
+        return;
+    }
+    for (int j = y0; j < y1; j++) {
+        for (int i = x0; i < x1; i++) {
+            Ray ray = RayTracer::primaryRay(scene, inverse, i + 0.5f, j + 0.5f);
+            int index = ((j - top) * width) + i;
+            glm::vec3 color = traceRay(ray, scene, hits != nullptr ? hits + index : nullptr, tileNodes);
+            pixels[index] = AccumulationBuffer::Pixel{color, 1};
+            chargeRayCounters(pixelRays, index);
+        }
+    }
+}
+
+// Shades the pixels in [x0, x1) x [y0, y1) from primary hits kept by renderTile, without tracing their rays.
+// pixels, hits and pixelRays hold the image's rows from row top on.
+// The colors are the ones renderTile would give for the scene's current lights and materials. With shadowsKnown,
+// the hits' shadowed bits are trusted instead of tracing shadow rays again; otherwise they are traced and kept.
+void RayTracer::shadeTile(AccumulationBuffer::Pixel *pixels, int top, const RayTraceScene &scene, const glm::mat4 &inverse, int x0, int y0, int x1, int y1,
+                          PrimaryHit *hits, bool shadowsKnown, RayCounters *pixelRays) {
+    int width = scene.width();
+    chargeRayCounters(nullptr, 0);
+    for (int j = y0; j < y1; j++) {
+        for (int i = x0; i < x1; i++) {
+            int index = ((j - top) * width) + i;
+            PrimaryHit &hit = hits[index];
+            if (hit.shape == -1) {
+                pixels[index] = AccumulationBuffer::Pixel{glm::vec3{0.f}, 1};
+                continue;
+            }
+            Ray ray = RayTracer::primaryRay(scene, inverse, i + 0.5f, j + 0.5f);
+            const glm::mat4 &inverseCTM = scene.getShapeCache(hit.shape).inverseCTM;
+            Ray objectRay = {inverseCTM * ray.origin, inverseCTM * ray.direction};
+            pixels[index] = AccumulationBuffer::Pixel{RayTracer::shade(ray, hit, objectRay, scene, shadowsKnown), 1};
+            chargeRayCounters(pixelRays, index);
         }
-        vector<RGBA> textureRGBA;
-        textureImage = textureImage.convertToFormat(QImage::Format_RGBX8888);
-        int w = textureImage.width();
-        int h = textureImage.height();
-        QByteArray arr = QByteArray::fromRawData((const char*) textureImage.bits(), textureImage.sizeInBytes());
-
-        textureRGBA.clear();
-        textureRGBA.reserve(w * h);
-        for (int i = 0; i < arr.size() / 4.f; i++){
-            textureRGBA.push_back(RGBA{(uint8_t) arr[4*i], (uint8_t) arr[4*i+1], (uint8_t) arr[4*i+2], (uint8_t) arr[4*i+3]});
-        }
-        Texture texture {textureRGBA, w, h};
-        m_cachedTextures.insert({filename, texture});
-    }
-
-    for (int j = 0; j < height; j++) {
-        for (int i = 0; i < width; i++) {
-            float x = ((i + 0.5f) / float(width)) - 0.5f;
-            float y = ((height - 1 - j + 0.5f) / float(height)) - 0.5f;
-            float theta_h = camera.getHeightAngle();
-            float theta_w = camera.getHeightAngle() * float(camera.getAspectRatio());
-            float u = 2 * k * std::tan(theta_w / 2.0f);
-            float v = 2 * k * std::tan(theta_h / 2.0f);
-            glm::vec3 uvk = glm::vec3{u * x, v * y, -k};
-            glm::vec3 pEye = glm::vec3{0, 0, 0};
-            glm::vec3 dir = uvk - pEye;
-            glm::vec4 origin = inverse * glm::vec4{pEye.x, pEye.y, pEye.z, 1};
-            glm::vec4 direction = inverse * glm::vec4{dir.x, dir.y, dir.z, 0};
-            Ray ray{origin, direction}; // World Space
-            RGBA color = traceRay(ray, scene);
-            int index = (j * width) + i;
-            imageData[index] = color;
-        }
-    }
-}
-
-RGBA RayTracer::traceRay(Ray ray, const RayTraceScene &scene) {
-    float t = 0.f, min = INFINITY;
-    RenderShapeData closest;
-    vector<RenderShapeData> shapes = scene.m_shapes;
+    }
+}
+
+// Returns the world-space ray through the image-plane point (px, py), measured in pixels from the top left.
+// A nonzero lens is a point on the thin lens, in camera space: the ray leaves from there instead of the pinhole
+// and bends to meet the pinhole ray on the plane in focus, at the camera's focal length.
+RayTracer::Ray RayTracer::primaryRay(const RayTraceScene &scene, const glm::mat4 &inverse, float px, float py, glm::vec2 lens) {
+    RAYTRACER_COUNT(primaryRays, 1);
+    const Camera &camera = scene.getCamera();
+    glm::vec3 uvk = RayTracer::imagePlanePoint(scene, px, py);
+    glm::vec3 pEye = glm::vec3{0, 0, 0};
+    glm::vec3 dir = uvk - pEye;
+    if (lens != glm::vec2{0.f}) {
+        // Both rays reach the plane in focus at uvk * focalLength, so their directions differ by lens / focalLength
+        pEye = glm::vec3{lens, 0.f};
+        dir -= pEye / camera.getFocalLength();
+    }
+    glm::vec4 origin = inverse * glm::vec4{pEye.x, pEye.y, pEye.z, 1};
+    glm::vec4 direction = inverse * glm::vec4{dir.x, dir.y, dir.z, 0};
+    return Ray{origin, direction}; // World Space
+}
+
+// The camera-space point of the image plane, at depth 1, that the pixel-space point (px, py) maps to
+glm::vec3 RayTracer::imagePlanePoint(const RayTraceScene &scene, float px, float py) {
+    const Camera &camera = scene.getCamera();
+    int width = scene.width(), height = scene.height(), k = 1;
+    float x = (px / float(width)) - 0.5f;
+    float y = ((height - py) / float(height)) - 0.5f;
+    float theta_h = camera.getHeightAngle();
+    float theta_w = camera.getHeightAngle() * float(camera.getAspectRatio());
+    float u = 2 * k * std::tan(theta_w / 2.0f);
+    float v = 2 * k * std::tan(theta_h / 2.0f);
+    return glm::vec3{u * x, v * y, -k};
+}
+
+// The world-space frustum of the pinhole rays through the pixels in [x0, x1) x [y0, y1)
+Frustum RayTracer::tileFrustum(const RayTraceScene &scene, const glm::mat4 &inverse, int x0, int y0, int x1, int y1) {
+    glm::vec3 corners[4];
+    glm::vec2 pixels[4] = {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y1}};
+    for (int c = 0; c < 4; c++) {
+        corners[c] = glm::vec3{inverse * glm::vec4{RayTracer::imagePlanePoint(scene, pixels[c].x, pixels[c].y), 0.f}};
+    }
+    glm::vec3 center = corners[0] + corners[2];
+    Frustum frustum;
+    frustum.origin = glm::vec3{inverse * glm::vec4{0.f, 0.f, 0.f, 1.f}};
+    for (int c = 0; c < 4; c++) {
+        // The plane through the eye and two neighbouring corners, facing the tile's center
+        glm::vec3 normal = glm::cross(corners[c], corners[(c + 1) % 4]);
+        frustum.normals[c] = glm::dot(normal, center) < 0.f ? -normal : normal;
+    }
+    return frustum;
+}
+
+// Traces and shades a world-space ray, keeping its hit in primaryHit when that is not null.
+// entryNodes, when not null, are the BVH nodes of a frustum the ray lies in (see BVH::cull).
+glm::vec3 RayTracer::traceRay(Ray ray, const RayTraceScene &scene, PrimaryHit *primaryHit, const vector<int> *entryNodes) {
+    float min;
     glm::vec3 normal;
-    tuple<vector<float>, glm::vec3, bool> result;
-    Ray objectRay;
     Ray closestRay;
-    int shapeIndex = 0;
-    for (const RenderShapeData &shape : shapes) {
-        if (!m_cached) {
-            m_inverseCTMCache.push_back(glm::inverse(shape.ctm));
-        }
-        objectRay = {m_inverseCTMCache[shapeIndex] * ray.origin, m_inverseCTMCache[shapeIndex] * ray.direction}; // to Object space
-        shapeIndex++;
-        switch (shape.primitive.type) {
+    int closestIndex = RayTracer::closestHit(ray, scene, min, normal, closestRay, entryNodes);
+    if (closestIndex == -1) {
+        if (primaryHit != nullptr) {
+            *primaryHit = PrimaryHit{-1, INFINITY, glm::vec3{0.f}, glm::vec2{0.f}, 0};
+        }
+        return glm::vec3{0.f};
+    }
+    PrimaryHit hit = RayTracer::primaryHit(closestIndex, min, normal, closestRay, scene);
+    glm::vec3 color = RayTracer::shade(ray, hit, closestRay, scene);
+    if (primaryHit != nullptr) {
+        *primaryHit = hit;
+    }
+    return color;
+}
+
+// Traces up to RayPacket::size world-space rays at once, writing one color per ray (and one hit per ray to
+// primaryHits when it is not null). Every candidate shape is tested against the whole packet with the given
+// SIMD intersectors, which agree with the scalar ones exactly, so each color matches traceRay's. entryNodes is
+// as for traceRay.
+void RayTracer::tracePacket(const Ray *rays, int count, const RayTraceScene &scene, const PacketIntersectors &intersectors, glm::vec3 *colors,
+                            PrimaryHit *primaryHits, const vector<int> *entryNodes) {
+    glm::vec3 origins[RayPacket::size];
+    glm::vec3 directions[RayPacket::size];
+    int closestSlots[RayPacket::size];
+    int closestShapes[RayPacket::size];
+    PacketHit hit;
+    // Missing rays copy the first one and never hit anything
+    for (int k = 0; k < RayPacket::size; k++) {
+        const Ray &ray = rays[k < count ? k : 0];
+        origins[k] = glm::vec3{ray.origin};
+        directions[k] = glm::vec3{ray.direction};
+        closestSlots[k] = -1;
+        closestShapes[k] = -1;
+        hit.t[k] = (k < count) ? INFINITY : 0.f;
+    }
+
+    const PrimitiveStore &primitives = scene.getPrimitives();
+    scene.visitPacketCandidates<RayPacket::size>(origins, directions, hit.t, m_config.enableAcceleration, [&](int slot) {
+        // As in closestHit, a tie goes to the shape listed first in the scene. The intersectors only take hits
+        // strictly closer than hit.t, so rays held by a later shape accept an equal t through the next float up.
+        int shape = primitives.shapeIndex(slot);
+        float heldT[RayPacket::size];
+        for (int k = 0; k < count; k++) {
+            heldT[k] = hit.t[k];
+            if (closestShapes[k] > shape) {
+                hit.t[k] = nextafter(hit.t[k], INFINITY);
+            }
+        }
+        RayPacket objectRays;
+        for (int k = 0; k < RayPacket::size; k++) {
+            const Ray &ray = rays[k < count ? k : 0];
+            glm::vec4 origin = primitives.toObject(slot, ray.origin);
+            glm::vec4 direction = primitives.toObject(slot, ray.direction);
+            objectRays.originX[k] = origin.x;
+            objectRays.originY[k] = origin.y;
+            objectRays.originZ[k] = origin.z;
+            objectRays.directionX[k] = direction.x;
+            objectRays.directionY[k] = direction.y;
+            objectRays.directionZ[k] = direction.z;
+        }
+        int hits = 0;
+        switch (primitives.type(slot)) {
             case PrimitiveType::PRIMITIVE_CUBE:
-                result = RayTracer::cubeIntersect(objectRay);
+                RAYTRACER_COUNT(intersectorCalls[int(PrimitiveType::PRIMITIVE_CUBE)], count);
+                hits = intersectors.cube(objectRays, hit);
                 break;
             case PrimitiveType::PRIMITIVE_CONE:
-                result = RayTracer::coneIntersect(objectRay);
+                RAYTRACER_COUNT(intersectorCalls[int(PrimitiveType::PRIMITIVE_CONE)], count);
+                hits = intersectors.cone(objectRays, hit);
                 break;
             case PrimitiveType::PRIMITIVE_CYLINDER:
-                result = RayTracer::cylinderIntersect(objectRay);
+                RAYTRACER_COUNT(intersectorCalls[int(PrimitiveType::PRIMITIVE_CYLINDER)], count);
+                hits = intersectors.cylinder(objectRays, hit);
                 break;
             case PrimitiveType::PRIMITIVE_SPHERE:
-                result = RayTracer::sphereIntersect(objectRay);
+                RAYTRACER_COUNT(intersectorCalls[int(PrimitiveType::PRIMITIVE_SPHERE)], count);
+                hits = intersectors.sphere(objectRays, hit);
                 break;
             case PrimitiveType::PRIMITIVE_MESH:
-                // not implemented, put here to suppress QT warnings
-                break;
             case PrimitiveType::PRIMITIVE_TORUS:
-                // not implemented, put here to suppress QT warnings
+            case PrimitiveType::PRIMITIVE_PLANE:
+            case PrimitiveType::PRIMITIVE_INVERTCUBE:
+                // Meshes, and the primitives with no packet test, send their rays through the scalar test one by
+                // one, so they hit (or miss) exactly as they do in closestHit
+                for (int k = 0; k < count; k++) {
+                    Ray objectRay;
+                    Hit rayHit;
+                    if (RayTracer::intersectShape(slot, rays[k], scene, objectRay, rayHit) && rayHit.t < hit.t[k]) {
+                        hit.t[k] = rayHit.t;
+                        hit.normalX[k] = rayHit.normal.x;
+                        hit.normalY[k] = rayHit.normal.y;
+                        hit.normalZ[k] = rayHit.normal.z;
+                        hits |= 1 << k;
+                    }
+                }
                 break;
         }
-        if (get<0>(result).empty()) {
+        for (int k = 0; k < count; k++) {
+            if (hits & (1 << k)) {
+                closestSlots[k] = slot;
+                closestShapes[k] = shape;
+            } else {
+                hit.t[k] = heldT[k];
+            }
+        }
+        return false;
+    }, entryNodes);
+
+    for (int k = 0; k < count; k++) {
+        if (closestSlots[k] == -1) {
+            colors[k] = glm::vec3{0.f};
+            if (primaryHits != nullptr) {
+                primaryHits[k] = PrimaryHit{-1, INFINITY, glm::vec3{0.f}, glm::vec2{0.f}, 0};
+            }
             continue;
-        } else {
-            t = get<0>(result)[0];
         }
-        if (t < min) {
-            min = t;
-            normal = get<1>(result);
-            closest = shape;
-            closestRay = {objectRay.origin, objectRay.direction};
+        int closestIndex = primitives.shapeIndex(closestSlots[k]);
+        const glm::mat4 &inverseCTM = scene.getShapeCache(closestIndex).inverseCTM;
+        Ray objectRay = {inverseCTM * rays[k].origin, inverseCTM * rays[k].direction};
+        glm::vec3 normal = {hit.normalX[k], hit.normalY[k], hit.normalZ[k]};
+        PrimaryHit primaryHit = RayTracer::primaryHit(closestIndex, hit.t[k], normal, objectRay, scene);
+        colors[k] = RayTracer::shade(rays[k], primaryHit, objectRay, scene);
+        if (primaryHits != nullptr) {
+            primaryHits[k] = primaryHit;
         }
     }
-    if (min == INFINITY) {
-        return RGBA{0, 0, 0};
-    }
-    glm::vec4 worldIntersectPosition = closest.ctm * closestRay.origin;
-    glm::vec4 worldIntersectDirection = closest.ctm * closestRay.direction;
-    glm::vec3 intersect = glm::vec3{worldIntersectPosition + (min * worldIntersectDirection)};
+}
+
+// The hit of a ray with the shape at index, t along it, with the given object-space normal.
+// objectRay is the ray in the shape's object space. Texture coordinates are found even for untextured
+// shapes, since a later material may add a texture.
+RayTracer::PrimaryHit RayTracer::primaryHit(int index, float t, glm::vec3 normal, const Ray &objectRay, const RayTraceScene &scene) {
+    glm::vec3 point = glm::vec3{objectRay.origin + (t * objectRay.direction)};
+    PrimitiveType type = scene.getShapes()[index].primitive.type;
+    return PrimaryHit{index, t, normal, RayTracer::textureCoordinates(point, glm::normalize(normal), type), 0};
+}
+
+// Lights the hit of a world-space ray. objectRay is the ray in the hit shape's object space.
+// The lights found blocked are kept in hit.shadowed, or read from it when shadowsKnown.
+glm::vec3 RayTracer::shade(const Ray &ray, PrimaryHit &hit, const Ray &objectRay, const RayTraceScene &scene, bool shadowsKnown) {
+    int index = hit.shape;
+    float t = hit.t;
+    glm::vec3 normal = hit.normal;
+    const RenderShapeData &closest = scene.getShapes()[index];
+    const ShapeCache &cache = scene.getShapeCache(index);
+    glm::vec4 worldIntersectPosition = closest.ctm * objectRay.origin;
+    glm::vec4 worldIntersectDirection = closest.ctm * objectRay.direction;
+    glm::vec3 intersect = glm::vec3{worldIntersectPosition + (t * worldIntersectDirection)};
     // Transform object space normal to world space
-    glm::vec3 worldNormal = glm::inverse(glm::transpose(glm::mat3(closest.ctm))) * normal;
+    glm::vec3 worldNormal = cache.normalMatrix * normal;
     // Use normal and intersection point (both in world space) for lighting computation
     RGBA textureColor;
-    if (closest.primitive.material.textureMap.isUsed) {
-        textureColor = RayTracer::mapTexture(glm::vec3{closestRay.origin + (min * closestRay.direction)}, glm::normalize(normal), closest);
+    if (closest.primitive.material.textureMap.isUsed && cache.textureIndex != -1) {
+        const Texture &texture = scene.getTextures()[cache.textureIndex];
+        float lod = 0.f;
+        if (m_config.enableTextureFilter) {
+            // A primary ray covers one pixel, which spans this angle on the camera's image plane
+            float spread = 2.f * std::tan(scene.getCamera().getHeightAngle() / 2.f) / float(scene.height());
+            lod = RayTracer::textureLod(ray, objectRay, t, normal, closest, texture, cache.inverseCTM, spread);
+        }
+        textureColor = RayTracer::sampleTexture(hit.uv, closest, texture, lod);
     } else {
         textureColor = RGBA{0, 0, 0};
     }
-    return RayTracer::phong(intersect, worldNormal, glm::vec3{ray.origin} - intersect, closest.primitive.material, scene.m_lights, scene.m_globalData , scene.m_shapes, scene, false, textureColor);
+    return RayTracer::phong(intersect, worldNormal, glm::vec3{ray.origin} - intersect, closest.primitive.material, scene.getLights(), scene.getGlobalData(), scene, false, textureColor,
+                            &hit.shadowed, shadowsKnown);
+}
+
+// Tests a world-space ray against the primitive in a store slot, reading only the packed store
+bool RayTracer::intersectShape(int slot, const Ray &ray, const RayTraceScene &scene, Ray &objectRay, Hit &hit) {
+    const PrimitiveStore &primitives = scene.getPrimitives();
+    objectRay = {primitives.toObject(slot, ray.origin), primitives.toObject(slot, ray.direction)}; // to Object space
+    RAYTRACER_COUNT(intersectorCalls[int(primitives.type(slot))], 1);
+    switch (primitives.type(slot)) {
+        case PrimitiveType::PRIMITIVE_CUBE:
+            return RayTracer::cubeIntersect(objectRay, hit);
+        case PrimitiveType::PRIMITIVE_CONE:
+            return RayTracer::coneIntersect(objectRay, hit);
+        case PrimitiveType::PRIMITIVE_CYLINDER:
+            return RayTracer::cylinderIntersect(objectRay, hit);
+        case PrimitiveType::PRIMITIVE_SPHERE:
+            return RayTracer::sphereIntersect(objectRay, hit);
+        case PrimitiveType::PRIMITIVE_MESH: {
+            int mesh = scene.getShapeCache(primitives.shapeIndex(slot)).meshIndex;
+            return mesh != -1 && scene.getMeshes()[mesh].intersect(objectRay, INFINITY, hit);
+        }
+        case PrimitiveType::PRIMITIVE_TORUS:
+        case PrimitiveType::PRIMITIVE_PLANE:
+        case PrimitiveType::PRIMITIVE_INVERTCUBE:
+            // not implemented, put here to suppress QT warnings
+            break;
+    }
+    return false;
+}
+
+// Returns whether a world-space ray hits the primitive in a store slot anywhere in (0, tMax)
+bool RayTracer::shapeOccluded(int slot, const Ray &ray, const RayTraceScene &scene, float tMax) {
+    const PrimitiveStore &primitives = scene.getPrimitives();
+    Ray objectRay = {primitives.toObject(slot, ray.origin), primitives.toObject(slot, ray.direction)}; // to Object space
+    RAYTRACER_COUNT(intersectorCalls[int(primitives.type(slot))], 1);
+    switch (primitives.type(slot)) {
+        case PrimitiveType::PRIMITIVE_CUBE:
+            return RayTracer::cubeOccluded(objectRay, tMax);
+        case PrimitiveType::PRIMITIVE_CONE:
+            return RayTracer::coneOccluded(objectRay, tMax);
+        case PrimitiveType::PRIMITIVE_CYLINDER:
+            return RayTracer::cylinderOccluded(objectRay, tMax);
+        case PrimitiveType::PRIMITIVE_SPHERE:
+            return RayTracer::sphereOccluded(objectRay, tMax);
+        case PrimitiveType::PRIMITIVE_MESH: {
+            int mesh = scene.getShapeCache(primitives.shapeIndex(slot)).meshIndex;
+            return mesh != -1 && scene.getMeshes()[mesh].occluded(objectRay, tMax);
+        }
+        case PrimitiveType::PRIMITIVE_TORUS:
+        case PrimitiveType::PRIMITIVE_PLANE:
+        case PrimitiveType::PRIMITIVE_INVERTCUBE:
+            // not implemented, put here to suppress QT warnings
+            break;
+    }
+    return false;
+}
+
+// Returns the index of the nearest shape hit by a world-space ray, or -1 on a miss.
+// tHit, normal and objectRay describe the hit in the shape's object space. entryNodes is as for traceRay.
+int RayTracer::closestHit(const Ray &ray, const RayTraceScene &scene, float &tHit, glm::vec3 &normal, Ray &objectRay, const vector<int> *entryNodes) {
+    const PrimitiveStore &primitives = scene.getPrimitives();
+    int closestSlot = -1;
+    tHit = INFINITY;
+    // Slots are visited in BVH order, so a tie goes to the shape listed first in the scene, as it would in scene order
+    scene.visitCandidates(glm::vec3{ray.origin}, glm::vec3{ray.direction}, tHit, m_config.enableAcceleration, [&](int slot) {
+        Ray candidateRay;
+        Hit hit;
+        if (RayTracer::intersectShape(slot, ray, scene, candidateRay, hit) &&
+            (hit.t < tHit || (hit.t == tHit && closestSlot != -1 && primitives.shapeIndex(slot) < primitives.shapeIndex(closestSlot)))) {
+            tHit = hit.t;
+            normal = hit.normal;
+            closestSlot = slot;
+        }
+        return false;
+    }, entryNodes);
+    if (closestSlot == -1) {
+        return -1;
+    }
+    // Only the winner is taken to object space with its full inverse, for shading
+    int closestIndex = primitives.shapeIndex(closestSlot);
+    const glm::mat4 &inverseCTM = scene.getShapeCache(closestIndex).inverseCTM;
+    objectRay = {inverseCTM * ray.origin, inverseCTM * ray.direction};
+    return closestIndex;
 }
 
-RGBA RayTracer::mapTexture(glm::vec3 intersection, glm::vec3 normal, RenderShapeData shape) {
-    const Texture texture = m_cachedTextures[shape.primitive.material.textureMap.filename];
+// The texture coordinates (u, v) of an object-space point on a primitive, with v growing upwards.
+// normal is the object-space normal there, which picks the face of cubes and the caps of cylinders and cones.
+glm::vec2 RayTracer::textureCoordinates(glm::vec3 intersection, glm::vec3 normal, PrimitiveType type) {
     float u=0, v=0, theta, phi;
-    int c, r;
-    switch (shape.primitive.type) {
+    switch (type) {
         case PrimitiveType::PRIMITIVE_CUBE:
             //cube
             if (normal.x == 1) {
@@ -204,7 +1065,7 @@ RGBA RayTracer::mapTexture(glm::vec3 intersection, glm::vec3 normal, RenderShape
             break;
         case PrimitiveType::PRIMITIVE_SPHERE:
 
-            phi = glm::asin(intersection.y/0.5f);
+            phi = glm::asin(glm::clamp(intersection.y/0.5f, -1.f, 1.f));
             v = 0.5f + (phi/M_PI);
             if (v == 0 || v == 1) {
                 u = 0.5f;
@@ -222,19 +1083,40 @@ RGBA RayTracer::mapTexture(glm::vec3 intersection, glm::vec3 normal, RenderShape
             // not implemented, put here to suppress QT warnings
             break;
         case PrimitiveType::PRIMITIVE_TORUS:
+        case PrimitiveType::PRIMITIVE_PLANE:
+        case PrimitiveType::PRIMITIVE_INVERTCUBE:
             // not implemented, put here to suppress QT warnings
             break;
     }
-    int width = texture.width;
-    int height = texture.height;
+    return {u, v};
+}
+
+// The texture's color at an object-space point on a shape. With enableTextureFilter the lookup is
+// trilinear at the mip level lod (see textureLod), otherwise it takes the nearest texel of the full image.
+RGBA RayTracer::mapTexture(glm::vec3 intersection, glm::vec3 normal, const RenderShapeData &shape, const Texture &texture, float lod) {
+    return RayTracer::sampleTexture(RayTracer::textureCoordinates(intersection, normal, shape.primitive.type), shape, texture, lod);
+}
+
+// The texture's color at texture coordinates uv of a shape, as mapTexture looks it up
+RGBA RayTracer::sampleTexture(glm::vec2 uv, const RenderShapeData &shape, const Texture &texture, float lod) {
+    float u = uv.x, v = uv.y;
+    int c, r;
+    int width = texture.width();
+    int height = texture.height();
+    float repeatU = shape.primitive.material.textureMap.repeatU;
+    float repeatV = shape.primitive.material.textureMap.repeatV;
+    if (m_config.enableTextureFilter) {
+        float s = u * (repeatU > 1 ? repeatU : 1.f) * width;
+        float t = (1 - v) * (repeatV > 1 ? repeatV : 1.f) * height;
+        glm::vec4 color = texture.trilinear(s, t, lod) + 0.5f;
+        return RGBA{uint8_t(color.r), uint8_t(color.g), uint8_t(color.b), uint8_t(color.a)};
+    }
     if (u == 1.f) {
         width--;
     }
     if (v == 0.f) {
         height--;
     }
-    float repeatU = shape.primitive.material.textureMap.repeatU;
-    float repeatV = shape.primitive.material.textureMap.repeatV;
 
     if (repeatU > 1) {
         c = int(floor(u * repeatU * width)) % width;
@@ -247,6 +1129,40 @@ RGBA RayTracer::mapTexture(glm::vec3 intersection, glm::vec3 normal, RenderShape
         r = int(floor((1 - v) * height));
     }
 
-    int index = ((width * r) + c);
-    return texture.textureRGBA[index];
+    return texture.texel(0, c, r);
+}
+
+// The mip level whose texels are the size of a ray's footprint on a textured hit, found with ray differentials.
+// Rays leaving the same origin spread apart by spread (an angle, per unit of ray length) in two directions
+// perpendicular to the ray are met with the tangent plane of the hit, and the texture coordinates of the
+// points where they meet it measure the footprint in texels. Everything is done in the shape's object space.
+float RayTracer::textureLod(const Ray &ray, const Ray &objectRay, float t, glm::vec3 normal, const RenderShapeData &shape,
+                            const Texture &texture, const glm::mat4 &inverseCTM, float spread) {
+    glm::vec3 origin = glm::vec3{objectRay.origin};
+    glm::vec3 hit = origin + t * glm::vec3{objectRay.direction};
+    glm::vec3 n = glm::normalize(normal);
+    glm::vec2 uv = RayTracer::textureCoordinates(hit, n, shape.primitive.type);
+    float repeatU = shape.primitive.material.textureMap.repeatU;
+    float repeatV = shape.primitive.material.textureMap.repeatV;
+    glm::vec2 texels = {(repeatU > 1 ? repeatU : 1.f) * texture.width(), (repeatV > 1 ? repeatV : 1.f) * texture.height()};
+
+    glm::vec3 direction = glm::vec3{ray.direction};
+    float length = glm::length(direction);
+    glm::vec3 axis = (glm::abs(direction.x) < 0.5f * length) ? glm::vec3{1, 0, 0} : glm::vec3{0, 1, 0};
+    glm::vec3 dx = glm::normalize(glm::cross(direction, axis)) * (spread * length);
+    glm::vec3 dy = glm::normalize(glm::cross(direction, dx)) * (spread * length);
+    float footprint = 0.f;
+    for (const glm::vec3 &offset : {dx, dy}) {
+        glm::vec3 offsetDirection = glm::vec3{inverseCTM * glm::vec4{direction + offset, 0.f}};
+        float tOffset = glm::dot(hit - origin, n) / glm::dot(offsetDirection, n);
+        // A neighbour that misses the plane means the ray grazes the surface, which covers the whole texture
+        if (!(tOffset > 0.f)) {
+            return float(texture.levelCount());
+        }
+        glm::vec2 delta = RayTracer::textureCoordinates(origin + tOffset * offsetDirection, n, shape.primitive.type) - uv;
+        // Coordinates jump by a whole texture across seams
+        delta -= glm::round(delta);
+        footprint = max(footprint, glm::length(delta * texels));
+    }
+    return log2(footprint);
 }
@@ -1,17 +1,24 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <atomic>
+#include <functional>
 #include "utils/rgba.h"
+#include "raystats.h"
+#include "accumulationbuffer.h"
 #include "utils/scenedata.h"
 #include "utils/sceneparser.h"
-#include <tuple>
-#include <unordered_map>
 
 using namespace std;
 
 // A forward declaration for the RaytraceScene class
 
 class RayTraceScene;
+class Texture;
+class GBuffer;
+struct PacketIntersectors;
+struct Frustum;
+struct PathSampler;
 
 // A class representing a ray-tracer
 
@@ -28,6 +35,69 @@ public:
         bool enableSuperSample   = false;
         bool enableAcceleration  = false;
         bool enableDepthOfField  = false;
+        bool enablePathTracing   = false;
+        bool enableLightCulling  = false; // skip lights too dim to change a pixel by a step, see LightGrid
+
+        int threadCount = 0; // workers used when enableParallelism is set; 0 uses the whole pool
+        int tileSize    = 16; // edge length in pixels of the tiles handed to workers
+        int simdWidth   = 0; // widest SIMD packet tests used for primary rays; 0 picks the widest the CPU supports, 1 traces rays one at a time
+
+        // With enableSuperSample, pixels whose 3x3 neighbourhood differs by more than superSampleThreshold in any
+        // channel (colors from 0 to 1) are resampled in stratified batches of 4, until the samples' standard
+        // deviation drops under the threshold or maxSamples have been taken
+        int maxSamples             = 16;
+        float superSampleThreshold = 0.1f;
+
+        // With enableDepthOfField, the most rays a pixel takes through the camera's lens. Pixels whose circle of
+        // confusion is under a pixel wide keep their single pinhole ray.
+        int maxLensSamples = 64;
+
+        // Reflected and (with enableRefraction) refracted rays are followed at most maxBounces hits deep, and only
+        // while the share of the pixel they carry is at least minThroughput in some channel. The default is about
+        // what one step of an 8-bit channel can show.
+        int maxBounces       = 4;
+        float minThroughput = 1.f / 256.f;
+
+        // With enablePathTracing, every pixel takes at least minPathSamples paths and at most maxPathSamples,
+        // stopping once the standard error of its tone-mapped mean is under pathNoiseThreshold in every channel.
+        // It is checked whenever the sample count doubles. Paths are at most maxPathBounces hits long, and past
+        // the third hit end by Russian roulette. See pathtracer.cpp.
+        int minPathSamples       = 16;
+        int maxPathSamples       = 256;
+        float pathNoiseThreshold = 0.01f;
+        int maxPathBounces       = 8;
+    };
+
+    // What a render did, filled in by render when asked for
+    struct Stats {
+        long long pixels        = 0;
+        long long samples       = 0; // primary rays traced, including the first one through every pixel center
+        long long refinedPixels = 0; // pixels that were supersampled, or path traced past minPathSamples
+        long long blurredPixels = 0; // pixels traced through the lens for depth of field
+        bool reusedPrimaryHits  = false; // the pixel centers were shaded from a GBuffer instead of traced
+
+        // The work done for every pixel, row by row. Only filled in when built with RAYTRACER_STATS, and never by
+        // renderStreamed.
+        vector<RayCounters> pixelRays;
+
+        double samplesPerPixel() const {
+            return pixels > 0 ? double(samples) / double(pixels) : 0.0;
+        }
+    };
+
+    // Lets another thread follow a render and stop it part way, see render
+    struct Progress {
+        atomic<bool> cancelled = false; // set from any thread to stop the render before its next tile
+        atomic<int> tiles = 0;          // over all of the render's passes, set again by every render it is given to
+        atomic<int> tilesDone = 0;
+
+        // Called after every tile of every pass with the tile's pixels, [x0, x1) x [y0, y1), from the worker that
+        // traced it. Those pixels of the render's buffer are final for the pass and can be read right away.
+        function<void(int x0, int y0, int x1, int y1)> tileDone;
+
+        float fraction() const {
+            return tiles > 0 ? float(tilesDone) / float(tiles) : 0.f;
+        }
     };
 
     struct Ray {
@@ -35,6 +105,23 @@ public:
         glm::vec4 direction;
     };
 
+    // The nearest intersection of a ray with a shape, in the shape's object space.
+    // Kept on the stack by callers so intersection tests never touch the heap.
+    struct Hit {
+        float t;
+        glm::vec3 normal;
+    };
+
+    // What shading needs to know of the nearest hit of a primary ray. The object-space point is not kept:
+    // it is t along the ray taken to the shape's object space, which is recomputed exactly.
+    struct PrimaryHit {
+        int shape;         // index into the scene's shapes, or -1 when the ray hits nothing
+        float t;
+        glm::vec3 normal;  // in the shape's object space, as its intersector returned it
+        glm::vec2 uv;      // texture coordinates of the hit, see textureCoordinates
+        uint32_t shadowed; // bit i is set when something blocks light i from the hit, for the first 32 lights
+    };
+
 public:
     RayTracer(Config config);
 
@@ -42,31 +129,98 @@ public:
     // The ray-tracer will render the scene and fill imageData in-place.
     // @param imageData The pointer to the imageData to be filled.
     // @param scene The scene to be rendered.
-    struct Texture {
-        const vector<RGBA> textureRGBA;
-        int width;
-        int height;
-    };
+    // @param stats When not null, receives the number of samples the render took (and the work of every pixel,
+    // when built with RAYTRACER_STATS).
+    // @param primaryHits When not null, the hits of the rays through the pixel centers are shaded from it if it
+    // was filled for the same geometry and camera (see GBuffer::matches), and are kept in it otherwise.
+    // The ray-tracer keeps no per-scene state, so one instance can trace from many threads.
+    void render(RGBA *imageData, const RayTraceScene &scene, Stats *stats = nullptr, GBuffer *primaryHits = nullptr);
+
+    // Renders the scene into buffer, which is resized to the scene and left with the render's unclamped colors.
+    // Resolving it gives the image the render above would. Every pixel is replaced as its tile is traced, so a
+    // buffer already of the scene's size keeps what it held (a preview, say) until then. With progress, the image
+    // is traced in tiles even without enableParallelism, each one reported as it is done. Returns false when
+    // progress was cancelled, leaving the tiles not reached yet as they were (and primaryHits empty).
+    bool render(AccumulationBuffer &buffer, const RayTraceScene &scene, Stats *stats = nullptr, GBuffer *primaryHits = nullptr,
+                Progress *progress = nullptr);
+
+    // Adds samples more jittered samples to every pixel of buffer, a render of scene, each picking up the
+    // pixel's sample sequence where its last sample left off. See raytracer.cpp.
+    // Returns false when progress was cancelled, leaving the pixels not reached yet as they were.
+    bool refine(AccumulationBuffer &buffer, const RayTraceScene &scene, int samples, Stats *stats = nullptr, Progress *progress = nullptr);
+
+    // A quick, blocky preview: traces the first pixel of every blockSize x blockSize block of buffer, a render of
+    // scene, through its center and copies it over the block. Blocks whose first pixel already has samples, as a
+    // call with twice the block size leaves it, are left alone, so calls with 8, 4 and 2 in turn trace each pixel
+    // once at most.
+    // Returns false when progress was cancelled.
+    bool renderCoarse(AccumulationBuffer &buffer, const RayTraceScene &scene, int blockSize, Progress *progress = nullptr);
 
-    vector<glm::mat4> m_inverseCTMCache;
-    bool m_cached = false;
-    unordered_map<string, Texture> m_cachedTextures;
-
-    void render(RGBA *imageData, const RayTraceScene &scene);
-    RGBA traceRay(Ray ray, const RayTraceScene &scene);
-    tuple<vector<float>, glm::vec3, bool> cylinderIntersect(Ray ray);
-    tuple<vector<float>, glm::vec3, bool> coneIntersect(Ray ray);
-    tuple<vector<float>, glm::vec3, bool> sphereIntersect(Ray ray);
-    tuple<vector<float>, glm::vec3, bool> cubeIntersect(Ray ray);
-    vector<float> quadraticEquation(float a, float b, float c);
-    RGBA toRGBA(const glm::vec4 &illumination);
-    RGBA phong(glm::vec3 position, glm::vec3 normal, glm::vec3 directionToCamera, SceneMaterial &material,
-               const vector<SceneLightData> &lights, const SceneGlobalData &globalData, const vector<RenderShapeData> &shapes, const RayTraceScene &scene, bool recursive, RGBA textureColor);
-    bool checkShadow(const glm::vec3 origin, const glm::vec3 direction, const vector<RenderShapeData> &shapes, bool isDirectional, float tCheck);
-    glm::vec3 recursiveReflection(const glm::vec3 origin, const glm::vec3 direction, int depth, const RayTraceScene &scene);
-    RGBA mapTexture(const glm::vec3 intersection, const glm::vec3 normal, const RenderShapeData shape);
+    // Renders only rows [y0, y1) of the image into rows, (y1 - y0) rows of width pixels. They match the same
+    // rows of a whole render exactly.
+    void renderRows(RGBA *rows, const RayTraceScene &scene, int y0, int y1, Stats *stats = nullptr);
+
+    // Renders the image band by band, for images too large to keep in memory. See raytracer.cpp.
+    bool renderStreamed(const RayTraceScene &scene, int bandHeight, const function<bool(const RGBA *rows, int y0, int y1)> &writeRows,
+                        Stats *stats = nullptr);
+
+    void renderTile(AccumulationBuffer::Pixel *pixels, int top, const RayTraceScene &scene, const glm::mat4 &inverse, int x0, int y0, int x1, int y1,
+                    RayCounters *pixelRays = nullptr, PrimaryHit *hits = nullptr);
+    void shadeTile(AccumulationBuffer::Pixel *pixels, int top, const RayTraceScene &scene, const glm::mat4 &inverse, int x0, int y0, int x1, int y1,
+                   PrimaryHit *hits, bool shadowsKnown, RayCounters *pixelRays = nullptr);
+    Ray primaryRay(const RayTraceScene &scene, const glm::mat4 &inverse, float px, float py, glm::vec2 lens = glm::vec2{0.f});
+    static glm::vec3 imagePlanePoint(const RayTraceScene &scene, float px, float py);
+    static Frustum tileFrustum(const RayTraceScene &scene, const glm::mat4 &inverse, int x0, int y0, int x1, int y1);
+    AccumulationBuffer::Pixel superSamplePixel(const RayTraceScene &scene, const glm::mat4 &inverse, int i, int j);
+    AccumulationBuffer::Pixel depthOfFieldPixel(const RayTraceScene &scene, const glm::mat4 &inverse, int i, int j, float diameter);
+    vector<float> circlesOfConfusion(const RayTraceScene &scene, const glm::mat4 &inverse, int y0, int y1, RayCounters *pixelRays = nullptr);
+    static float neighbourhoodContrast(const glm::vec3 *image, int width, int height, int i, int j);
+    AccumulationBuffer::Pixel pathTracePixel(const RayTraceScene &scene, const glm::mat4 &inverse, int i, int j, float lensRadius);
+    glm::vec3 pathSample(const RayTraceScene &scene, const glm::mat4 &inverse, int i, int j, uint32_t sample, float lensRadius);
+    glm::vec3 tracePath(Ray ray, const RayTraceScene &scene, PathSampler &sampler);
+    glm::vec3 traceRay(Ray ray, const RayTraceScene &scene, PrimaryHit *primaryHit = nullptr, const vector<int> *entryNodes = nullptr);
+    void tracePacket(const Ray *rays, int count, const RayTraceScene &scene, const PacketIntersectors &intersectors, glm::vec3 *colors,
+                     PrimaryHit *primaryHits = nullptr, const vector<int> *entryNodes = nullptr);
+    static PrimaryHit primaryHit(int index, float t, glm::vec3 normal, const Ray &objectRay, const RayTraceScene &scene);
+    glm::vec3 shade(const Ray &ray, PrimaryHit &hit, const Ray &objectRay, const RayTraceScene &scene, bool shadowsKnown = false);
+    bool intersectShape(int slot, const Ray &ray, const RayTraceScene &scene, Ray &objectRay, Hit &hit);
+    bool shapeOccluded(int slot, const Ray &ray, const RayTraceScene &scene, float tMax);
+    int closestHit(const Ray &ray, const RayTraceScene &scene, float &tHit, glm::vec3 &normal, Ray &objectRay,
+                   const vector<int> *entryNodes = nullptr);
+
+    // Closest-hit tests of an object-space ray against the unit primitives
+    static bool cylinderIntersect(const Ray &ray, Hit &hit);
+    static bool coneIntersect(const Ray &ray, Hit &hit);
+    static bool sphereIntersect(const Ray &ray, Hit &hit);
+    static bool cubeIntersect(const Ray &ray, Hit &hit);
+
+    // Occlusion-only tests: whether the ray hits the primitive anywhere in (0, tMax)
+    static bool cylinderOccluded(const Ray &ray, float tMax);
+    static bool coneOccluded(const Ray &ray, float tMax);
+    static bool sphereOccluded(const Ray &ray, float tMax);
+    static bool cubeOccluded(const Ray &ray, float tMax);
+
+    static int quadraticEquation(float a, float b, float c, float roots[2]);
+
+    glm::vec3 phong(glm::vec3 position, glm::vec3 normal, glm::vec3 directionToCamera, const SceneMaterial &material,
+               const vector<SceneLightData> &lights, const SceneGlobalData &globalData, const RayTraceScene &scene, bool recursive, RGBA textureColor,
+               uint32_t *shadowed = nullptr, bool shadowsKnown = false);
+    bool checkShadow(const glm::vec3 origin, const glm::vec3 direction, const RayTraceScene &scene, int lightIndex, bool isDirectional, float tCheck);
+    glm::vec3 traceSecondary(const Ray &ray, glm::vec3 throughput, const RayTraceScene &scene);
+    static glm::vec3 refractDirection(glm::vec3 direction, glm::vec3 normal, float ior);
+    RGBA mapTexture(const glm::vec3 intersection, const glm::vec3 normal, const RenderShapeData &shape, const Texture &texture, float lod = 0.f);
+    RGBA sampleTexture(glm::vec2 uv, const RenderShapeData &shape, const Texture &texture, float lod);
+    float textureLod(const Ray &ray, const Ray &objectRay, float t, glm::vec3 normal, const RenderShapeData &shape,
+                     const Texture &texture, const glm::mat4 &inverseCTM, float spread);
+    static glm::vec2 textureCoordinates(glm::vec3 intersection, glm::vec3 normal, PrimitiveType type);
 
 private:
+    bool renderWindow(AccumulationBuffer::Pixel *pixels, const RayTraceScene &scene, int y0, int y1, Stats *stats, GBuffer *primaryHits,
+                      Progress *progress = nullptr);
+    bool pathTraceWindow(AccumulationBuffer::Pixel *pixels, const RayTraceScene &scene, int y0, int y1, Stats *stats, Progress *progress);
+    void forEachTile(int width, int top, int bottom, const function<void(int, int, int, int)> &renderTile, Progress *progress = nullptr);
+    int tileCount(int width, int rows) const;
+
     const Config m_config;
 };
 
@@ -1,19 +1,196 @@
 #include <stdexcept>
 #include "raytracescene.h"
 #include "utils/sceneparser.h"
+#include <iostream>
+#include <unordered_map>
+#include <atomic>
+#include <numeric>
+#include <QString>
+#include <QImage>
 
 using namespace std;
 
-RayTraceScene::RayTraceScene(int width, int height, const RenderData &metaData) {
+namespace {
+    // Folds raw bytes into a 64-bit FNV-1a hash
+    void hashBytes(uint64_t &hash, const void *data, size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+        }
+    }
+}
+
+RayTraceScene::RayTraceScene(int width, int height, const RenderData &metaData) :
+    RayTraceScene(width, height, SceneSnapshot(metaData), metaData.cameraData)
+{}
+
+RayTraceScene::RayTraceScene(int width, int height, const SceneSnapshot &snapshot, const SceneCameraData &cameraData) {
+    static atomic<long long> scenesBuilt = 0;
+    m_id = scenesBuilt++;
     m_width = width;
     m_height = height;
-    m_globalData = metaData.globalData;
-    m_cameraData = metaData.cameraData;
-    m_camera.init(metaData.cameraData, width, height);
-    m_shapes = metaData.shapes;
-    m_lights = metaData.lights;
+    m_snapshot = snapshot;
+    m_cameraData = cameraData;
+    m_camera.init(cameraData, width, height);
+    const vector<RenderShapeData> &shapes = m_snapshot.shapes();
+
+    // Textures and meshes are loaded once per distinct filename and shared between shapes
+    unordered_map<string, int> textureIndices;
+    unordered_map<string, int> meshIndices;
+    vector<glm::mat4> inverseCTMs;
+    vector<AABB> bounds;
+    m_shapeCache.reserve(shapes.size());
+    inverseCTMs.reserve(shapes.size());
+    bounds.reserve(shapes.size());
+    for (const RenderShapeData &shape : shapes) {
+        ShapeCache cache;
+        cache.inverseCTM = glm::inverse(shape.ctm);
+        cache.normalMatrix = glm::inverse(glm::transpose(glm::mat3(shape.ctm)));
+        cache.worldBounds = unitPrimitiveBounds(shape.ctm);
+        cache.textureIndex = -1;
+        cache.meshIndex = -1;
+
+        if (shape.primitive.type == PrimitiveType::PRIMITIVE_MESH) {
+            const string &meshfile = shape.primitive.meshfile;
+            if (meshfile.empty()) {
+                cache.meshIndex = loadMesh(shape);
+            } else {
+                auto found = meshIndices.find(meshfile);
+                if (found == meshIndices.end()) {
+                    found = meshIndices.insert({meshfile, loadMesh(shape)}).first;
+                }
+                cache.meshIndex = found->second;
+            }
+            // A mesh that failed to load is left as an empty box at the shape's origin
+            AABB meshBounds{glm::vec3(0.f), glm::vec3(0.f)};
+            if (cache.meshIndex != -1) {
+                meshBounds = m_meshes[cache.meshIndex].bounds();
+            }
+            cache.worldBounds = transformedBounds(meshBounds, shape.ctm);
+        }
+
+        const string &filename = shape.primitive.material.textureMap.filename;
+        if (shape.primitive.material.textureMap.isUsed && !filename.empty()) {
+            auto found = textureIndices.find(filename);
+            if (found == textureIndices.end()) {
+                found = textureIndices.insert({filename, loadTexture(filename)}).first;
+            }
+            cache.textureIndex = found->second;
+        }
+        m_shapeCache.push_back(cache);
+        inverseCTMs.push_back(cache.inverseCTM);
+        bounds.push_back(cache.worldBounds);
+    }
+    m_primitives.build(shapes, inverseCTMs, bounds);
+
+    // The hierarchy indexes store slots, so its leaves point into the packed arrays
+    vector<AABB> slotBounds(bounds.size());
+    for (int slot = 0; slot < m_primitives.size(); slot++) {
+        slotBounds[slot] = bounds[m_primitives.shapeIndex(slot)];
+    }
+    m_bvh.build(slotBounds);
+
+    for (const AABB &box : bounds) {
+        m_bounds.expand(box);
+    }
+    m_lightIndices.resize(m_snapshot.lights().size());
+    iota(m_lightIndices.begin(), m_lightIndices.end(), 0);
+
+    uint64_t key = 0xcbf29ce484222325ULL;
+    for (const RenderShapeData &shape : shapes) {
+        hashBytes(key, &shape.primitive.type, sizeof(shape.primitive.type));
+        hashBytes(key, &shape.ctm, sizeof(shape.ctm));
+        hashBytes(key, shape.primitive.meshfile.data(), shape.primitive.meshfile.size());
+        for (const objl::Vertex &vertex : shape.meshData.Vertices) {
+            hashBytes(key, &vertex.Position, sizeof(vertex.Position));
+            hashBytes(key, &vertex.Normal, sizeof(vertex.Normal));
+        }
+        hashBytes(key, shape.meshData.Indices.data(), shape.meshData.Indices.size() * sizeof(unsigned int));
+    }
+    m_shapeKey = key;
+    RayTraceScene::hashGeometry();
+
+    key = 0xcbf29ce484222325ULL;
+    for (const SceneLightData &light : m_snapshot.lights()) {
+        hashBytes(key, &light.type, sizeof(light.type));
+        hashBytes(key, &light.pos, sizeof(light.pos));
+        hashBytes(key, &light.dir, sizeof(light.dir));
+        hashBytes(key, &light.color, sizeof(light.color));
+        hashBytes(key, &light.function, sizeof(light.function));
+        hashBytes(key, &light.angle, sizeof(light.angle));
+    }
+    m_lightKey = key;
+}
+
+void RayTraceScene::setCamera(const SceneCameraData &cameraData) {
+    m_cameraData = cameraData;
+    m_camera.init(cameraData, m_width, m_height);
+    RayTraceScene::hashGeometry();
+}
+
+// Combines the image size and the camera with the shapes' hash into m_geometryKey
+void RayTraceScene::hashGeometry() {
+    uint64_t key = 0xcbf29ce484222325ULL;
+    hashBytes(key, &m_width, sizeof(m_width));
+    hashBytes(key, &m_height, sizeof(m_height));
+    hashBytes(key, &m_cameraData.pos, sizeof(m_cameraData.pos));
+    hashBytes(key, &m_cameraData.look, sizeof(m_cameraData.look));
+    hashBytes(key, &m_cameraData.up, sizeof(m_cameraData.up));
+    hashBytes(key, &m_cameraData.heightAngle, sizeof(m_cameraData.heightAngle));
+    hashBytes(key, &m_shapeKey, sizeof(m_shapeKey));
+    m_geometryKey = key;
 }
 
+// Builds the triangle mesh of a mesh shape into m_meshes, returning its index or -1 if it has no triangles.
+// Shapes parsed from an OBJ carry their mesh; scene files only name the OBJ, which is loaded here.
+int RayTraceScene::loadMesh(const RenderShapeData &shape) {
+    if (!shape.meshData.Indices.empty()) {
+        m_meshes.emplace_back(shape.meshData.Vertices, shape.meshData.Indices);
+        return int(m_meshes.size()) - 1;
+    }
+    objl::Loader loader;
+    if (shape.primitive.meshfile.empty() || !loader.LoadFile(shape.primitive.meshfile) || loader.LoadedIndices.empty()) {
+        cout << "Error loading mesh" << endl;
+        return -1;
+    }
+    m_meshes.emplace_back(loader.LoadedVertices, loader.LoadedIndices);
+    return int(m_meshes.size()) - 1;
+}
+
+// Decodes a texture and builds its mip chain into m_textures, returning its index or -1 if it could not be loaded
+int RayTraceScene::loadTexture(const string &filename) {
+    QImage textureImage;
+    QString file = QString::fromStdString(filename);
+    if (!textureImage.load(file)) {
+        cout << "Error loading texture" << endl;
+        return -1;
+    }
+    textureImage = textureImage.convertToFormat(QImage::Format_RGBX8888);
+    int w = textureImage.width();
+    int h = textureImage.height();
+    QByteArray arr = QByteArray::fromRawData((const char*) textureImage.bits(), textureImage.sizeInBytes());
+
+    vector<RGBA> textureRGBA;
+    textureRGBA.reserve(w * h);
+    for (int i = 0; i < arr.size() / 4.f; i++){
+        textureRGBA.push_back(RGBA{(uint8_t) arr[4*i], (uint8_t) arr[4*i+1], (uint8_t) arr[4*i+2], (uint8_t) arr[4*i+3]});
+    }
+    m_textures.emplace_back(textureRGBA, w, h);
+    return int(m_textures.size()) - 1;
+}
+
+
+long long RayTraceScene::id() const {
+    return m_id;
+}
+
+uint64_t RayTraceScene::geometryKey() const {
+    return m_geometryKey;
+}
+
+uint64_t RayTraceScene::lightKey() const {
+    return m_lightKey;
+}
 
 const int& RayTraceScene::width() const {
     return m_width;
@@ -23,8 +200,12 @@ const int& RayTraceScene::height() const {
     return m_height;
 }
 
+const SceneSnapshot& RayTraceScene::getSnapshot() const {
+    return m_snapshot;
+}
+
 const SceneGlobalData& RayTraceScene::getGlobalData() const {
-    return m_globalData;
+    return m_snapshot.globalData();
 }
 
 const Camera& RayTraceScene::getCamera() const {
@@ -32,5 +213,40 @@ const Camera& RayTraceScene::getCamera() const {
 }
 
 const vector<RenderShapeData>& RayTraceScene::getShapes() const {
-    return m_shapes;
+    return m_snapshot.shapes();
+}
+
+const vector<SceneLightData>& RayTraceScene::getLights() const {
+    return m_snapshot.lights();
+}
+
+const ShapeCache& RayTraceScene::getShapeCache(int index) const {
+    return m_shapeCache[index];
+}
+
+const vector<Texture>& RayTraceScene::getTextures() const {
+    return m_textures;
+}
+
+const vector<TriangleMesh>& RayTraceScene::getMeshes() const {
+    return m_meshes;
+}
+
+const PrimitiveStore& RayTraceScene::getPrimitives() const {
+    return m_primitives;
+}
+
+const BVH& RayTraceScene::getBVH() const {
+    return m_bvh;
+}
+
+const LightGrid& RayTraceScene::getLightGrid() const {
+    call_once(m_lightGridBuilt, [this] {
+        m_lightGrid.build(m_snapshot.lights(), m_bounds);
+    });
+    return m_lightGrid;
+}
+
+span<const int> RayTraceScene::getLightIndices() const {
+    return span<const int>(m_lightIndices);
 }
@@ -1,12 +1,32 @@
 #pragma once
 
+#include "utils/rgba.h"
 #include "utils/scenedata.h"
 #include "utils/sceneparser.h"
+#include "utils/scenesnapshot.h"
 #include "camera/camera.h"
+#include "bvh.h"
+#include "lightgrid.h"
+#include "primitivestore.h"
+#include "trianglemesh.h"
+#include "texture.h"
+#include <mutex>
+#include <span>
 
 using namespace std;
 
-// A class representing a scene to be ray-traced
+// Everything derived from a shape that rays need, computed once on construction
+struct ShapeCache {
+    glm::mat4 inverseCTM;   // world space to object space
+    glm::mat3 normalMatrix; // inverse transpose of the CTM, takes object normals to world space
+    AABB worldBounds;
+    int textureIndex;       // index into getTextures(), or -1 when the shape is untextured
+    int meshIndex;          // index into getMeshes(), or -1 when the shape is not a loaded mesh
+};
+
+// A class representing a scene to be ray-traced.
+// The scene is immutable once constructed (but for setCamera between renders), so any number of render threads
+// may share it.
 
 // Feel free to make your own design choices for RayTraceScene, the functions below are all optional / for your convenience.
 // You can either implement and use these getters, or make your own design.
@@ -17,12 +37,35 @@ class RayTraceScene
 public:
     RayTraceScene(int width, int height, const RenderData &metaData);
 
+    // Shares the snapshot's shapes and lights instead of copying them, viewed through cameraData
+    RayTraceScene(int width, int height, const SceneSnapshot &snapshot, const SceneCameraData &cameraData);
+
+    // Views the scene through another camera, keeping everything built from its shapes and lights, so moving
+    // the camera costs nothing. Only for scenes no render is using.
+    void setCamera(const SceneCameraData &cameraData);
+
     // The getter of the width of the scene
     const int& width() const;
 
     // The getter of the height of the scene
     const int& height() const;
 
+    // A number that identifies this scene among all scenes built by the process, for caches keyed by scene
+    long long id() const;
+
+    // A hash of everything that decides what the rays through the pixel centers hit: the image size, the camera,
+    // and every shape's type, transform and mesh. Lights and materials are left out, so scenes that differ only
+    // in them share a key, and share primary hits.
+    uint64_t geometryKey() const;
+
+    // A hash of where the lights are and how far they reach: their number, types, positions, directions,
+    // colors, attenuations and cones. Which shadow rays are traced, and what they hit, depend on nothing else
+    // of the lights, so scenes that share both keys have the same shadows at their primary hits.
+    uint64_t lightKey() const;
+
+    // The getter of the snapshot the scene was built from
+    const SceneSnapshot& getSnapshot() const;
+
     // The getter of the global data of the scene
     const SceneGlobalData& getGlobalData() const;
 
@@ -32,11 +75,110 @@ public:
     // The getter of the shapes in the scene
     const vector<RenderShapeData>& getShapes() const;
 
+    // The getter of the lights in the scene
+    const vector<SceneLightData>& getLights() const;
+
+    // The getter of the data precomputed for the shape at index
+    const ShapeCache& getShapeCache(int index) const;
+
+    // The getter of the textures decoded for the scene's shapes, indexed by ShapeCache::textureIndex
+    const vector<Texture>& getTextures() const;
+
+    // The getter of the triangle meshes instanced by the scene's mesh shapes
+    const vector<TriangleMesh>& getMeshes() const;
+
+    // The getter of the packed intersection data of the shapes, in Morton order
+    const PrimitiveStore& getPrimitives() const;
+
+    // The getter of the bounding volume hierarchy over the primitive store, built once on construction
+    const BVH& getBVH() const;
+
+    // The getter of the lists of the lights that reach each part of the scene. Only light culling needs them, so
+    // they are built on first use instead of on construction; any number of threads may ask at once.
+    const LightGrid& getLightGrid() const;
+
+    // Every light's index, in scene order, for shading that visits them all
+    span<const int> getLightIndices() const;
+
+    // Visits the primitive store slots of shapes a world-space ray may hit closer than tMax, through the BVH
+    // when accelerated and by brute force otherwise. See BVH::traverse for the visitor contract.
+    // When entryNodes is not null, the BVH is only searched below those nodes, which BVH::cull found for a
+    // frustum the ray lies in.
+    template <typename Visitor>
+    void visitCandidates(const glm::vec3 &origin, const glm::vec3 &direction, const float &tMax, bool accelerated, Visitor visit,
+                         const vector<int> *entryNodes = nullptr) const;
+
+    // Like visitCandidates, for the shapes any ray of a packet may hit. See BVH::traversePacket.
+    template <int size, typename Visitor>
+    void visitPacketCandidates(const glm::vec3 *origins, const glm::vec3 *directions, const float *tMax, bool accelerated, Visitor visit,
+                               const vector<int> *entryNodes = nullptr) const;
+
+private:
+    int loadTexture(const string &filename);
+    int loadMesh(const RenderShapeData &shape);
+    void hashGeometry();
+
+    long long m_id;
+    uint64_t m_geometryKey;
+    uint64_t m_shapeKey; // the part of m_geometryKey that the camera has no say in
+    uint64_t m_lightKey;
     int m_width;
     int m_height;
-    SceneGlobalData m_globalData;
+    SceneSnapshot m_snapshot;
     SceneCameraData m_cameraData;
     Camera m_camera;
-    vector<RenderShapeData> m_shapes;
-    vector<SceneLightData> m_lights;
+
+    vector<ShapeCache> m_shapeCache;
+    vector<Texture> m_textures;
+    vector<TriangleMesh> m_meshes;
+    PrimitiveStore m_primitives;
+    BVH m_bvh;
+    AABB m_bounds; // of every shape, which the light grid covers
+    vector<int> m_lightIndices;
+    mutable once_flag m_lightGridBuilt;
+    mutable LightGrid m_lightGrid;
 };
+
+template <typename Visitor>
+void RayTraceScene::visitCandidates(const glm::vec3 &origin, const glm::vec3 &direction, const float &tMax, bool accelerated, Visitor visit,
+                                    const vector<int> *entryNodes) const {
+    if (accelerated && entryNodes != nullptr) {
+        for (int node : *entryNodes) {
+            if (m_bvh.traverse(origin, direction, tMax, visit, node)) {
+                return;
+            }
+        }
+        return;
+    }
+    if (accelerated) {
+        m_bvh.traverse(origin, direction, tMax, visit);
+        return;
+    }
+    for (int i = 0; i < m_primitives.size(); i++) {
+        if (visit(i)) {
+            return;
+        }
+    }
+}
+
+template <int size, typename Visitor>
+void RayTraceScene::visitPacketCandidates(const glm::vec3 *origins, const glm::vec3 *directions, const float *tMax, bool accelerated, Visitor visit,
+                                          const vector<int> *entryNodes) const {
+    if (accelerated && entryNodes != nullptr) {
+        for (int node : *entryNodes) {
+            if (m_bvh.traversePacket<size>(origins, directions, tMax, visit, node)) {
+                return;
+            }
+        }
+        return;
+    }
+    if (accelerated) {
+        m_bvh.traversePacket<size>(origins, directions, tMax, visit);
+        return;
+    }
+    for (int i = 0; i < m_primitives.size(); i++) {
+        if (visit(i)) {
+            return;
+        }
+    }
+}
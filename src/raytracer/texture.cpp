@@ -0,0 +1,94 @@
+#include "texture.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+Texture::Texture(const vector<RGBA> &pixels, int width, int height) {
+    int w = max(1, width), h = max(1, height);
+    size_t offset = 0;
+    while (true) {
+        int tilesX = (w + 3) / 4, tilesY = (h + 3) / 4;
+        m_levels.push_back(Level{w, h, tilesX, offset});
+        offset += size_t(tilesX) * tilesY * 16;
+        if (w == 1 && h == 1) {
+            break;
+        }
+        w = max(1, w / 2);
+        h = max(1, h / 2);
+    }
+    m_texels.resize(offset);
+
+    auto store = [&](int level, int x, int y, RGBA color) {
+        const Level &l = m_levels[level];
+        size_t tile = size_t(y >> 2) * l.tilesX + (x >> 2);
+        m_texels[l.offset + (tile << 4) + ((y & 3) << 2) + (x & 3)] = color;
+    };
+    if (!pixels.empty()) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                store(0, x, y, pixels[size_t(y) * width + x]);
+            }
+        }
+    }
+
+    // Each texel averages the 2x2 block under it; the last row or column of an odd level is reused
+    for (int level = 1; level < levelCount(); level++) {
+        const Level &above = m_levels[level - 1];
+        for (int y = 0; y < m_levels[level].height; y++) {
+            for (int x = 0; x < m_levels[level].width; x++) {
+                int x0 = min(2 * x, above.width - 1), x1 = min(2 * x + 1, above.width - 1);
+                int y0 = min(2 * y, above.height - 1), y1 = min(2 * y + 1, above.height - 1);
+                RGBA a = texel(level - 1, x0, y0), b = texel(level - 1, x1, y0);
+                RGBA c = texel(level - 1, x0, y1), d = texel(level - 1, x1, y1);
+                store(level, x, y, RGBA{uint8_t((a.r + b.r + c.r + d.r + 2) / 4),
+                                        uint8_t((a.g + b.g + c.g + d.g + 2) / 4),
+                                        uint8_t((a.b + b.b + c.b + d.b + 2) / 4),
+                                        uint8_t((a.a + b.a + c.a + d.a + 2) / 4)});
+            }
+        }
+    }
+}
+
+int Texture::width() const {
+    return m_levels[0].width;
+}
+
+int Texture::height() const {
+    return m_levels[0].height;
+}
+
+int Texture::levelCount() const {
+    return int(m_levels.size());
+}
+
+glm::vec4 Texture::bilinear(int level, float s, float t) const {
+    const Level &l = m_levels[level];
+    // Texel centers sit at half-integer coordinates of the level
+    float x = s * (float(l.width) / float(width())) - 0.5f;
+    float y = t * (float(l.height) / float(height())) - 0.5f;
+    float fx = floor(x), fy = floor(y);
+    int x0 = int(fx), y0 = int(fy);
+    float wx = x - fx, wy = y - fy;
+    auto color = [&](int x, int y) {
+        RGBA c = texel(level, x, y);
+        return glm::vec4{c.r, c.g, c.b, c.a};
+    };
+    glm::vec4 top = glm::mix(color(x0, y0), color(x0 + 1, y0), wx);
+    glm::vec4 bottom = glm::mix(color(x0, y0 + 1), color(x0 + 1, y0 + 1), wx);
+    return glm::mix(top, bottom, wy);
+}
+
+glm::vec4 Texture::trilinear(float s, float t, float lod) const {
+    // NaN footprints (from degenerate hits) fall back to the full image
+    if (!(lod > 0.f)) {
+        return bilinear(0, s, t);
+    }
+    int last = levelCount() - 1;
+    if (lod >= float(last)) {
+        return bilinear(last, s, t);
+    }
+    int level = int(lod);
+    float blend = lod - float(level);
+    return glm::mix(bilinear(level, s, t), bilinear(level + 1, s, t), blend);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <vector>
+#include "utils/rgba.h"
+
+using namespace std;
+
+// A texture image decoded once when the scene is built, with its whole mip chain.
+// Every level halves the one above it (rounding down) until it is one texel wide and high.
+// Texels are stored in 4x4 tiles of 64 bytes, one cache line each, so the four texels of a bilinear
+// lookup (and the lookups of neighbouring pixels) almost always share a line, even on large images.
+// Texel coordinates wrap around, which is what repeated textures want anyway.
+
+class Texture {
+public:
+    // Builds the mip chain of an image given row by row from the top left
+    Texture(const vector<RGBA> &pixels, int width, int height);
+
+    // The size of the full resolution image
+    int width() const;
+    int height() const;
+
+    int levelCount() const;
+
+    // The texel at column x and row y of a mip level, counted from the top left
+    RGBA texel(int level, int x, int y) const {
+        const Level &l = m_levels[level];
+        x %= l.width;
+        y %= l.height;
+        x += (x < 0) ? l.width : 0;
+        y += (y < 0) ? l.height : 0;
+        size_t tile = size_t(y >> 2) * l.tilesX + (x >> 2);
+        return m_texels[l.offset + (tile << 4) + ((y & 3) << 2) + (x & 3)];
+    }
+
+    // Filtered lookups at (s, t), measured in texels of the full resolution image from its top left corner.
+    // Results are in [0, 255] per channel. lod is the mip level to sample, fractional levels blend the two nearest;
+    // it is clamped to the chain, so a lod of 0 or less is a bilinear lookup of the full image.
+    glm::vec4 bilinear(int level, float s, float t) const;
+    glm::vec4 trilinear(float s, float t, float lod) const;
+
+private:
+    struct Level {
+        int width;
+        int height;
+        int tilesX;
+        size_t offset; // of the level's first tile in m_texels
+    };
+
+    vector<Level> m_levels;
+    vector<RGBA> m_texels;
+};
@@ -0,0 +1,141 @@
+#include "threadpool.h"
+
+using namespace std;
+
+namespace {
+    // The pool whose worker is running on this thread, and which worker it is
+    thread_local const ThreadPool *currentPool = nullptr;
+    thread_local int currentWorker = -1;
+}
+
+ThreadPool::ThreadPool(int threadCount) {
+    if (threadCount <= 0) {
+        threadCount = max(1, int(thread::hardware_concurrency()));
+    }
+    for (int i = 0; i < threadCount; i++) {
+        m_queues.push_back(make_unique<WorkQueue>());
+    }
+    for (int i = 0; i < threadCount; i++) {
+        m_threads.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for (thread &worker : m_threads) {
+        worker.join();
+    }
+}
+
+int ThreadPool::threadCount() const {
+    return int(m_threads.size());
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::parallelFor(int taskCount, int maxWorkers, const function<void(int, int)> &task) {
+    if (taskCount <= 0) {
+        return;
+    }
+    if (currentPool == this) {
+        ThreadPool::runInline(taskCount, task);
+        return;
+    }
+    lock_guard<mutex> submit(m_submitMutex);
+    int workers = (maxWorkers <= 0) ? threadCount() : min(maxWorkers, threadCount());
+
+    // Workers join a batch under m_mutex when they see its generation. One that woke too late for the last
+    // batch may still be looking for its tasks, so the next is only set up once it has left; any worker that
+    // joins afterwards sees the new generation, and only the first workers of it take part.
+    unique_lock<mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_busyWorkers == 0; });
+    m_task = task;
+    m_activeWorkers = workers;
+    m_remaining = taskCount;
+    // Hand every worker a contiguous run of tasks; stealing evens out the rest
+    for (int worker = 0; worker < workers; worker++) {
+        WorkQueue &queue = *m_queues[worker];
+        lock_guard<mutex> queueLock(queue.lock);
+        for (int i = worker * taskCount / workers; i < (worker + 1) * taskCount / workers; i++) {
+            queue.tasks.push_back(i);
+        }
+    }
+
+    m_generation++;
+    m_wake.notify_all();
+    m_done.wait(lock, [this] { return m_remaining == 0; });
+}
+
+void ThreadPool::workerLoop(int worker) {
+    currentPool = this;
+    currentWorker = worker;
+    long long seenGeneration = 0;
+    while (true) {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_wake.wait(lock, [&] { return m_stopping || m_generation != seenGeneration; });
+            if (m_stopping) {
+                return;
+            }
+            seenGeneration = m_generation;
+            if (worker >= m_activeWorkers) {
+                continue;
+            }
+            m_busyWorkers++;
+        }
+        runTasks(worker);
+        lock_guard<mutex> lock(m_mutex);
+        if (--m_busyWorkers == 0) {
+            m_done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::runTasks(int worker) {
+    int task;
+    while (popLocal(worker, task) || steal(worker, task)) {
+        m_task(task, worker);
+        if (--m_remaining == 0) {
+            lock_guard<mutex> lock(m_mutex);
+            m_done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::runInline(int taskCount, const function<void(int, int)> &task) {
+    for (int i = 0; i < taskCount; i++) {
+        task(i, currentWorker);
+    }
+}
+
+bool ThreadPool::popLocal(int worker, int &task) {
+    WorkQueue &queue = *m_queues[worker];
+    lock_guard<mutex> lock(queue.lock);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+}
+
+bool ThreadPool::steal(int worker, int &task) {
+    int workers = m_activeWorkers;
+    for (int offset = 1; offset < workers; offset++) {
+        WorkQueue &queue = *m_queues[(worker + offset) % workers];
+        lock_guard<mutex> lock(queue.lock);
+        if (!queue.tasks.empty()) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
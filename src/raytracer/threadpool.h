@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// A persistent pool of worker threads that runs batches of independent tasks.
+// Every worker owns a deque of task indices; a worker that runs out of work
+// steals from the opposite end of another worker's deque, so batches whose
+// tasks vary wildly in cost (e.g. tiles full of reflective surfaces) stay balanced.
+
+class ThreadPool {
+public:
+    // Starts threadCount workers, or one per hardware thread when threadCount <= 0
+    explicit ThreadPool(int threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool& operator=(const ThreadPool &) = delete;
+
+    int threadCount() const;
+
+    // Runs task(index, worker) for every index in [0, taskCount) and blocks until all have finished.
+    // At most maxWorkers workers take part (all of them when maxWorkers <= 0).
+    // Concurrent calls are serialized. A call from inside one of the pool's own tasks runs its tasks one after
+    // another on the calling worker, since the other workers may all be waiting on that task.
+    void parallelFor(int taskCount, int maxWorkers, const function<void(int, int)> &task);
+
+    // The process-wide pool, started on first use and reused by every render
+    static ThreadPool& shared();
+
+private:
+    struct WorkQueue {
+        mutex lock;
+        deque<int> tasks;
+    };
+
+    void workerLoop(int worker);
+    void runTasks(int worker);
+    void runInline(int taskCount, const function<void(int, int)> &task);
+    bool popLocal(int worker, int &task);
+    bool steal(int worker, int &task);
+
+    vector<thread> m_threads;
+    vector<unique_ptr<WorkQueue>> m_queues;
+
+    mutex m_submitMutex;
+    mutex m_mutex;
+    condition_variable m_wake;
+    condition_variable m_done;
+    long long m_generation = 0;
+    int m_busyWorkers = 0; // workers that joined the current batch and haven't left it yet
+    bool m_stopping = false;
+
+    function<void(int, int)> m_task;
+    atomic<int> m_activeWorkers = 0;
+    atomic<int> m_remaining = 0;
+};
@@ -0,0 +1,138 @@
+#include "trianglemesh.h"
+#include <cmath>
+
+using namespace std;
+
+namespace {
+    // The ray in the shear-and-scale frame of the watertight ray/triangle test
+    // (Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection", JCGT 2013).
+    // The axis the ray travels fastest along becomes z, so triangles sharing an edge
+    // compute exactly the same edge function for it and no ray slips between them.
+    struct ShearedRay {
+        glm::vec3 origin;
+        int kx, ky, kz;
+        float sx, sy, sz;
+
+        ShearedRay(const glm::vec3 &origin, const glm::vec3 &direction) : origin(origin) {
+            glm::vec3 magnitude = glm::abs(direction);
+            kz = (magnitude.x > magnitude.y) ? ((magnitude.x > magnitude.z) ? 0 : 2) : ((magnitude.y > magnitude.z) ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            // Keep the winding the same after the axes are permuted
+            if (direction[kz] < 0) {
+                swap(kx, ky);
+            }
+            sx = direction[kx] / direction[kz];
+            sy = direction[ky] / direction[kz];
+            sz = 1.f / direction[kz];
+        }
+    };
+
+    // Returns whether the ray hits the triangle in (0, tMax), with the distance and barycentric weights of the hit
+    bool intersectTriangle(const ShearedRay &ray, const glm::vec3 *triangle, float tMax, float &t, glm::vec3 &weights) {
+        glm::vec3 a = triangle[0] - ray.origin;
+        glm::vec3 b = triangle[1] - ray.origin;
+        glm::vec3 c = triangle[2] - ray.origin;
+        float ax = a[ray.kx] - ray.sx * a[ray.kz], ay = a[ray.ky] - ray.sy * a[ray.kz];
+        float bx = b[ray.kx] - ray.sx * b[ray.kz], by = b[ray.ky] - ray.sy * b[ray.kz];
+        float cx = c[ray.kx] - ray.sx * c[ray.kz], cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+        float u = cx * by - cy * bx;
+        float v = ax * cy - ay * cx;
+        float w = bx * ay - by * ax;
+        // Edges through the ray itself are redone in double precision so the sign is exact
+        if (u == 0.f || v == 0.f || w == 0.f) {
+            u = float(double(cx) * double(by) - double(cy) * double(bx));
+            v = float(double(ax) * double(cy) - double(ay) * double(cx));
+            w = float(double(bx) * double(ay) - double(by) * double(ax));
+        }
+        if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f)) {
+            return false;
+        }
+        float determinant = u + v + w;
+        if (determinant == 0.f) {
+            return false;
+        }
+        float az = ray.sz * a[ray.kz], bz = ray.sz * b[ray.kz], cz = ray.sz * c[ray.kz];
+        float scaledT = u * az + v * bz + w * cz;
+        // Compare t against (0, tMax) without dividing, whatever the determinant's sign
+        if (determinant < 0.f ? (scaledT >= 0.f || scaledT < tMax * determinant) : (scaledT <= 0.f || scaledT > tMax * determinant)) {
+            return false;
+        }
+        t = scaledT / determinant;
+        weights = glm::vec3{u, v, w} / determinant;
+        return t < tMax;
+    }
+}
+
+TriangleMesh::TriangleMesh(const vector<objl::Vertex> &vertices, const vector<unsigned int> &indices) {
+    int triangles = int(indices.size() / 3);
+    m_positions.reserve(3 * triangles);
+    m_normals.reserve(3 * triangles);
+    vector<AABB> triangleBounds;
+    triangleBounds.reserve(triangles);
+    for (int i = 0; i < triangles; i++) {
+        AABB box;
+        for (int corner = 0; corner < 3; corner++) {
+            const objl::Vertex &vertex = vertices[indices[3 * i + corner]];
+            glm::vec3 position = {vertex.Position.X, vertex.Position.Y, vertex.Position.Z};
+            m_positions.push_back(position);
+            m_normals.push_back(glm::vec3{vertex.Normal.X, vertex.Normal.Y, vertex.Normal.Z});
+            box.expand(position);
+        }
+        triangleBounds.push_back(box);
+        m_bounds.expand(box);
+    }
+    m_bvh.build(triangleBounds);
+}
+
+const AABB& TriangleMesh::bounds() const {
+    return m_bounds;
+}
+
+int TriangleMesh::triangleCount() const {
+    return int(m_positions.size() / 3);
+}
+
+bool TriangleMesh::intersect(const RayTracer::Ray &ray, float tMax, RayTracer::Hit &hit) const {
+    return trace<false>(ray, tMax, hit);
+}
+
+bool TriangleMesh::occluded(const RayTracer::Ray &ray, float tMax) const {
+    RayTracer::Hit hit;
+    return trace<true>(ray, tMax, hit);
+}
+
+template <bool anyHit>
+bool TriangleMesh::trace(const RayTracer::Ray &ray, float tMax, RayTracer::Hit &hit) const {
+    glm::vec3 origin = glm::vec3(ray.origin);
+    glm::vec3 direction = glm::vec3(ray.direction);
+    ShearedRay sheared(origin, direction);
+    int closest = -1;
+    glm::vec3 closestWeights;
+    hit.t = tMax;
+    m_bvh.traverse(origin, direction, hit.t, [&](int triangle) {
+        float t;
+        glm::vec3 weights;
+        if (intersectTriangle(sheared, &m_positions[3 * triangle], hit.t, t, weights)) {
+            hit.t = t;
+            closest = triangle;
+            closestWeights = weights;
+            return anyHit;
+        }
+        return false;
+    });
+    if (closest == -1) {
+        return false;
+    }
+    if (!anyHit) {
+        const glm::vec3 *normals = &m_normals[3 * closest];
+        const glm::vec3 *positions = &m_positions[3 * closest];
+        hit.normal = closestWeights.x * normals[0] + closestWeights.y * normals[1] + closestWeights.z * normals[2];
+        // Meshes without vertex normals fall back to the face normal
+        if (glm::dot(hit.normal, hit.normal) == 0.f) {
+            hit.normal = glm::cross(positions[1] - positions[0], positions[2] - positions[0]);
+        }
+    }
+    return true;
+}
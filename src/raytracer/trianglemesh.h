@@ -0,0 +1,37 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "utils/OBJ_Loader.h"
+#include "raytracer.h"
+#include "bvh.h"
+
+using namespace std;
+
+// A triangle mesh in object space with a BVH of its own (the bottom level). One is built per distinct
+// mesh and shared by every shape that instances it; the scene's BVH over shape transforms is the top level.
+
+class TriangleMesh {
+public:
+    // Builds the mesh from an indexed triangle list, as loaded by objl::Loader
+    TriangleMesh(const vector<objl::Vertex> &vertices, const vector<unsigned int> &indices);
+
+    // The object-space bounds of all triangles
+    const AABB& bounds() const;
+
+    int triangleCount() const;
+
+    // Closest-hit and occlusion tests of an object-space ray, like the unit primitives' intersectors.
+    // Only hits in (0, tMax) count. The hit normal interpolates the vertex normals.
+    bool intersect(const RayTracer::Ray &ray, float tMax, RayTracer::Hit &hit) const;
+    bool occluded(const RayTracer::Ray &ray, float tMax) const;
+
+private:
+    template <bool anyHit>
+    bool trace(const RayTracer::Ray &ray, float tMax, RayTracer::Hit &hit) const;
+
+    vector<glm::vec3> m_positions; // three per triangle
+    vector<glm::vec3> m_normals;   // three per triangle
+    AABB m_bounds;
+    BVH m_bvh;
+};
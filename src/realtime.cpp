@@ -7,7 +7,6 @@
 #include "debug.h"
 #include "glm/gtx/transform.hpp"
 #include "raytracer/raytracer.h"
-#include "raytracer/raytracescene.h"
 #include "settings.h"
 #include "shaderloader.h"
 #include "utils/sceneparser.h"
@@ -31,10 +30,18 @@ Realtime::Realtime(QWidget *parent)
     m_keyMap[Qt::Key_D]       = false;
     m_keyMap[Qt::Key_Control] = false;
     m_keyMap[Qt::Key_Space]   = false;
+
+    // Tiles arrive on the UI thread, queued from the job's thread
+    m_rayTraceJobs = std::make_unique<RenderJobQueue>();
+    connect(m_rayTraceJobs.get(), &RenderJobQueue::tileFinished, this, [this](int id, QRect rect, QImage tile) {
+        uploadRayTraceTile(id, rect, tile);
+    });
 }
 
 void Realtime::finish() {
     killTimer(m_timer);
+    // Stops the job being traced, which may still be using m_primaryHits
+    m_rayTraceJobs.reset();
     this->makeCurrent();
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -62,6 +69,9 @@ void Realtime::finish() {
 
     glDeleteProgram(m_lighting_shader);
 
+    glDeleteTextures(1, &m_raytrace_texture);
+    glDeleteProgram(m_raytrace_shader);
+
     glDeleteProgram(m_postprocess_shader);
     glDeleteProgram(m_pixeloutline_shader);
 
@@ -219,9 +229,23 @@ void Realtime::initializeGL() {
     m_lighting_shader = ShaderLoader::createShaderProgram(":/resources/shaders/default.vert", ":/resources/shaders/default.frag");
     m_postprocess_shader = ShaderLoader::createShaderProgram(":/resources/shaders/pixelation.vert", ":/resources/shaders/pixelation.frag");
     m_pixeloutline_shader = ShaderLoader::createShaderProgram(":/resources/shaders/pixelation.vert", ":/resources/shaders/pixeloutline.frag");
+    m_raytrace_shader = ShaderLoader::createShaderProgram(":/resources/shaders/pixelation.vert", ":/resources/shaders/raytrace.frag");
 
 
     initializePixelation();
+
+    /// RAY TRACING
+    glUseProgram(m_raytrace_shader);
+    glUniform1i(glGetUniformLocation(m_raytrace_shader, "m_texture"), 11);
+    glGenTextures(1, &m_raytrace_texture);
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D, m_raytrace_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    resizeRayTraceTexture();
+
     m_currParam1 = settings.shapeParameter1;
     m_currParam2 = settings.shapeParameter2;
     m_nearPlane = settings.nearPlane;
@@ -374,6 +398,21 @@ void Realtime::initializeGL() {
 }
 
 void Realtime::paintGL() {
+    if (m_rayTraced) {
+        // The ray traced view replaces the whole pipeline below
+        glBindFramebuffer(GL_FRAMEBUFFER, m_defaultFBO);
+        glViewport(0, 0, m_screen_width, m_screen_height);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glUseProgram(m_raytrace_shader);
+        glBindVertexArray(m_fullscreen_vao);
+        glActiveTexture(GL_TEXTURE11);
+        glBindTexture(GL_TEXTURE_2D, m_raytrace_texture);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        glBindVertexArray(0);
+        glUseProgram(0);
+        return;
+    }
+
     // activate main FBO
     glBindFramebuffer(GL_FRAMEBUFFER, renderFBO);
 
@@ -400,21 +439,21 @@ void Realtime::paintGL() {
 
     // Pass m_ka into the fragment shader as a uniform
     GLint ambientLocation = glGetUniformLocation(m_lighting_shader, "ambient");
-    glUniform1f(ambientLocation, m_data.globalData.ka);
+    glUniform1f(ambientLocation, m_scene.globalData().ka);
 
     // Pass light position and m_kd into the fragment shader as a uniform
     GLint diffuseLocation = glGetUniformLocation(m_lighting_shader, "diffuse");
-    glUniform1f(diffuseLocation, m_data.globalData.kd);
+    glUniform1f(diffuseLocation, m_scene.globalData().kd);
 
     // Pass shininess, m_ks, and world-space camera position
     GLint specularLocation = glGetUniformLocation(m_lighting_shader, "specular");
-    glUniform1f(specularLocation, m_data.globalData.ks);
+    glUniform1f(specularLocation, m_scene.globalData().ks);
 
     glm::vec4 cameraPos = inverse(m_viewMatrix) * glm::vec4{0, 0, 0, 1}; // viewMat * origin
     GLint cameraPosLocation = glGetUniformLocation(m_lighting_shader, "cameraPos");
     glUniform4fv(cameraPosLocation, 1, &cameraPos[0]);
 
-    int numLights = m_data.lights.size();
+    int numLights = m_scene.lights().size();
 
     GLint numLightsLocation = glGetUniformLocation(m_lighting_shader, "numLights");
     glUniform1i(numLightsLocation, numLights);
@@ -441,35 +480,35 @@ void Realtime::paintGL() {
     GLint penumbraLocation;
     for (int i = 0; i < numLights; i++) {
         int lightType;
-        switch(m_data.lights[i].type) {
+        switch(m_scene.lights()[i].type) {
             case LightType::LIGHT_POINT :
                 lightType = 0;
                 lightPosLocation = glGetUniformLocation(m_lighting_shader, ("lighting[" + std::to_string(i) + "].lightPos").c_str());
-                glUniform4fv(lightPosLocation, 1, &m_data.lights[i].pos[0]);
+                glUniform4fv(lightPosLocation, 1, &m_scene.lights()[i].pos[0]);
                 break;
             case LightType::LIGHT_DIRECTIONAL :
                 lightType = 1;
                 lightDirLocation = glGetUniformLocation(m_lighting_shader, ("lighting[" + std::to_string(i) + "].lightDir").c_str());
-                glUniform4fv(lightDirLocation, 1, &m_data.lights[i].dir[0]);
+                glUniform4fv(lightDirLocation, 1, &m_scene.lights()[i].dir[0]);
                 break;
             case LightType::LIGHT_SPOT :
                 lightType = 2;
                 lightDirLocation = glGetUniformLocation(m_lighting_shader, ("lighting[" + std::to_string(i) + "].lightDir").c_str());
-                glUniform4fv(lightDirLocation, 1, &m_data.lights[i].dir[0]);
+                glUniform4fv(lightDirLocation, 1, &m_scene.lights()[i].dir[0]);
 
                 lightPosLocation = glGetUniformLocation(m_lighting_shader, ("lighting[" + std::to_string(i) + "].lightPos").c_str());
-                glUniform4fv(lightPosLocation, 1, &m_data.lights[i].pos[0]);
+                glUniform4fv(lightPosLocation, 1, &m_scene.lights()[i].pos[0]);
 
                 angleLocation = glGetUniformLocation(m_lighting_shader, ("lighting[" + std::to_string(i) + "].angle").c_str());
-                glUniform1f(angleLocation, m_data.lights[i].angle);
+                glUniform1f(angleLocation, m_scene.lights()[i].angle);
 
                 penumbraLocation = glGetUniformLocation(m_lighting_shader, ("lighting[" + std::to_string(i) + "].penumbra").c_str());
-                glUniform1f(penumbraLocation, m_data.lights[i].penumbra);
+                glUniform1f(penumbraLocation, m_scene.lights()[i].penumbra);
                 break;
             default : // default -> Directional
                 lightType = 1;
                 lightDirLocation = glGetUniformLocation(m_lighting_shader, ("lighting[" + std::to_string(i) + "].lightDir").c_str());
-                glUniform4fv(lightDirLocation, 1, &m_data.lights[i].dir[0]);
+                glUniform4fv(lightDirLocation, 1, &m_scene.lights()[i].dir[0]);
                 break;
         }
 
@@ -477,14 +516,14 @@ void Realtime::paintGL() {
         glUniform1i(typeLocation, lightType);
 
         colorLocation = glGetUniformLocation(m_lighting_shader, ("lighting[" + std::to_string(i) + "].color").c_str());
-        glUniform4fv(colorLocation, 1, &m_data.lights[i].color[0]);
+        glUniform4fv(colorLocation, 1, &m_scene.lights()[i].color[0]);
 
         attenuationLocation = glGetUniformLocation(m_lighting_shader, ("lighting[" + std::to_string(i) + "].attenuation").c_str());
-        glUniform3fv(attenuationLocation, 1, &m_data.lights[i].function[0]);
+        glUniform3fv(attenuationLocation, 1, &m_scene.lights()[i].function[0]);
     }
 
     // Loop over shapes in scene
-    for (RenderShapeData &shape : m_data.shapes) {
+    for (const RenderShapeData &shape : m_scene.shapes()) {
 
         GLint modelLocation = glGetUniformLocation(m_lighting_shader, "modelMat");
         glUniformMatrix4fv(modelLocation, 1, GL_FALSE, &shape.ctm[0][0]);
@@ -651,20 +690,26 @@ void Realtime::resizeGL(int w, int h) {
     initializePixelation();
 
     // reset camera size/recalculate proj matrix
-    m_camera.init(m_data.cameraData, size().width(), size().height());
+    m_camera.init(m_cameraData, size().width(), size().height());
     m_projMatrix = m_camera.getProjectionMatrix();
     m_viewMatrix = m_camera.getViewMatrix();
+
+    resizeRayTraceTexture();
+    restartRayTrace();
 }
 
 void Realtime::sceneChanged() {
     makeCurrent();
     int success;
+    RenderData renderData;
     if (settings.sceneFilePath.ends_with(".xml")) {
-        success = SceneParser::parse(settings.sceneFilePath, m_data);
+        success = SceneParser::parse(settings.sceneFilePath, renderData);
+        m_scene = SceneSnapshot(std::move(renderData));
     } else {
-        success = SceneParser::parseMesh(settings.sceneFilePath, m_data);
+        success = SceneParser::parseMesh(settings.sceneFilePath, renderData);
+        m_scene = SceneSnapshot(std::move(renderData));
         m_isMesh = true;
-        if (m_data.shapes.empty()) {
+        if (m_scene.empty()) {
             std::cout << "some error while parsing mesh";
         } else {
             std::cout << "binding mesh" << std::endl;
@@ -676,12 +721,14 @@ void Realtime::sceneChanged() {
         std::cerr << "Error loading scene: \"" << settings.sceneFilePath << "\"" << std::endl;
         exit(1);
     }
+    m_cameraData = m_scene.cameraData();
 
 
-    m_camera.init(m_data.cameraData, size().width(), size().height());
+    m_camera.init(m_cameraData, size().width(), size().height());
     m_projMatrix = m_camera.getProjectionMatrix();
     m_viewMatrix = m_camera.getViewMatrix();
 
+    restartRayTrace();
     update(); // asks for a PaintGL() call to occur
 }
 
@@ -701,7 +748,7 @@ void Realtime::settingsChanged() {
 
     // updates camera projection matrix if near or far plane change
     if (planeChanged) {
-        m_camera.init(m_data.cameraData, size().width(), size().height());
+        m_camera.init(m_cameraData, size().width(), size().height());
         m_projMatrix = m_camera.getProjectionMatrix();
     }
 
@@ -872,7 +919,7 @@ void Realtime::bindMesh() {
     Mesh mesh;
     mesh.init();
     glBindBuffer(GL_ARRAY_BUFFER, m_meshVbo);
-    m_meshData = mesh.generateShape(m_data.shapes[0].meshData);
+    m_meshData = mesh.generateShape(m_scene.shapes()[0].meshData);
     glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_meshData.size(), m_meshData.data(), GL_STATIC_DRAW);
     glEnableVertexAttribArray(0); // adds position attribute
     glEnableVertexAttribArray(1); // adds normal attribute
@@ -1036,9 +1083,9 @@ void Realtime::translate(float dx, float dy, float dz) {
     translationMat[3][0] = dx;
     translationMat[3][1] = dy;
     translationMat[3][2] = dz;
-    m_data.cameraData.pos = translationMat * m_data.cameraData.pos;
+    m_cameraData.pos = translationMat * m_cameraData.pos;
     // since position is changing, recalculate view matrix
-    m_camera.init(m_data.cameraData, size().width(), size().height());
+    m_camera.init(m_cameraData, size().width(), size().height());
     m_viewMatrix = m_camera.getViewMatrix();
     // updates cameraPos in shader since viewMatrix is changing
     glUseProgram(m_lighting_shader);
@@ -1046,12 +1093,14 @@ void Realtime::translate(float dx, float dy, float dz) {
     GLint cameraPosLocation = glGetUniformLocation(m_lighting_shader, "cameraPos");
     glUniform4fv(cameraPosLocation, 1, &cameraPos[0]);
     glUseProgram(0);
+
+    restartRayTrace();
 }
 
 void Realtime::rotate(glm::mat4 rotation) {
-    m_data.cameraData.look = rotation * m_data.cameraData.look;
+    m_cameraData.look = rotation * m_cameraData.look;
     // since look vector is changing, update both projection and view matrices
-    m_camera.init(m_data.cameraData, size().width(), size().height());
+    m_camera.init(m_cameraData, size().width(), size().height());
     m_projMatrix = m_camera.getProjectionMatrix();
     m_viewMatrix = m_camera.getViewMatrix();
     // updates cameraPos in shader since viewMatrix is changing
@@ -1060,26 +1109,77 @@ void Realtime::rotate(glm::mat4 rotation) {
     GLint cameraPosLocation = glGetUniformLocation(m_lighting_shader, "cameraPos");
     glUniform4fv(cameraPosLocation, 1, &cameraPos[0]);
     glUseProgram(0);
-}
 
-QImage Realtime::raytraceScene() {
+    restartRayTrace();
+}
 
-    QImage image = QImage(m_screen_width, m_screen_height, QImage::Format_RGBX8888);
-    image.fill(Qt::black);
-    RGBA *data = reinterpret_cast<RGBA *>(image.bits());
+RenderJobQueue::Job Realtime::rayTraceJob() {
+    RenderJobQueue::Job job;
+    job.width = m_screen_width;
+    job.height = m_screen_height;
+    job.scene = m_scene;
+    job.camera = m_cameraData;
 
     // Setting up the raytracer
-    RayTracer::Config rtConfig{};
-    RayTracer raytracer{ rtConfig };
+    job.config.enableAcceleration = true;
+    job.config.enableParallelism = true;
+    job.config.enableLightCulling = true;
+
+    // A blocky preview shows within a few frames of the camera stopping, then sharpens and loses its aliasing
+    job.progressive = true;
+    job.samples = 16;
+
+    // Only the queue's jobs use it, one at a time
+    job.primaryHits = &m_primaryHits;
+    return job;
+}
+
+void Realtime::setRayTraced(bool rayTraced) {
+    m_rayTraced = rayTraced;
+    if (m_rayTraced) {
+        restartRayTrace();
+    } else {
+        m_rayTraceJobs->cancelAll();
+        m_rayTraceJob = 0;
+    }
+    update(); // asks for a PaintGL() call to occur
+}
 
-    RayTraceScene rtScene{ m_screen_width, m_screen_height, m_data };
+// Traces the current view in place of whatever is still being traced. The last image stays up until the new
+// one's tiles cover it.
+void Realtime::restartRayTrace() {
+    // The queue is gone once finish has been called
+    if (!m_rayTraced || m_rayTraceJobs == nullptr) {
+        return;
+    }
+    m_rayTraceJobs->cancelAll();
+    m_rayTraceJob = m_rayTraceJobs->submit(rayTraceJob());
+}
 
-    raytracer.render(data, rtScene);
-    return image;
+// Sizes m_raytrace_texture to the screen, which is what jobs trace
+void Realtime::resizeRayTraceTexture() {
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D, m_raytrace_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, m_screen_width, m_screen_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Copies a tile straight into the texture, so only the pixels that changed are uploaded
+void Realtime::uploadRayTraceTile(int id, QRect rect, QImage tile) {
+    // Tiles of jobs since replaced may be of another view or size
+    if (id != m_rayTraceJob) {
+        return;
+    }
+    makeCurrent();
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D, m_raytrace_texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x(), rect.y(), rect.width(), rect.height(), GL_RGBA, GL_UNSIGNED_BYTE, tile.constBits());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    update(); // asks for a PaintGL() call to occur
 }
 
 int Realtime::determineTesselation() {
-    int numShapes = m_data.shapes.size();
+    int numShapes = m_scene.shapes().size();
     if (numShapes > 30) {
         return 3;
     } else if (numShapes > 25) {
@@ -8,12 +8,16 @@
 #include <glm/glm.hpp>
 #include "glm/gtx/transform.hpp"
 
+#include <memory>
 #include <unordered_map>
 #include <QElapsedTimer>
 #include <QOpenGLWidget>
 #include <QTime>
 #include <QTimer>
 #include "utils/sceneparser.h"
+#include "utils/scenesnapshot.h"
+#include "raytracer/gbuffer.h"
+#include "renderjobqueue.h"
 #include "camera/camera.h"
 #include "shapes/Cone.h"
 #include "shapes/Cube.h"
@@ -28,7 +32,7 @@ public:
     void finish();                                      // Called on program exit
     void sceneChanged();
     void settingsChanged();
-    QImage raytraceScene();
+    void setRayTraced(bool rayTraced);                  // Shows the view ray traced in place of the rasterized one
 
 public slots:
     void tick(QTimerEvent* event);                      // Called once per tick of m_timer
@@ -64,6 +68,11 @@ private:
     void translate(float dx, float dy, float dz);
     void rotate(glm::mat4 rotation);
 
+    RenderJobQueue::Job rayTraceJob();                  // The ray tracing of the current view, for a RenderJobQueue
+    void restartRayTrace();
+    void resizeRayTraceTexture();
+    void uploadRayTraceTile(int id, QRect rect, QImage tile);
+
     // Tick Related Variables
     int m_timer;                                        // Stores timer which attempts to run ~60 times per second
     QElapsedTimer m_elapsedTimer;                       // Stores timer which keeps track of actual time between frames
@@ -77,7 +86,15 @@ private:
     int m_devicePixelRatio;
 
     Camera m_camera;
-    RenderData m_data;
+    SceneSnapshot m_scene;          // Shapes and lights as loaded, shared with the ray tracer
+    SceneCameraData m_cameraData;   // The camera as moved by the user
+    GBuffer m_primaryHits;          // Kept by ray tracing jobs, so tracing again without moving only re-shades
+
+    // While ray traced, the view is traced progressively in the background, again whenever the camera moves,
+    // and each tile is copied into m_raytrace_texture as it is traced
+    std::unique_ptr<RenderJobQueue> m_rayTraceJobs; // declared after m_primaryHits, so stopped before it goes
+    bool m_rayTraced = false;
+    int m_rayTraceJob = 0;          // id of the job whose tiles are shown, 0 when there is none
 
     // Shape to render
     Cone m_cone;
@@ -112,6 +129,8 @@ private:
     bool m_isMesh = false;
 
     GLuint m_lighting_shader; // Stores id of lighting shader program
+    GLuint m_raytrace_shader; // Draws m_raytrace_texture over the screen
+    GLuint m_raytrace_texture;
 
     GLuint m_fbo;
     GLuint m_fbo2;
@@ -0,0 +1,85 @@
+#include "bandqueue.h"
+#include <algorithm>
+
+BandQueue::BandQueue(int height, int bandRows) :
+    m_height(height),
+    m_bandRows(max(1, bandRows)),
+    m_remaining((height + m_bandRows - 1) / m_bandRows),
+    m_bands(m_remaining)
+{
+    for (int band = 0; band < bandCount(); band++) {
+        m_waiting.push_back(band);
+    }
+}
+
+int BandQueue::bandCount() const {
+    return int(m_bands.size());
+}
+
+int BandQueue::firstRow(int band) const {
+    return band * m_bandRows;
+}
+
+int BandQueue::endRow(int band) const {
+    return min(m_height, (band + 1) * m_bandRows);
+}
+
+int BandQueue::take(int worker, Clock::time_point now) {
+    // A worker isn't handed back a band it stalled on
+    for (auto it = m_waiting.begin(); it != m_waiting.end(); it++) {
+        Band &band = m_bands[*it];
+        if (band.worker == worker) {
+            continue;
+        }
+        int index = *it;
+        m_waiting.erase(it);
+        band.worker = worker;
+        band.takenAt = now;
+        return index;
+    }
+    return -1;
+}
+
+bool BandQueue::complete(int band) {
+    if (band < 0 || band >= bandCount() || m_bands[band].done) {
+        return false;
+    }
+    m_bands[band].done = true;
+    m_remaining--;
+    auto waiting = find(m_waiting.begin(), m_waiting.end(), band);
+    if (waiting != m_waiting.end()) {
+        m_waiting.erase(waiting);
+    }
+    return true;
+}
+
+void BandQueue::release(int worker) {
+    for (int index = 0; index < bandCount(); index++) {
+        Band &band = m_bands[index];
+        if (band.worker != worker) {
+            continue;
+        }
+        band.worker = -1;
+        if (!band.done && find(m_waiting.begin(), m_waiting.end(), index) == m_waiting.end()) {
+            m_waiting.push_front(index);
+        }
+    }
+}
+
+int BandQueue::requeueStalled(Clock::time_point now, Clock::duration timeout) {
+    int requeued = 0;
+    for (int index = bandCount() - 1; index >= 0; index--) {
+        const Band &band = m_bands[index];
+        if (band.done || band.worker < 0 || now - band.takenAt <= timeout ||
+            find(m_waiting.begin(), m_waiting.end(), index) != m_waiting.end()) {
+            continue;
+        }
+        m_waiting.push_front(index);
+        requeued++;
+    }
+    return requeued;
+}
+
+bool BandQueue::finished() const {
+    return m_remaining == 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+// Which worker renders which band, and which bands are done. A band that has been out for longer than the
+// stall timeout, or whose worker left, goes back to the front of the queue for the next worker to ask;
+// whichever copy of a band arrives first is kept.
+class BandQueue {
+public:
+    using Clock = chrono::steady_clock;
+
+    BandQueue(int height, int bandRows);
+
+    int bandCount() const;
+    int firstRow(int band) const;
+    int endRow(int band) const;
+
+    // Hands the next waiting band to worker, or returns -1 if none is waiting
+    int take(int worker, Clock::time_point now);
+
+    // Marks band as done; false if it already was (a slow worker finishing a reassigned band)
+    bool complete(int band);
+
+    // Puts back the bands worker was rendering, when it disconnects
+    void release(int worker);
+
+    // Puts back the bands that have been out for longer than timeout; returns how many
+    int requeueStalled(Clock::time_point now, Clock::duration timeout);
+
+    bool finished() const;
+
+private:
+    struct Band {
+        int worker = -1; // who the band was last handed to, or -1 while it waits
+        bool done = false;
+        Clock::time_point takenAt;
+    };
+
+    int m_height;
+    int m_bandRows;
+    int m_remaining;
+    vector<Band> m_bands;
+    deque<int> m_waiting;
+};
@@ -0,0 +1,395 @@
+#include "distributed.h"
+#include "raytracer/raytracescene.h"
+#include "utils/sceneparser.h"
+
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QEventLoop>
+#include <QHostAddress>
+#include <QProcess>
+#include <QRandomGenerator>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+namespace {
+    // Every message is its length, as a 32-bit integer, followed by its type and fields written with QDataStream:
+    //  - Hello (from a worker, first): the render's token
+    //  - Job (to a worker, once it has said hello): scene file, width, height, RayTracer::Config
+    //  - Band (to a worker): first row, end row
+    //  - Rows (from a worker): first row, end row, samples, refined pixels, blurred pixels, the rows' RGBA bytes
+    enum MessageType : quint8 {
+        JobMessage   = 1,
+        BandMessage  = 2,
+        RowsMessage  = 3,
+        HelloMessage = 4,
+    };
+
+    // The longest Hello, Job and Band messages may be; Rows messages may be as long as their rows plus this
+    const qsizetype maxControlLength = 64 * 1024;
+
+    const QDataStream::Version streamVersion = QDataStream::Qt_6_0;
+
+    QByteArray message(const function<void(QDataStream &)> &writeFields) {
+        QByteArray payload;
+        QDataStream out(&payload, QIODevice::WriteOnly);
+        out.setVersion(streamVersion);
+        writeFields(out);
+        QByteArray framed(sizeof(quint32), Qt::Uninitialized);
+        qToBigEndian<quint32>(quint32(payload.size()), framed.data());
+        return framed + payload;
+    }
+
+    // Whether the message received starts with claims to be longer than maxLength, so the peer can be dropped
+    // before its message is buffered
+    bool tooLong(const QByteArray &received, qsizetype maxLength) {
+        return received.size() >= qsizetype(sizeof(quint32)) && qsizetype(qFromBigEndian<quint32>(received.constData())) > maxLength;
+    }
+
+    // Moves the first whole message out of received, or returns false if it hasn't all arrived yet
+    bool takeMessage(QByteArray &received, QByteArray &payload) {
+        if (received.size() < qsizetype(sizeof(quint32))) {
+            return false;
+        }
+        qsizetype length = qFromBigEndian<quint32>(received.constData());
+        if (received.size() < qsizetype(sizeof(quint32)) + length) {
+            return false;
+        }
+        payload = received.mid(sizeof(quint32), length);
+        received.remove(0, sizeof(quint32) + length);
+        return true;
+    }
+
+    QDataStream& operator<<(QDataStream &out, const RayTracer::Config &config) {
+        out << config.enableRefraction << config.enableTextureFilter << config.enableSuperSample << config.enableAcceleration << config.enableDepthOfField
+            << config.tileSize << config.simdWidth << config.maxSamples << config.superSampleThreshold
+            << config.maxLensSamples << config.maxBounces << config.minThroughput << config.enablePathTracing
+            << config.minPathSamples << config.maxPathSamples << config.pathNoiseThreshold << config.maxPathBounces
+            << config.enableLightCulling;
+        return out;
+    }
+
+    QDataStream& operator>>(QDataStream &in, RayTracer::Config &config) {
+        in >> config.enableRefraction >> config.enableTextureFilter >> config.enableSuperSample >> config.enableAcceleration >> config.enableDepthOfField
+           >> config.tileSize >> config.simdWidth >> config.maxSamples >> config.superSampleThreshold
+           >> config.maxLensSamples >> config.maxBounces >> config.minThroughput >> config.enablePathTracing
+           >> config.minPathSamples >> config.maxPathSamples >> config.pathNoiseThreshold >> config.maxPathBounces
+           >> config.enableLightCulling;
+        return in;
+    }
+
+    // Splits host:port, or prints an error and returns false
+    bool splitAddress(const QString &address, QString &host, quint16 &port) {
+        qsizetype colon = address.lastIndexOf(':');
+        bool ok = false;
+        port = colon > 0 ? address.mid(colon + 1).toUShort(&ok) : 0;
+        if (!ok) {
+            cerr << "Invalid address, expected host:port: " << address.toStdString() << endl;
+            return false;
+        }
+        host = address.left(colon);
+        return true;
+    }
+}
+
+bool renderDistributed(const QString &sceneFile, int width, int height, const RayTracer::Config &config,
+                       const DistributedOptions &options, RGBA *imageData, RayTracer::Stats &stats) {
+    QString host = QHostAddress(QHostAddress::LocalHost).toString();
+    quint16 port = 0;
+    if (!options.listen.isEmpty() && !splitAddress(options.listen, host, port)) {
+        return false;
+    }
+    QTcpServer server;
+    if (!server.listen(QHostAddress(host), port)) {
+        cerr << "Error listening on " << host.toStdString() << ":" << port << ": " << server.errorString().toStdString() << endl;
+        return false;
+    }
+    cout << "Waiting for workers on " << host.toStdString() << ":" << server.serverPort() << endl;
+
+    using Clock = BandQueue::Clock;
+    BandQueue queue(height, options.bandRows);
+    Clock::duration stallTimeout = chrono::duration_cast<Clock::duration>(chrono::duration<double>(options.stallSeconds));
+    stats = RayTracer::Stats{};
+    stats.pixels = (long long)width * height;
+
+    // Local workers are given a token made up for this render when there is none
+    QString token = options.token;
+    if (token.isEmpty()) {
+        token = QString::number(QRandomGenerator::system()->generate64(), 16) + QString::number(QRandomGenerator::system()->generate64(), 16);
+    }
+    QByteArray job = message([&](QDataStream &out) {
+        out << quint8(JobMessage) << sceneFile << width << height << config;
+    });
+
+    struct Worker {
+        QTcpSocket *socket; // null once the worker has left
+        QByteArray received;
+        bool joined = false; // whether it has given the token, and so been sent the job
+        int bandsOut = 0;
+    };
+    const qsizetype maxRowsLength = qsizetype(width) * max(1, options.bandRows) * qsizetype(sizeof(RGBA)) + maxControlLength;
+    // A worker gets its next band while it is still rendering the last one, so it never waits on the network
+    const int maxBandsOut = 2;
+    vector<Worker> workers;
+    vector<unique_ptr<QProcess>> processes;
+    QEventLoop loop;
+    bool failed = false;
+
+    auto feed = [&](int id) {
+        Worker &worker = workers[id];
+        while (worker.socket != nullptr && worker.joined && worker.bandsOut < maxBandsOut) {
+            int band = queue.take(id, Clock::now());
+            if (band < 0) {
+                break;
+            }
+            worker.socket->write(message([&](QDataStream &out) {
+                out << quint8(BandMessage) << queue.firstRow(band) << queue.endRow(band);
+            }));
+            worker.bandsOut++;
+        }
+    };
+    auto feedAll = [&] {
+        for (int id = 0; id < int(workers.size()); id++) {
+            feed(id);
+        }
+    };
+    // Without --listen no other workers can join, so the render fails once every local worker is gone
+    auto checkWorkersLeft = [&] {
+        if (!options.listen.isEmpty() || queue.finished() || failed) {
+            return;
+        }
+        for (const Worker &worker : workers) {
+            if (worker.socket != nullptr) {
+                return;
+            }
+        }
+        for (const auto &process : processes) {
+            if (process->state() != QProcess::NotRunning) {
+                return;
+            }
+        }
+        cerr << "Error: every worker left before the image was done" << endl;
+        failed = true;
+        loop.quit();
+    };
+    auto drop = [&](int id) {
+        Worker &worker = workers[id];
+        if (worker.socket == nullptr) {
+            return;
+        }
+        worker.socket->disconnect();
+        worker.socket->deleteLater();
+        worker.socket = nullptr;
+        queue.release(id);
+        feedAll();
+        checkWorkersLeft();
+    };
+    auto receive = [&](int id) {
+        Worker &worker = workers[id];
+        worker.received += worker.socket->readAll();
+        QByteArray payload;
+        while (worker.socket != nullptr) {
+            if (tooLong(worker.received, worker.joined ? maxRowsLength : maxControlLength)) {
+                cerr << "Dropping worker " << id << ", which sent an oversized message" << endl;
+                drop(id);
+                return;
+            }
+            if (!takeMessage(worker.received, payload)) {
+                return;
+            }
+            QDataStream in(payload);
+            in.setVersion(streamVersion);
+            quint8 type = 0;
+            if (!worker.joined) {
+                QString given;
+                in >> type >> given;
+                if (in.status() != QDataStream::Ok || type != HelloMessage || given != token) {
+                    cerr << "Dropping worker " << id << ", which didn't give the render's token" << endl;
+                    drop(id);
+                    return;
+                }
+                worker.joined = true;
+                worker.socket->write(job);
+                feed(id);
+                continue;
+            }
+            int y0 = 0, y1 = 0;
+            qint64 samples = 0, refinedPixels = 0, blurredPixels = 0;
+            QByteArray pixels;
+            in >> type >> y0 >> y1 >> samples >> refinedPixels >> blurredPixels >> pixels;
+            int band = y0 / max(1, options.bandRows);
+            if (in.status() != QDataStream::Ok || type != RowsMessage || y0 < 0 || band >= queue.bandCount() ||
+                y0 != queue.firstRow(band) || y1 != queue.endRow(band) || pixels.size() != qsizetype(width) * (y1 - y0) * qsizetype(sizeof(RGBA))) {
+                cerr << "Dropping worker " << id << ", which sent a malformed message" << endl;
+                drop(id);
+                return;
+            }
+            worker.bandsOut--;
+            if (queue.complete(band)) {
+                memcpy(imageData + size_t(y0) * width, pixels.constData(), size_t(pixels.size()));
+                stats.samples += samples;
+                stats.refinedPixels += refinedPixels;
+                stats.blurredPixels += blurredPixels;
+            }
+            if (queue.finished()) {
+                loop.quit();
+                return;
+            }
+            feed(id);
+        }
+    };
+
+    QObject::connect(&server, &QTcpServer::newConnection, &loop, [&] {
+        while (QTcpSocket *socket = server.nextPendingConnection()) {
+            int id = int(workers.size());
+            workers.push_back(Worker{socket});
+            QObject::connect(socket, &QTcpSocket::readyRead, &loop, [&, id] { receive(id); });
+            QObject::connect(socket, &QTcpSocket::disconnected, &loop, [&, id] { drop(id); });
+        }
+    });
+
+    QTimer stallCheck;
+    QObject::connect(&stallCheck, &QTimer::timeout, &loop, [&] {
+        if (queue.requeueStalled(Clock::now(), stallTimeout) > 0) {
+            feedAll();
+        }
+    });
+    stallCheck.start(1000);
+
+    // Local workers share the hardware threads unless told otherwise, and connect over loopback
+    int threads = options.threadsPerWorker > 0 ? options.threadsPerWorker :
+                  max(1, int(thread::hardware_concurrency()) / max(1, options.localWorkers));
+    QHostAddress listening = server.serverAddress();
+    if (listening == QHostAddress::Any || listening == QHostAddress::AnyIPv4 || listening == QHostAddress::AnyIPv6) {
+        listening = QHostAddress::LocalHost;
+    }
+    QString coordinator = listening.toString() + ":" + QString::number(server.serverPort());
+    for (int i = 0; i < options.localWorkers; i++) {
+        auto process = make_unique<QProcess>();
+        process->setProcessChannelMode(QProcess::ForwardedChannels);
+        QObject::connect(process.get(), &QProcess::finished, &loop, checkWorkersLeft);
+        QObject::connect(process.get(), &QProcess::errorOccurred, &loop, checkWorkersLeft);
+        process->start(QCoreApplication::applicationFilePath(), {"--worker", coordinator, "--threads", QString::number(threads),
+                                                                 "--token", token});
+        processes.push_back(std::move(process));
+    }
+
+    if (!queue.finished()) {
+        loop.exec();
+    }
+
+    // Hanging up tells the workers to exit; ones still rendering a band someone else finished first are stopped
+    stallCheck.stop();
+    server.disconnect();
+    server.close();
+    for (Worker &worker : workers) {
+        if (worker.socket != nullptr) {
+            worker.socket->disconnect();
+            worker.socket->abort();
+        }
+    }
+    for (auto &process : processes) {
+        process->disconnect();
+        if (!process->waitForFinished(10000)) {
+            process->kill();
+            process->waitForFinished();
+        }
+    }
+    return !failed;
+}
+
+int runRenderWorker(const QString &coordinator, int threads, const QString &token) {
+    QString host;
+    quint16 port;
+    if (!splitAddress(coordinator, host, port)) {
+        return 1;
+    }
+    QTcpSocket socket;
+    socket.connectToHost(host, port);
+    if (!socket.waitForConnected(30000)) {
+        cerr << "Error connecting to " << coordinator.toStdString() << ": " << socket.errorString().toStdString() << endl;
+        return 1;
+    }
+
+    socket.write(message([&](QDataStream &out) {
+        out << quint8(HelloMessage) << token;
+    }));
+
+    QByteArray received, payload;
+    bool oversized = false;
+    // Blocks until a whole message has arrived; false once the coordinator has hung up or sent too much
+    auto nextMessage = [&] {
+        while (true) {
+            received += socket.readAll();
+            if (tooLong(received, maxControlLength)) {
+                cerr << "Error: oversized message from " << coordinator.toStdString() << endl;
+                oversized = true;
+                return false;
+            }
+            if (takeMessage(received, payload)) {
+                return true;
+            }
+            if (!socket.waitForReadyRead(-1)) {
+                return false;
+            }
+        }
+    };
+
+    RenderData metaData;
+    unique_ptr<RayTraceScene> scene;
+    unique_ptr<RayTracer> raytracer;
+    while (nextMessage()) {
+        QDataStream in(payload);
+        in.setVersion(streamVersion);
+        quint8 type = 0;
+        in >> type;
+        if (type == JobMessage && scene == nullptr) {
+            QString sceneFile;
+            int width = 0, height = 0;
+            RayTracer::Config config;
+            in >> sceneFile >> width >> height >> config;
+            config.enableParallelism = threads != 1;
+            config.threadCount = threads;
+            if (in.status() != QDataStream::Ok || width <= 0 || height <= 0) {
+                cerr << "Error: malformed job from " << coordinator.toStdString() << endl;
+                return 1;
+            }
+            if (SceneParser::parse(sceneFile.toStdString(), metaData) != 0) {
+                cerr << "Error loading scene: \"" << sceneFile.toStdString() << "\"" << endl;
+                return 1;
+            }
+            scene = make_unique<RayTraceScene>(width, height, metaData);
+            raytracer = make_unique<RayTracer>(config);
+        } else if (type == BandMessage && scene != nullptr) {
+            int y0 = 0, y1 = 0;
+            in >> y0 >> y1;
+            if (in.status() != QDataStream::Ok || y0 < 0 || y1 <= y0 || y1 > scene->height()) {
+                cerr << "Error: malformed band from " << coordinator.toStdString() << endl;
+                return 1;
+            }
+            vector<RGBA> rows(size_t(scene->width()) * (y1 - y0));
+            RayTracer::Stats stats;
+            raytracer->renderRows(rows.data(), *scene, y0, y1, &stats);
+            socket.write(message([&](QDataStream &out) {
+                out << quint8(RowsMessage) << y0 << y1 << qint64(stats.samples) << qint64(stats.refinedPixels)
+                    << qint64(stats.blurredPixels) << QByteArray(reinterpret_cast<const char *>(rows.data()), qsizetype(rows.size() * sizeof(RGBA)));
+            }));
+            while (socket.bytesToWrite() > 0) {
+                if (!socket.waitForBytesWritten(-1)) {
+                    return 0;
+                }
+            }
+        } else {
+            cerr << "Error: unexpected message from " << coordinator.toStdString() << endl;
+            return 1;
+        }
+    }
+    return oversized ? 1 : 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "bandqueue.h"
+#include "raytracer/raytracer.h"
+
+#include <QString>
+
+using namespace std;
+
+// Splits one render across worker processes, on this machine or others, over TCP.
+//
+// The coordinator listens for workers and drops any that doesn't first give the render's token. It sends each
+// worker that does the scene file's path and the render settings once, then
+// hands out bands of rows and copies the bands they send back into the image. Workers load the scene when
+// they connect and render their bands with RayTracer::renderRows, so the image matches a local render
+// exactly. Workers on other machines must see the scene file (and its meshes and textures) at the same path.
+// The token only keeps out peers that don't know it: nothing is encrypted, so the token, the scene's path and
+// the image cross the network in the clear. Only listen on networks whose hosts are trusted.
+
+struct DistributedOptions {
+    int localWorkers = 0;  // worker processes to start on this machine
+    QString listen;        // host:port to accept workers on; a free loopback port when empty
+    int threadsPerWorker = 0; // threads of each local worker; 0 shares the hardware threads between them
+    int bandRows = 16;     // rows handed out at a time
+    double stallSeconds = 60.0; // how long a band may be out before it is handed to another worker too
+    QString token;         // workers have to give to join; a random one, which only local workers get, when empty
+};
+
+// Renders the scene on workers into imageData (width x height pixels), filling in stats' counts.
+// Returns false, after printing why, if the workers could not be reached or all left before the image was done.
+bool renderDistributed(const QString &sceneFile, int width, int height, const RayTracer::Config &config,
+                       const DistributedOptions &options, RGBA *imageData, RayTracer::Stats &stats);
+
+// Connects to the coordinator at host:port, gives it token, and renders the bands it hands out until it
+// disconnects. threads picks the worker's render threads like --threads does. Returns the process's exit code.
+int runRenderWorker(const QString &coordinator, int threads, const QString &token);
@@ -0,0 +1,285 @@
+#include "raytracer/raytracer.h"
+#include "raytracer/raytracescene.h"
+#include "raytracer/threadpool.h"
+#include "utils/sceneparser.h"
+#include "utils/stripedimagewriter.h"
+#ifdef RENDER_DISTRIBUTED
+#include "distributed.h"
+#endif
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+// Renders a scene file to an image without opening a window, for batches on headless machines.
+// Usage: cs1230-render <scene.xml> <output.png|output.ppm> [options]; see --help.
+// Shadows, reflections and texture maps are always rendered; the options turn on the rest.
+// Besides the image, writes the render's timings as JSON (to <output>.json unless --timing names a file).
+// With --band-rows, the image is rendered and written a band of rows at a time, so its size is not limited by memory.
+// With --workers or --listen, the render is split across worker processes (see distributed.h): --workers starts
+// them on this machine, and `cs1230-render --worker <host:port> --token <secret>` joins one from another machine
+// that listens with the same --token. Those options need a build configured with -DRENDER_DISTRIBUTED=ON.
+
+namespace {
+    double secondsSince(chrono::steady_clock::time_point start) {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Reads a non-negative integer option, or prints an error and returns false
+    bool readCount(const QCommandLineParser &parser, const QString &name, int &value) {
+        bool ok = false;
+        int parsed = parser.value(name).toInt(&ok);
+        if (!ok || parsed < 0) {
+            cerr << "Invalid --" << name.toStdString() << ": " << parser.value(name).toStdString() << endl;
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("cs1230-render");
+    QCoreApplication::setOrganizationName("CS 1230");
+    QCoreApplication::setApplicationVersion(QT_VERSION_STR);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Ray traces a scene file to an image, without a window.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("scene", "The scene file to render.");
+    parser.addPositionalArgument("output", "The image to write. Its suffix (.png or .ppm) picks the format.");
+    parser.addOptions({
+        {"width", "Image width in pixels.", "pixels", "800"},
+        {"height", "Image height in pixels.", "pixels", "600"},
+        {"threads", "Worker threads; 0 uses every hardware thread, 1 renders on the main thread.", "count", "0"},
+        {"tile-size", "Edge length in pixels of the tiles handed to workers.", "pixels", "16"},
+        {"simd-width", "Widest SIMD packets for primary rays; 0 picks the widest the CPU supports, 1 disables packets.", "rays", "0"},
+        {"max-samples", "Most samples per pixel taken by --super-sample.", "count", "16"},
+        {"max-lens-samples", "Most rays per pixel taken by --depth-of-field.", "count", "64"},
+        {"max-bounces", "Most reflected or refracted hits followed from each primary hit.", "count", "4"},
+        {"max-path-samples", "Most paths per pixel taken by --path-trace.", "count", "256"},
+        {"band-rows", "Render and write the image this many rows at a time, keeping two bands in memory; 0 renders it whole.", "rows", "0"},
+        {"workers", "Render in this many worker processes on this machine, each with --threads threads (default: a share of them).", "count", "0"},
+        {"listen", "Accept workers from other machines on this address, e.g. 0.0.0.0:5123.", "host:port"},
+        {"worker-rows", "Rows handed to a worker at a time.", "rows", "16"},
+        {"stall-timeout", "Seconds a worker may take over its rows before they are also handed to another worker.", "seconds", "60"},
+        {"worker", "Run as a worker of the render at host:port, instead of rendering a scene.", "host:port"},
+        {"token", "Secret a worker has to give to join the render; needed with --listen, which should only be used on trusted networks.", "secret"},
+        {"timing", "Where to write the timings as JSON (default: <output>.json).", "file"},
+        {"ray-stats", "Write a heatmap of the work done per pixel and print a table of ray counts (needs a RAYTRACER_STATS build).", "image"},
+        {"refraction", "Enable refraction."},
+        {"texture-filter", "Enable mip-mapped texture filtering."},
+        {"super-sample", "Enable adaptive supersampling."},
+        {"depth-of-field", "Enable thin-lens depth of field."},
+        {"path-trace", "Path trace with next-event estimation, sampling each pixel until it converges."},
+        {"light-culling", "Skip the lights too dim to change a pixel by a step, where many small lights overlap."},
+        {"no-acceleration", "Test every ray against every shape instead of using the BVH."},
+    });
+    parser.process(a);
+
+    if (parser.isSet("worker")) {
+#ifdef RENDER_DISTRIBUTED
+        int threads;
+        if (!readCount(parser, "threads", threads)) {
+            return 1;
+        }
+        return runRenderWorker(parser.value("worker"), threads, parser.value("token"));
+#else
+        cerr << "--worker needs a build configured with -DRENDER_DISTRIBUTED=ON" << endl;
+        return 1;
+#endif
+    }
+
+    QStringList arguments = parser.positionalArguments();
+    if (arguments.size() != 2) {
+        cerr << "Expected a scene file and an output image" << endl;
+        parser.showHelp(1);
+    }
+    QString sceneFile = arguments[0];
+    QString outputFile = arguments[1];
+    QString format = QFileInfo(outputFile).suffix().toLower();
+    if (format != "png" && format != "ppm") {
+        cerr << "Output must end in .png or .ppm: " << outputFile.toStdString() << endl;
+        return 1;
+    }
+
+    int width, height, threads, tileSize, simdWidth, maxSamples, maxLensSamples, maxBounces, maxPathSamples, bandRows, workers, workerRows,
+        stallTimeout;
+    if (!readCount(parser, "width", width) || !readCount(parser, "height", height) || !readCount(parser, "threads", threads) ||
+        !readCount(parser, "tile-size", tileSize) || !readCount(parser, "simd-width", simdWidth) ||
+        !readCount(parser, "max-samples", maxSamples) || !readCount(parser, "max-lens-samples", maxLensSamples) ||
+        !readCount(parser, "max-bounces", maxBounces) || !readCount(parser, "max-path-samples", maxPathSamples) ||
+        !readCount(parser, "band-rows", bandRows) ||
+        !readCount(parser, "workers", workers) || !readCount(parser, "worker-rows", workerRows) ||
+        !readCount(parser, "stall-timeout", stallTimeout)) {
+        return 1;
+    }
+    bool distributed = workers > 0 || parser.isSet("listen");
+#ifndef RENDER_DISTRIBUTED
+    if (distributed) {
+        cerr << "--workers and --listen need a build configured with -DRENDER_DISTRIBUTED=ON" << endl;
+        return 1;
+    }
+#endif
+    if (distributed && (bandRows > 0 || parser.isSet("ray-stats"))) {
+        cerr << "--band-rows and --ray-stats only work for renders on this process, not with --workers or --listen" << endl;
+        return 1;
+    }
+    if (bandRows > 0 && parser.isSet("ray-stats")) {
+        // The heatmap needs every pixel's counters, which would keep far more than two bands in memory
+        cerr << "--ray-stats needs the whole image in memory, so it doesn't work with --band-rows" << endl;
+        return 1;
+    }
+    if (parser.isSet("listen") && parser.value("token").isEmpty()) {
+        cerr << "--listen needs a --token, which workers on other machines have to give to join" << endl;
+        return 1;
+    }
+    if (parser.isSet("ray-stats") && !rayStatsEnabled) {
+        cerr << "--ray-stats needs a build configured with -DRAYTRACER_STATS=ON" << endl;
+        return 1;
+    }
+    if (width == 0 || height == 0) {
+        cerr << "The image must be at least one pixel wide and high" << endl;
+        return 1;
+    }
+
+    RayTracer::Config config{};
+    config.enableRefraction    = parser.isSet("refraction");
+    config.enableTextureFilter = parser.isSet("texture-filter");
+    config.enableParallelism   = threads != 1;
+    config.enableSuperSample   = parser.isSet("super-sample");
+    config.enableAcceleration  = !parser.isSet("no-acceleration");
+    config.enableDepthOfField  = parser.isSet("depth-of-field");
+    config.enablePathTracing   = parser.isSet("path-trace");
+    config.enableLightCulling  = parser.isSet("light-culling");
+    config.threadCount         = threads;
+    config.tileSize            = tileSize;
+    config.simdWidth           = simdWidth;
+    config.maxSamples          = maxSamples;
+    config.maxLensSamples      = maxLensSamples;
+    config.maxBounces          = maxBounces;
+    config.maxPathSamples      = maxPathSamples;
+
+    auto start = chrono::steady_clock::now();
+    RenderData metaData;
+    if (SceneParser::parse(sceneFile.toStdString(), metaData) != 0) {
+        cerr << "Error loading scene: \"" << sceneFile.toStdString() << "\"" << endl;
+        return 1;
+    }
+    double parseSeconds = secondsSince(start);
+
+    RayTracer::Stats stats;
+    double buildSeconds = 0.0, renderSeconds = 0.0, writeSeconds = 0.0;
+    if (distributed) {
+#ifdef RENDER_DISTRIBUTED
+        // The workers build the scene themselves, so its build time is part of the render time
+        DistributedOptions options;
+        options.localWorkers     = workers;
+        options.listen           = parser.value("listen");
+        options.threadsPerWorker = threads;
+        options.bandRows         = max(1, workerRows);
+        options.stallSeconds     = stallTimeout;
+        options.token            = parser.value("token");
+        QImage image = QImage(width, height, QImage::Format_RGBX8888);
+        image.fill(Qt::black);
+        start = chrono::steady_clock::now();
+        if (!renderDistributed(QFileInfo(sceneFile).absoluteFilePath(), width, height, config, options,
+                               reinterpret_cast<RGBA *>(image.bits()), stats)) {
+            return 1;
+        }
+        renderSeconds = secondsSince(start);
+
+        start = chrono::steady_clock::now();
+        if (!image.save(outputFile, format.toUpper().toLatin1().constData())) {
+            cerr << "Error saving image: \"" << outputFile.toStdString() << "\"" << endl;
+            return 1;
+        }
+        writeSeconds = secondsSince(start);
+#endif
+    } else if (bandRows > 0) {
+        start = chrono::steady_clock::now();
+        RayTraceScene scene{width, height, metaData};
+        buildSeconds = secondsSince(start);
+
+        // Bands are written while the next one renders, so the render time includes the writing
+        RayTracer raytracer{config};
+        StripedImageWriter writer(outputFile.toStdString(), width, height);
+        start = chrono::steady_clock::now();
+        bool written = writer.ok() && raytracer.renderStreamed(scene, bandRows, [&](const RGBA *rows, int y0, int y1) {
+            auto writeStart = chrono::steady_clock::now();
+            bool ok = writer.writeRows(rows, y1 - y0);
+            writeSeconds += secondsSince(writeStart);
+            return ok;
+        }, &stats);
+        if (!writer.finish() || !written) {
+            cerr << "Error saving image: \"" << outputFile.toStdString() << "\"" << endl;
+            return 1;
+        }
+        renderSeconds = secondsSince(start);
+    } else {
+        start = chrono::steady_clock::now();
+        RayTraceScene scene{width, height, metaData};
+        buildSeconds = secondsSince(start);
+
+        RayTracer raytracer{config};
+        QImage image = QImage(width, height, QImage::Format_RGBX8888);
+        image.fill(Qt::black);
+        RGBA *data = reinterpret_cast<RGBA *>(image.bits());
+        start = chrono::steady_clock::now();
+        raytracer.render(data, scene, &stats);
+        renderSeconds = secondsSince(start);
+
+        start = chrono::steady_clock::now();
+        if (!image.save(outputFile, format.toUpper().toLatin1().constData())) {
+            cerr << "Error saving image: \"" << outputFile.toStdString() << "\"" << endl;
+            return 1;
+        }
+        writeSeconds = secondsSince(start);
+    }
+
+    if (parser.isSet("ray-stats")) {
+        vector<RGBA> heatmap = rayCostHeatmap(stats.pixelRays);
+        QImage heatmapImage(reinterpret_cast<const uchar *>(heatmap.data()), width, height, QImage::Format_RGBX8888);
+        if (!heatmapImage.save(parser.value("ray-stats"))) {
+            cerr << "Error saving heatmap: \"" << parser.value("ray-stats").toStdString() << "\"" << endl;
+            return 1;
+        }
+        cout << rayStatsTable(stats.pixelRays, width);
+    }
+
+    QJsonObject timing{
+        {"scene", sceneFile},
+        {"output", outputFile},
+        {"width", width},
+        {"height", height},
+        {"bandRows", bandRows},
+        {"workers", workers},
+        {"threads", config.enableParallelism ? (threads > 0 ? threads : ThreadPool::shared().threadCount()) : 1},
+        {"parseSeconds", parseSeconds},
+        {"buildSeconds", buildSeconds},
+        {"renderSeconds", renderSeconds},
+        {"writeSeconds", writeSeconds},
+        {"primarySamples", double(stats.samples)},
+        {"samplesPerPixel", stats.samplesPerPixel()},
+        {"primaryRaysPerSecond", renderSeconds > 0 ? double(stats.samples) / renderSeconds : 0.0},
+    };
+    QString timingFile = parser.isSet("timing") ? parser.value("timing") : outputFile + ".json";
+    QFile file(timingFile);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        cerr << "Error writing timings: \"" << timingFile.toStdString() << "\"" << endl;
+        return 1;
+    }
+    file.write(QJsonDocument(timing).toJson());
+
+    cout << "Rendered " << sceneFile.toStdString() << " at " << width << "x" << height << " in " << renderSeconds << " s" << endl;
+    return 0;
+}
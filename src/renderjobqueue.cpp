@@ -0,0 +1,139 @@
+#include "renderjobqueue.h"
+#include "raytracer/raytracescene.h"
+#include "raytracer/accumulationbuffer.h"
+
+#include <algorithm>
+
+RenderJobQueue::RenderJobQueue(QObject *parent) :
+    QObject(parent)
+{
+    m_thread = std::thread([this] { run(); });
+}
+
+// Defined here, where RayTraceScene is complete
+RenderJobQueue::~RenderJobQueue() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        if (m_running != nullptr) {
+            m_running->cancelled = true;
+        }
+    }
+    m_wake.notify_all();
+    m_thread.join();
+}
+
+int RenderJobQueue::submit(Job job) {
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        id = m_nextId++;
+        m_pending.push_back(Pending{id, std::move(job)});
+    }
+    m_wake.notify_one();
+    return id;
+}
+
+void RenderJobQueue::cancel(int id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto pending = std::find_if(m_pending.begin(), m_pending.end(), [&](const Pending &entry) {
+        return entry.id == id;
+    });
+    if (pending != m_pending.end()) {
+        m_pending.erase(pending);
+    } else if (m_runningId == id && m_running != nullptr) {
+        m_running->cancelled = true;
+    }
+}
+
+void RenderJobQueue::cancelAll() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pending.clear();
+    if (m_running != nullptr) {
+        m_running->cancelled = true;
+    }
+}
+
+void RenderJobQueue::run() {
+    while (true) {
+        Pending next;
+        RayTracer::Progress progress;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&] {
+                return m_stopping || !m_pending.empty();
+            });
+            if (m_stopping) {
+                return;
+            }
+            // Highest priority first, and the earliest submitted among equals
+            auto first = std::min_element(m_pending.begin(), m_pending.end(), [](const Pending &a, const Pending &b) {
+                return a.job.priority != b.job.priority ? a.job.priority > b.job.priority : a.id < b.id;
+            });
+            next = std::move(*first);
+            m_pending.erase(first);
+            m_runningId = next.id;
+            m_running = &progress;
+        }
+
+        render(next.id, next.job, progress);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = nullptr;
+        m_runningId = 0;
+    }
+}
+
+// The scene of job, which is the last one traced seen through the job's camera when only the camera moved.
+// Loading textures and building the BVH can take a while, so it is done here rather than on submit.
+const RayTraceScene& RenderJobQueue::sceneFor(const Job &job) {
+    bool reusable = m_scene != nullptr && m_scene->getSnapshot().shares(job.scene) && m_scene->width() == job.width
+                    && m_scene->height() == job.height;
+    if (reusable) {
+        m_scene->setCamera(job.camera);
+    } else {
+        m_scene.reset();
+        m_scene = std::make_unique<RayTraceScene>(job.width, job.height, job.scene, job.camera);
+    }
+    return *m_scene;
+}
+
+// Traces job, emitting its tiles as they are done, until it is finished or cancelled
+void RenderJobQueue::render(int id, const Job &job, RayTracer::Progress &progress) {
+    const RayTraceScene &scene = sceneFor(job);
+    if (progress.cancelled) {
+        return;
+    }
+    RayTracer raytracer{job.config};
+    AccumulationBuffer buffer;
+
+    progress.tileDone = [&](int x0, int y0, int x1, int y1) {
+        QImage tile(x1 - x0, y1 - y0, QImage::Format_RGBX8888);
+        for (int j = y0; j < y1; j++) {
+            const AccumulationBuffer::Pixel *pixels = buffer.pixels() + size_t(j) * buffer.width();
+            RGBA *row = reinterpret_cast<RGBA *>(tile.scanLine(j - y0));
+            for (int i = x0; i < x1; i++) {
+                row[i - x0] = AccumulationBuffer::quantize(AccumulationBuffer::toneMap(pixels[i].mean()));
+            }
+        }
+        emit tileFinished(id, QRect(x0, y0, x1 - x0, y1 - y0), tile);
+    };
+
+    if (job.progressive) {
+        for (int blockSize = 8; blockSize > 1; blockSize /= 2) {
+            if (!raytracer.renderCoarse(buffer, scene, blockSize, &progress)) {
+                return;
+            }
+        }
+    }
+    // The full render keeps the preview's samples in buffer until it replaces them tile by tile, as the viewport
+    // keeps showing the preview until the full render's tiles arrive
+    if (!raytracer.render(buffer, scene, nullptr, job.primaryHits, &progress)) {
+        return;
+    }
+    for (int sample = 1; sample < job.samples; sample++) {
+        if (!raytracer.refine(buffer, scene, 1, nullptr, &progress)) {
+            return;
+        }
+    }
+}
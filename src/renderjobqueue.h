@@ -0,0 +1,83 @@
+#pragma once
+
+#include <QImage>
+#include <QObject>
+#include <QRect>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "raytracer/raytracer.h"
+#include "utils/scenesnapshot.h"
+
+class RayTraceScene;
+
+// Ray traces scenes in the background, so the UI stays responsive while an image is traced.
+// Jobs run one at a time on a thread that lives as long as the queue, and their tiles are spread over the
+// shared ThreadPool, so no thread is started per render. Pending jobs run highest priority first, then in the
+// order they were submitted. A job reports every tile as it is traced through tileFinished, which is emitted
+// from the job's thread and so queued to receivers on the UI thread.
+// The last scene traced is kept, so a job that only moves the camera starts tracing right away.
+
+class RenderJobQueue : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Job {
+        int width = 0;
+        int height = 0;
+        SceneSnapshot scene;
+        SceneCameraData camera;
+        RayTracer::Config config;
+        int priority = 0;
+
+        // Progressive jobs first trace a blocky preview, one pixel per 8x8 block, then per 4x4 and 2x2 block,
+        // before the full image. Every pass reports its tiles as it goes.
+        bool progressive = false;
+
+        // After the full image, a pass adds one jittered sample to every pixel (see RayTracer::refine) until
+        // every pixel has this many
+        int samples = 1;
+
+        // When not null, the primary hits are kept in it, so tracing the same view again only re-shades (see
+        // RayTracer::render). Jobs run one at a time, so several may share one, but nothing else may touch it
+        // while they are queued.
+        GBuffer *primaryHits = nullptr;
+    };
+
+    explicit RenderJobQueue(QObject *parent = nullptr);
+    ~RenderJobQueue();
+
+    // Queues job and returns the id the signals carry for it
+    int submit(Job job);
+
+    // Drops the job if it has not started yet, or stops it before its next tile
+    void cancel(int id);
+    void cancelAll();
+
+signals:
+    // Every pass of a job reports each tile it traces, so the last tile reported for a pixel is its best yet
+    void tileFinished(int id, QRect rect, QImage tile);
+
+private:
+    struct Pending {
+        int id = 0;
+        Job job;
+    };
+
+    void run();
+    void render(int id, const Job &job, RayTracer::Progress &progress);
+    const RayTraceScene& sceneFor(const Job &job);
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::vector<Pending> m_pending;
+    int m_nextId = 1;
+    int m_runningId = 0;
+    RayTracer::Progress *m_running = nullptr; // of the job running, while it does
+    bool m_stopping = false;
+    std::unique_ptr<RayTraceScene> m_scene; // the last one traced, only touched by the job thread
+    std::thread m_thread;
+};
@@ -15,7 +15,7 @@ void Mesh::unpackMesh(objl::Vertex vertex) {
     m_vertexData.push_back(vertex.Normal.Z);
 }
 
-std::vector<float> Mesh::generateShape(objl::Mesh meshData) {
+std::vector<float> Mesh::generateShape(const objl::Mesh &meshData) {
     int size = meshData.Vertices.size();
     for (int i = 0; size; i++) {
         if (i >= size) {
@@ -8,7 +8,7 @@ class Mesh
 {
 public:
     void init();
-    std::vector<float> generateShape(objl::Mesh meshData);
+    std::vector<float> generateShape(const objl::Mesh &meshData);
 
 
 private:
@@ -107,7 +107,7 @@ struct SceneMaterial {
    SceneFileMap textureMap; // Used for texture mapping
    float blend;             // Used for texture mapping
 
-   SceneColor cEmissive;    // Not used
+   SceneColor cEmissive;    // Only used by path tracing
    SceneFileMap bumpMap;    // Not used
 
    void clear() {
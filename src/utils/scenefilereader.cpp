@@ -112,11 +112,14 @@ bool ScenefileReader::readXML() {
    m_cameraData.up = glm::vec4(0.f, 1.f, 0.f, 0.f);
    m_cameraData.look = glm::vec4(-1.f, -1.f, -1.f, 0.f);
    m_cameraData.heightAngle = 45 * M_PI / 180.f;
+   m_cameraData.aperture = 0.f;
+   m_cameraData.focalLength = 0.f;
 
    // Default global data
    m_globalData.ka = 0.5f;
    m_globalData.kd = 0.5f;
    m_globalData.ks = 0.5f;
+   m_globalData.kt = 0.5f;
 
    // Iterate over child elements
    QDomNode childNode = scenefile.firstChild();
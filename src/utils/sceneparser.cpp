@@ -51,6 +51,7 @@ int SceneParser::parseMesh(std::string filepath, RenderData &renderData) {
     RenderShapeData mesh;
     mesh.meshData = loader.LoadedMeshes[0];
     mesh.primitive.type = PrimitiveType::PRIMITIVE_MESH;
+    mesh.primitive.meshfile = filepath;
     mesh.primitive.material.cAmbient = glm::vec4{loader.LoadedMeshes[0].MeshMaterial.Ka.X,
             loader.LoadedMeshes[0].MeshMaterial.Ka.Y, loader.LoadedMeshes[0].MeshMaterial.Ka.Z, 1};
     mesh.primitive.material.cDiffuse = glm::vec4{loader.LoadedMeshes[0].MeshMaterial.Kd.X,
@@ -0,0 +1,33 @@
+#include "scenesnapshot.h"
+
+SceneSnapshot::SceneSnapshot() :
+    m_data(std::make_shared<const RenderData>())
+{}
+
+SceneSnapshot::SceneSnapshot(RenderData renderData) :
+    m_data(std::make_shared<const RenderData>(std::move(renderData)))
+{}
+
+bool SceneSnapshot::empty() const {
+    return m_data->shapes.empty();
+}
+
+bool SceneSnapshot::shares(const SceneSnapshot &other) const {
+    return m_data == other.m_data;
+}
+
+const SceneGlobalData& SceneSnapshot::globalData() const {
+    return m_data->globalData;
+}
+
+const SceneCameraData& SceneSnapshot::cameraData() const {
+    return m_data->cameraData;
+}
+
+const std::vector<SceneLightData>& SceneSnapshot::lights() const {
+    return m_data->lights;
+}
+
+const std::vector<RenderShapeData>& SceneSnapshot::shapes() const {
+    return m_data->shapes;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "sceneparser.h"
+#include <memory>
+#include <vector>
+
+// An immutable, reference-counted copy of a loaded scene.
+// The realtime renderer and the ray tracer both read shapes and lights through a snapshot,
+// so handing the scene from one to the other (or to another thread) only bumps a reference count.
+class SceneSnapshot {
+public:
+    SceneSnapshot();
+    explicit SceneSnapshot(RenderData renderData);
+
+    bool empty() const;
+
+    // Whether both are copies of the same loaded scene
+    bool shares(const SceneSnapshot &other) const;
+
+    const SceneGlobalData& globalData() const;
+
+    // The camera as it was loaded from the scene file
+    const SceneCameraData& cameraData() const;
+
+    const std::vector<SceneLightData>& lights() const;
+
+    const std::vector<RenderShapeData>& shapes() const;
+
+private:
+    std::shared_ptr<const RenderData> m_data;
+};
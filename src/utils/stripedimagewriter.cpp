@@ -0,0 +1,144 @@
+#include "stripedimagewriter.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <iostream>
+
+namespace {
+    // The CRC-32 that ends every PNG chunk, over its type and data
+    uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+        static const std::array<uint32_t, 256> table = [] {
+            std::array<uint32_t, 256> entries;
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+                }
+                entries[n] = c;
+            }
+            return entries;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++) {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    void appendBigEndian(std::vector<uint8_t> &bytes, uint32_t value) {
+        bytes.insert(bytes.end(), {uint8_t(value >> 24), uint8_t(value >> 16), uint8_t(value >> 8), uint8_t(value)});
+    }
+
+    bool hasSuffix(const std::string &path, const std::string &suffix) {
+        if (path.size() < suffix.size()) {
+            return false;
+        }
+        return std::equal(suffix.rbegin(), suffix.rend(), path.rbegin(), [](char a, char b) {
+            return a == std::tolower(b);
+        });
+    }
+}
+
+StripedImageWriter::StripedImageWriter(const std::string &path, int width, int height) :
+    m_file(path, std::ios::binary | std::ios::trunc),
+    m_png(hasSuffix(path, ".png")),
+    m_width(width),
+    m_height(height)
+{
+    if (!m_file) {
+        std::cout << "Error creating image: \"" << path << "\"" << std::endl;
+        return;
+    }
+    if (!m_png) {
+        m_file << "P6\n" << width << " " << height << "\n255\n";
+        return;
+    }
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    m_file.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+    std::vector<uint8_t> header;
+    appendBigEndian(header, uint32_t(width));
+    appendBigEndian(header, uint32_t(height));
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bits per channel, RGB, deflate, no filtering, not interlaced
+    writeChunk("IHDR", header);
+    // The zlib header of a 32K window without a preset dictionary
+    writeChunk("IDAT", {0x78, 0x01});
+}
+
+bool StripedImageWriter::ok() const {
+    return bool(m_file);
+}
+
+bool StripedImageWriter::writeRows(const RGBA *pixels, int count) {
+    count = std::min(count, m_height - m_rowsWritten);
+    if (!m_file || count <= 0) {
+        return false;
+    }
+    // A filter byte of 0 (none) starts every PNG scanline
+    size_t rowBytes = size_t(m_width) * 3 + (m_png ? 1 : 0);
+    std::vector<uint8_t> rows;
+    rows.reserve(rowBytes * count);
+    for (int j = 0; j < count; j++) {
+        if (m_png) {
+            rows.push_back(0);
+        }
+        for (int i = 0; i < m_width; i++) {
+            const RGBA &pixel = pixels[size_t(j) * m_width + i];
+            rows.insert(rows.end(), {pixel.r, pixel.g, pixel.b});
+        }
+    }
+    m_rowsWritten += count;
+    if (!m_png) {
+        m_file.write(reinterpret_cast<const char *>(rows.data()), rows.size());
+        return bool(m_file);
+    }
+
+    // Adler-32 sums, reduced often enough that they never overflow
+    uint32_t a = m_adler & 0xffff, b = m_adler >> 16;
+    for (size_t start = 0; start < rows.size(); start += 5552) {
+        for (size_t i = start; i < std::min(rows.size(), start + 5552); i++) {
+            a += rows[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    m_adler = (b << 16) | a;
+
+    // Stored blocks hold at most 65535 bytes each
+    std::vector<uint8_t> blocks;
+    blocks.reserve(rows.size() + (rows.size() / 65535 + 1) * 5);
+    for (size_t start = 0; start < rows.size(); start += 65535) {
+        uint16_t length = uint16_t(std::min<size_t>(65535, rows.size() - start));
+        uint16_t complement = uint16_t(~length);
+        blocks.insert(blocks.end(), {0, uint8_t(length), uint8_t(length >> 8), uint8_t(complement), uint8_t(complement >> 8)});
+        blocks.insert(blocks.end(), rows.begin() + start, rows.begin() + start + length);
+    }
+    writeChunk("IDAT", blocks);
+    return bool(m_file);
+}
+
+bool StripedImageWriter::finish() {
+    if (m_png && m_file) {
+        // An empty final block ends the deflate stream, then the checksum ends the zlib stream
+        std::vector<uint8_t> end = {1, 0, 0, 0xff, 0xff};
+        appendBigEndian(end, m_adler);
+        writeChunk("IDAT", end);
+        writeChunk("IEND", {});
+    }
+    m_file.close();
+    if (m_rowsWritten != m_height) {
+        std::cout << "Error writing image: " << m_rowsWritten << " of " << m_height << " rows written" << std::endl;
+        return false;
+    }
+    return !m_file.fail();
+}
+
+void StripedImageWriter::writeChunk(const char *type, const std::vector<uint8_t> &data) {
+    std::vector<uint8_t> chunk;
+    chunk.reserve(data.size() + 12);
+    appendBigEndian(chunk, uint32_t(data.size()));
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    appendBigEndian(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+    m_file.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "rgba.h"
+
+// Writes an 8-bit RGB image to disk a band of rows at a time, top to bottom, so that images far larger than
+// memory can be saved as they are rendered. The format follows the file's suffix:
+//  - .ppm is a binary PPM (P6), whose rows simply follow its header.
+//  - .png gets one IDAT chunk per band. Its deflate stream is made of stored (uncompressed) blocks, which any
+//    PNG reader accepts and which need no compression library; the file is as large as the PPM would be.
+
+class StripedImageWriter {
+public:
+    // Creates path and writes the header of a width x height image
+    StripedImageWriter(const std::string &path, int width, int height);
+
+    // Whether the file could be created and every write so far succeeded
+    bool ok() const;
+
+    // Appends count rows of width pixels each. Alpha is dropped.
+    bool writeRows(const RGBA *pixels, int count);
+
+    // Writes what the format needs after the last row and closes the file.
+    // Fails if fewer rows than the image's height were written.
+    bool finish();
+
+private:
+    void writeChunk(const char *type, const std::vector<uint8_t> &data);
+
+    std::ofstream m_file;
+    bool m_png;
+    int m_width;
+    int m_height;
+    int m_rowsWritten = 0;
+    uint32_t m_adler = 1; // running Adler-32 of the PNG's raw scanlines, for the end of its zlib stream
+};